@@ -109,7 +109,7 @@ namespace MotorClient
                 string command = "quit";
 
                 await Task.Delay(100);
-                byte[] sendBytes = Encoding.ASCII.GetBytes(command);
+                byte[] sendBytes = Encoding.ASCII.GetBytes(command + "\n");
                 await messageStream.WriteAsync(sendBytes, 0, sendBytes.Length);
                 messageStream.Flush();
                 AddLineToCmdOutput($"<<CLIENT>>\tSent command \"{command}\" to server.");
@@ -141,7 +141,7 @@ namespace MotorClient
                         cmdQueue.RemoveAt(0);
 
                         await Task.Delay(100);
-                        byte[] sendBytes = Encoding.ASCII.GetBytes(command);
+                        byte[] sendBytes = Encoding.ASCII.GetBytes(command + "\n");
                         await messageStream.WriteAsync(sendBytes, 0, sendBytes.Length);
                         messageStream.Flush();
                         AddLineToCmdOutput($"<<CLIENT>>\tSent command \"{command}\" to server.");
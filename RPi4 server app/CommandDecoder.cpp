@@ -0,0 +1,57 @@
+#include "CommandDecoder.h"
+
+CommandDecoder::CommandDecoder() : discarding(false), dropped(0) {}
+
+/// Appends every command completed by 'data' to 'commands'.
+/// Empty commands (blank lines) are skipped.
+void CommandDecoder::feed(const char* data, size_t length, std::vector<std::string>& commands) {
+    const char* end = data + length;
+
+    const char* start = data;
+    for (const char* p = data; p < end; p++) {
+        if (*p != '\n' && *p != '\0') continue;
+
+        size_t partLength = p - start;
+        if (discarding || pending.size() + partLength > MAX_COMMAND_LENGTH) {
+            if (!discarding) dropped++;
+            discarding = false;
+            pending.clear();
+            start = p + 1;
+            continue;
+        }
+
+        if (pending.empty()) {
+            size_t n = partLength;
+            if (n > 0 && start[n - 1] == '\r') n--;
+            if (n > 0) commands.emplace_back(start, n);
+        }
+        else {
+            pending.append(start, partLength);
+            if (!pending.empty() && pending.back() == '\r') pending.pop_back();
+            if (!pending.empty()) commands.push_back(pending);
+            pending.clear();
+        }
+        start = p + 1;
+    }
+
+    // Keep the unterminated tail for the next read
+    size_t tail = end - start;
+    if (tail > 0 && !discarding) {
+        if (pending.size() + tail > MAX_COMMAND_LENGTH) {
+            dropped++;
+            discarding = true;
+            pending.clear();
+        }
+        else {
+            pending.append(start, tail);
+        }
+    }
+}
+
+size_t CommandDecoder::pendingBytes() const {
+    return pending.size();
+}
+
+size_t CommandDecoder::droppedCommands() const {
+    return dropped;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+constexpr size_t MAX_COMMAND_LENGTH = 4096;
+
+/// Splits a client byte stream into commands.
+/// A command ends with '\n' (a '\r' before it is dropped) or '\0', so one
+/// read may carry several commands and a command may span several reads.
+class CommandDecoder {
+private:
+	std::string pending;	// start of a command still waiting for its terminator
+	bool discarding;		// skipping an overlong command up to its terminator
+	size_t dropped;			// commands discarded for exceeding MAX_COMMAND_LENGTH
+
+public:
+	CommandDecoder();
+
+	void feed(const char* data, size_t length, std::vector<std::string>& commands);
+
+	size_t pendingBytes() const;
+	size_t droppedCommands() const;
+};
@@ -0,0 +1,243 @@
+#include "CommandParser.h"
+
+#include <charconv>
+#include <cstdlib>
+
+constexpr int MAX_ARGS = 2;
+constexpr size_t MAX_NUMBER_LENGTH = 32;
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t';
+}
+
+/// Splits off the next space separated token, empty when none is left
+static std::string_view nextToken(std::string_view& rest) {
+    size_t start = 0;
+    while (start < rest.size() && isSpace(rest[start])) start++;
+    size_t end = start;
+    while (end < rest.size() && !isSpace(rest[end])) end++;
+
+    std::string_view token = rest.substr(start, end - start);
+    rest.remove_prefix(end);
+    return token;
+}
+
+/// Parses a whole token as a float. A ',' decimal separator is accepted
+/// as well, since the client formats numbers in the user's locale.
+static bool parseNumber(std::string_view token, float& value) {
+    if (token.empty() || token.size() >= MAX_NUMBER_LENGTH) return false;
+
+    char buffer[MAX_NUMBER_LENGTH];
+    for (size_t i = 0; i < token.size(); i++) {
+        buffer[i] = token[i] == ',' ? '.' : token[i];
+    }
+    buffer[token.size()] = '\0';
+    const char* first = buffer[0] == '+' ? buffer + 1 : buffer;
+    const char* last = buffer + token.size();
+
+#if defined(__cpp_lib_to_chars)
+    std::from_chars_result result = std::from_chars(first, last, value);
+    return result.ec == std::errc() && result.ptr == last;
+#else
+    // Older standard libraries lack floating point from_chars
+    char* end = nullptr;
+    value = std::strtof(first, &end);
+    return end == last;
+#endif
+}
+
+/// Parses the id of a "@<id>" motor prefix; decimal digits only
+static bool parseMotorId(std::string_view token, uint8_t& motor) {
+    token.remove_prefix(1);
+    if (token.empty() || token.size() > 3) return false;
+
+    int value = 0;
+    for (char c : token) {
+        if (c < '0' || c > '9') return false;
+        value = value * 10 + (c - '0');
+    }
+    if (value > MAX_MOTOR_ID) return false;
+    motor = (uint8_t)value;
+    return true;
+}
+
+/// Parses a command of the form "[@motor] <name> [speed] [duration]"
+/// without allocating; the message is only viewed, never copied
+ParsedCommand parseCommand(std::string_view message) {
+    ParsedCommand parsed = { mCmd::none, 0, 0, parseOk, 0, 0, 0 };
+
+    std::string_view rest = message;
+    std::string_view name = nextToken(rest);
+    if (!name.empty() && name[0] == MOTOR_PREFIX) {
+        if (!parseMotorId(name, parsed.motor)) {
+            parsed.error = errInvalidMotor;
+            return parsed;
+        }
+        name = nextToken(rest);
+    }
+    if (name.empty()) {
+        parsed.error = errEmpty;
+        return parsed;
+    }
+
+    const CommandSpec* spec = findCommand(name);
+    if (!spec) {
+        parsed.error = errUnknownCommand;
+        return parsed;
+    }
+
+    if (spec->maxArgs == RAW_ARGS) {
+        std::string_view args = rest;
+        if (nextToken(args).empty()) {
+            parsed.error = errMissingArgument;
+            parsed.errorArg = 1;
+            return parsed;
+        }
+        parsed.cmd = spec->cmd;
+        parsed.argsOffset = (uint16_t)(rest.data() - message.data());
+        return parsed;
+    }
+
+    float args[MAX_ARGS] = { 0, 0 };
+    int argc = 0;
+    for (std::string_view token = nextToken(rest); !token.empty(); token = nextToken(rest)) {
+        if (argc >= spec->maxArgs) {
+            parsed.error = errTooManyArguments;
+            parsed.errorArg = argc + 1;
+            return parsed;
+        }
+        if (!parseNumber(token, args[argc])) {
+            parsed.error = errInvalidArgument;
+            parsed.errorArg = argc + 1;
+            return parsed;
+        }
+        argc++;
+    }
+    if (argc < spec->minArgs) {
+        parsed.error = errMissingArgument;
+        parsed.errorArg = argc + 1;
+        return parsed;
+    }
+
+    parsed.cmd = spec->cmd;
+    parsed.speed = args[0];
+    parsed.duration = args[1];
+    return parsed;
+}
+
+/// Describes a parse error for the client
+const char* parseErrorString(parseError error) {
+    switch (error) {
+    case parseOk:
+        return "OK";
+    case errEmpty:
+        return "Empty command";
+    case errUnknownCommand:
+        return "Unknown command";
+    case errMissingArgument:
+        return "Missing argument";
+    case errInvalidArgument:
+        return "Invalid argument";
+    case errTooManyArguments:
+        return "Too many arguments";
+    case errInvalidMotor:
+        return "Unknown motor";
+    default:
+        return "Unknown error";
+    }
+}
+
+//  PROGRAMS    ////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Parses one segment statement: CW|CCW <volts> <ms> or RPM <rpm> <ms>
+static const char* parseSegment(std::string_view name, std::string_view rest, ProgramSegment& segment) {
+    float value, durationMs;
+    if (!parseNumber(nextToken(rest), value) || !parseNumber(nextToken(rest), durationMs))
+        return "needs a speed and a duration";
+    if (!nextToken(rest).empty()) return "has too many arguments";
+    if (!(durationMs > 0.0f) || durationMs > MAX_SEGMENT_MS) return "duration out of range";
+
+    if (name == "RPM") {
+        if (!(value >= -MAX_SEGMENT_RPM && value <= MAX_SEGMENT_RPM)) return "rpm out of range";
+        segment.kind = segmentRpm;
+    }
+    else {
+        if (!(value >= 0.0f && value <= MAX_SEGMENT_VOLTS)) return "voltage out of range";
+        segment.kind = segmentVoltage;
+        if (name == "CCW") value = -value;
+    }
+    segment.value = value;
+    segment.durationNs = (int64_t)(durationMs * 1000000.0f);
+    return nullptr;
+}
+
+/// Parses and validates a motion program of ';' separated statements:
+///   CW <volts> <ms>, CCW <volts> <ms>, RPM <rpm> <ms>,
+///   LOOP <count> ... END around statements to repeat.
+/// Loops are unrolled and every segment gets its start time, so nothing
+/// is left to decide while the program runs.
+ProgramError parseProgram(std::string_view text, MotionProgram& program) {
+    struct OpenLoop {
+        size_t firstSegment;
+        int count;
+        int statement;
+    };
+    OpenLoop loops[MAX_PROGRAM_LOOP_DEPTH];
+    int depth = 0;
+    int statement = 0;
+
+    program.segments.clear();
+    program.totalNs = 0;
+
+    while (!text.empty()) {
+        size_t end = text.find(';');
+        std::string_view rest = text.substr(0, end);
+        text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+
+        std::string_view name = nextToken(rest);
+        if (name.empty()) continue;
+        statement++;
+
+        if (name == "LOOP") {
+            float count;
+            if (!parseNumber(nextToken(rest), count) || !nextToken(rest).empty()) return { "LOOP needs a count", statement };
+            if (!(count >= 1.0f && count <= MAX_PROGRAM_LOOP_COUNT) || count != (int)count) return { "loop count out of range", statement };
+            if (depth == MAX_PROGRAM_LOOP_DEPTH) return { "loops nested too deep", statement };
+            loops[depth++] = { program.segments.size(), (int)count, statement };
+        }
+        else if (name == "END") {
+            if (!nextToken(rest).empty()) return { "END takes no arguments", statement };
+            if (depth == 0) return { "END without LOOP", statement };
+
+            OpenLoop& loop = loops[--depth];
+            size_t first = loop.firstSegment;
+            size_t length = program.segments.size() - first;
+            if (length == 0) return { "empty loop", loop.statement };
+            if (program.segments.size() + length * (loop.count - 1) > (size_t)MAX_PROGRAM_SEGMENTS)
+                return { "too many segments", statement };
+            for (int pass = 1; pass < loop.count; pass++) {
+                for (size_t i = 0; i < length; i++) program.segments.push_back(program.segments[first + i]);
+            }
+        }
+        else if (name == "CW" || name == "CCW" || name == "RPM") {
+            ProgramSegment segment;
+            const char* reason = parseSegment(name, rest, segment);
+            if (reason) return { reason, statement };
+            if (program.segments.size() >= (size_t)MAX_PROGRAM_SEGMENTS) return { "too many segments", statement };
+            program.segments.push_back(segment);
+        }
+        else {
+            return { "unknown statement", statement };
+        }
+    }
+
+    if (depth > 0) return { "LOOP without END", loops[depth - 1].statement };
+    if (program.segments.empty()) return { "no segments", 0 };
+
+    for (ProgramSegment& segment : program.segments) {
+        segment.startNs = program.totalNs;
+        program.totalNs += segment.durationNs;
+    }
+    return { nullptr, 0 };
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "MotionProgram.h"
+
+#include <cstdint>
+#include <string_view>
+
+enum mCmd {
+    none = 0,
+    rotateCW,
+    rotateCCW,
+    SpdOn,
+    SpdOff,
+    Acc,
+    PwmInfo,
+    LatencyInfo,
+    RpmFilter,
+    rotateRpm,
+    Profile,
+    RtInfo,
+    MetricsInfo,
+    Stop,
+    EmergencyStop,
+    Program,
+    SimInfo,
+    PwmFrequency,
+    quit
+};
+
+enum parseError {
+    parseOk = 0,
+    errEmpty,
+    errUnknownCommand,
+    errMissingArgument,
+    errInvalidArgument,
+    errTooManyArguments,
+    errInvalidMotor
+};
+
+constexpr char MOTOR_PREFIX = '@';	// "@<id> CMD ..." addresses a motor, 0 by default
+constexpr int MAX_MOTOR_ID = 255;
+constexpr uint8_t RAW_ARGS = 0xFF;	// maxArgs of a command taking the rest of the line unparsed
+
+/// Result of parsing one command; speed and duration are 0 when not given
+struct ParsedCommand {
+    mCmd cmd;
+    float speed;
+    float duration;
+    parseError error;
+    uint8_t errorArg;	// 1-based argument the error refers to, 0 if none
+    uint8_t motor;		// addressed motor
+    uint16_t argsOffset;	// where the arguments of a RAW_ARGS command start in the message
+};
+
+/// Command name and the number of arguments it accepts
+struct CommandSpec {
+    std::string_view name;
+    mCmd cmd;
+    uint8_t minArgs;
+    uint8_t maxArgs;
+};
+
+constexpr CommandSpec COMMAND_TABLE[] = {
+    { "RCW",   mCmd::rotateCW,      2, 2 },
+    { "RCCW",  mCmd::rotateCCW,     2, 2 },
+    { "TSI",   mCmd::SpdOn,         0, 0 },
+    { "TSO",   mCmd::SpdOff,        0, 0 },
+    { "ACC",   mCmd::Acc,           1, 2 },
+    { "PWM",   mCmd::PwmInfo,       0, 0 },
+    { "LAT",   mCmd::LatencyInfo,   0, 0 },
+    { "FLT",   mCmd::RpmFilter,     2, 2 },
+    { "RPM",   mCmd::rotateRpm,     2, 2 },
+    { "PRF",   mCmd::Profile,       1, 1 },
+    { "RT",    mCmd::RtInfo,        0, 0 },
+    { "MET",   mCmd::MetricsInfo,   0, 0 },
+    { "STOP",  mCmd::Stop,          0, 0 },
+    { "ESTOP", mCmd::EmergencyStop, 0, 0 },
+    { "PROG",  mCmd::Program,       1, RAW_ARGS },
+    { "SIM",   mCmd::SimInfo,       0, 0 },
+    { "FRQ",   mCmd::PwmFrequency,  1, 2 },
+    { "quit",  mCmd::quit,          0, 0 },
+};
+
+/// Looks a command name up in COMMAND_TABLE, nullptr if unknown
+constexpr const CommandSpec* findCommand(std::string_view name) {
+    for (const CommandSpec& spec : COMMAND_TABLE) {
+        if (spec.name == name) return &spec;
+    }
+    return nullptr;
+}
+
+static_assert(findCommand("RCCW")->cmd == mCmd::rotateCCW, "command table lookup");
+static_assert(findCommand("rcw") == nullptr, "command names are case sensitive");
+
+ParsedCommand parseCommand(std::string_view message);
+const char* parseErrorString(parseError error);
+ProgramError parseProgram(std::string_view text, MotionProgram& program);
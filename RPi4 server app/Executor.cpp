@@ -0,0 +1,102 @@
+#include "Executor.h"
+#include "Logger.h"
+#include "Metrics.h"
+
+#include <chrono>
+
+Worker::Worker(const char* name, threadRole role) : name(name), role(role), busy(false), stopping(false) {}
+
+Worker::~Worker() {
+	shutdown();
+}
+
+/// Takes tasks one after the other until shut down
+void Worker::loop() {
+	applyThreadRole(role);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		changed.wait(lock, [this]() { return task || stopping; });
+		if (!task) break;
+
+		std::function<void()> work = std::move(task);
+		task = nullptr;
+		lock.unlock();
+		work();
+		lock.lock();
+
+		busy = false;
+		changed.notify_all();
+	}
+}
+
+/// Hands the worker a task, starting its thread the first time. Returns
+/// false while the previous task still runs or once the worker is shut down.
+bool Worker::run(std::function<void()> work) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (busy || stopping) return false;
+
+	busy = true;
+	task = std::move(work);
+	if (!thread.joinable()) {
+		thread = std::thread([this]() { this->loop(); });
+		metrics().threadsStarted.add();
+	}
+	changed.notify_all();
+	return true;
+}
+
+/// Blocks until the current task, if any, has returned
+void Worker::wait() {
+	std::unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [this]() { return !busy; });
+}
+
+/// As wait, giving up after 'timeoutMs'. Returns true once idle.
+bool Worker::waitFor(int timeoutMs) {
+	std::unique_lock<std::mutex> lock(mutex);
+	return changed.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]() { return !busy; });
+}
+
+bool Worker::isBusy() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return busy;
+}
+
+/// Lets the current task finish, then joins the thread. Tasks are
+/// refused from here on.
+void Worker::shutdown() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		changed.notify_all();
+	}
+	if (thread.joinable()) thread.join();
+}
+
+////////////////////////////////////////////////////////////////////////
+
+Executor::~Executor() {
+	shutdown([]() {});
+}
+
+Worker& Executor::add(const char* name, threadRole role) {
+	workers.push_back(std::make_unique<Worker>(name, role));
+	return *workers.back();
+}
+
+/// Joins every worker. The tasks must already have been told to return;
+/// 'wake' is called every EXECUTOR_NUDGE_MS until they have, for tasks
+/// asleep on a queue or a clock that the first wake-up missed.
+void Executor::shutdown(const std::function<void()>& wake) {
+	for (auto it = workers.rbegin(); it != workers.rend(); ++it) {
+		Worker& worker = **it;
+		int nudges = 0;
+		do {
+			wake();
+			if (++nudges == 1000 / EXECUTOR_NUDGE_MS) LOG_WARN(logServer, "Worker '%s' is slow to stop", worker.getName());
+		} while (!worker.waitFor(EXECUTOR_NUDGE_MS));
+		worker.shutdown();
+	}
+	workers.clear();
+}
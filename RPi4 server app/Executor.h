@@ -0,0 +1,58 @@
+#pragma once
+
+#include "RealTime.h"
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+constexpr int EXECUTOR_NUDGE_MS = 20;		// how often shutdown wakes workers that still run
+
+/// A long-lived, joinable thread that runs one task at a time. The thread
+/// starts with the first task and then waits for the next one, so starting
+/// and stopping a loop over and over creates no threads.
+class Worker {
+private:
+	const char* name;
+	threadRole role;
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::function<void()> task;		// handed over, not yet taken
+	bool busy;						// a task is handed over or running
+	bool stopping;
+
+	void loop();
+
+public:
+	Worker(const char* name, threadRole role);
+	~Worker();
+	Worker(const Worker&) = delete;
+	Worker& operator=(const Worker&) = delete;
+
+	bool run(std::function<void()> work);
+	void wait();
+	bool waitFor(int timeoutMs);
+	bool isBusy();
+	void shutdown();
+
+	const char* getName() const {
+		return name;
+	}
+};
+
+/// The server's workers. They are added while the server is set up and
+/// joined together, in the reverse order, when it shuts down.
+class Executor {
+private:
+	std::vector<std::unique_ptr<Worker>> workers;
+
+public:
+	~Executor();
+
+	Worker& add(const char* name, threadRole role);
+	void shutdown(const std::function<void()>& wake);
+};
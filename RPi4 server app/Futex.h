@@ -0,0 +1,35 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+
+/// Sleeps while 'word' still holds 'expected', at most timeoutMs (-1 waits forever)
+inline void futexWait(std::atomic<uint32_t>& word, uint32_t expected, int timeoutMs) {
+	timespec timeout;
+	timespec* timeoutPtr = nullptr;
+	if (timeoutMs >= 0) {
+		timeout.tv_sec = timeoutMs / 1000;
+		timeout.tv_nsec = (long)(timeoutMs % 1000) * 1000000;
+		timeoutPtr = &timeout;
+	}
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, timeoutPtr, nullptr, 0);
+}
+
+/// Sleeps while 'word' still holds 'expected', at most until the absolute
+/// CLOCK_MONOTONIC time 'deadlineNs'
+inline void futexWaitUntilNs(std::atomic<uint32_t>& word, uint32_t expected, int64_t deadlineNs) {
+	timespec deadline;
+	deadline.tv_sec = deadlineNs / 1000000000LL;
+	deadline.tv_nsec = deadlineNs % 1000000000LL;
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_BITSET_PRIVATE, expected, &deadline, nullptr, FUTEX_BITSET_MATCH_ANY);
+}
+
+/// Wakes up to 'count' threads sleeping on 'word'
+inline void futexWake(std::atomic<uint32_t>& word, int count) {
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
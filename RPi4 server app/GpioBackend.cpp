@@ -0,0 +1,31 @@
+#include "GpioBackend.h"
+
+#ifdef MOTOR_NO_WIRINGPI
+#include "SimGpioBackend.h"
+static SimGpioBackend defaultBackend;
+#else
+#include "WiringPiBackend.h"
+static WiringPiBackend defaultBackend;
+#endif
+
+static GpioBackend* activeBackend = &defaultBackend;
+
+/// Returns the backend all pin, interrupt and clock calls go through
+GpioBackend& gpio() {
+    return *activeBackend;
+}
+
+/// Replaces the active backend. Must be called before the server is created.
+void setGpioBackend(GpioBackend* backend) {
+    activeBackend = backend ? backend : &defaultBackend;
+}
+
+/// Milliseconds on the backend clock
+unsigned long GpioBackend::millis() {
+    return (unsigned long)(nowNs() / 1000000);
+}
+
+/// Sleeps for the given number of milliseconds on the backend clock
+void GpioBackend::delay(unsigned int ms) {
+    sleepUntilNs(nowNs() + (int64_t)ms * 1000000);
+}
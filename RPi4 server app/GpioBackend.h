@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+const int pinInput = 0;
+const int pinOutput = 1;
+
+const int pinLow = 0;
+const int pinHigh = 1;
+
+const int edgeRising = 2;
+
+/// Pin, interrupt and clock access used by the timing-critical paths.
+/// The values above match the wiringPi constants they replace.
+class GpioBackend {
+public:
+	virtual ~GpioBackend() {}
+
+	virtual int setup() = 0;
+
+	virtual void pinMode(int pin, int mode) = 0;
+	virtual void digitalWrite(int pin, int value) = 0;
+	virtual int digitalRead(int pin) = 0;
+	virtual int registerISR(int pin, int edge, void (*handler)()) = 0;
+
+	virtual int64_t nowNs() = 0;
+	virtual void sleepUntilNs(int64_t deadlineNs) = 0;
+	/// Sleeps until the deadline or until 'wake' no longer holds 'seen',
+	/// whichever comes first. May return early; callers check both again.
+	virtual void waitUntilNs(int64_t deadlineNs, std::atomic<uint32_t>& wake, uint32_t seen) = 0;
+
+	/// Setting a PWM channel was given; pin -1 is idle. For backends that
+	/// model what the pins drive.
+	virtual void pwmChanged(int channel, int pin, int64_t onNs, int64_t periodNs) {}
+
+	unsigned long millis();
+	void delay(unsigned int ms);
+};
+
+GpioBackend& gpio();
+void setGpioBackend(GpioBackend* backend);
@@ -0,0 +1,201 @@
+#include "Journal.h"
+#include "Logger.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+constexpr size_t JOURNAL_MIN_RECORDS = 64;
+
+static int64_t journalClockNs() {
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+Journal::Journal() : header(nullptr), records(nullptr), capacity(0), mappedSize(0), fd(-1) {}
+
+/// Only flushes: detached threads may still append while the process exits
+Journal::~Journal() {
+	sync();
+}
+
+//  FILE    ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Maps the journal file, creating or resizing it as needed. A file left
+/// by an earlier run with the same layout is continued where it stopped;
+/// anything else is cleared. Returns false and stays closed on failure.
+bool Journal::open(const std::string& path, size_t fileSize) {
+	close();
+
+	uint64_t slots = fileSize > JOURNAL_HEADER_SIZE ? (fileSize - JOURNAL_HEADER_SIZE) / sizeof(JournalRecord) : 0;
+	if (slots < JOURNAL_MIN_RECORDS) slots = JOURNAL_MIN_RECORDS;
+	size_t size = JOURNAL_HEADER_SIZE + slots * sizeof(JournalRecord);
+
+	int file = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (file < 0) {
+		LOG_ERROR(logServer, "Journal '%s' cannot be opened: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct stat info;
+	bool sameSize = fstat(file, &info) == 0 && (size_t)info.st_size == size;
+	if (!sameSize && ftruncate(file, (off_t)size) != 0) {
+		LOG_ERROR(logServer, "Journal '%s' cannot be sized: %s", path.c_str(), strerror(errno));
+		::close(file);
+		return false;
+	}
+
+	// Populated up front so the hot path never takes a page fault
+	void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, file, 0);
+	if (map == MAP_FAILED) {
+		LOG_ERROR(logServer, "Journal '%s' cannot be mapped: %s", path.c_str(), strerror(errno));
+		::close(file);
+		return false;
+	}
+
+	JournalHeader* mapped = (JournalHeader*)map;
+	bool reusable = sameSize && memcmp(mapped->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) == 0
+		&& mapped->version == JOURNAL_VERSION && mapped->recordSize == sizeof(JournalRecord)
+		&& mapped->capacity == slots;
+
+	if (!reusable) {
+		// The magic goes in last: a crash halfway leaves a file that is cleared again
+		memset(map, 0, size);
+		mapped->version = JOURNAL_VERSION;
+		mapped->recordSize = sizeof(JournalRecord);
+		mapped->capacity = slots;
+		mapped->nextSequence.store(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(mapped->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+	}
+
+	fd = file;
+	mappedSize = size;
+	capacity = slots;
+	header = mapped;
+	records = (JournalRecord*)((char*)map + JOURNAL_HEADER_SIZE);
+
+	LOG_INFO(logServer, "Journal '%s': %llu records%s", path.c_str(), (unsigned long long)slots,
+		reusable ? ", continued" : "");
+	return true;
+}
+
+/// Flushes the file to storage and unmaps it. Appends must have stopped.
+void Journal::close() {
+	if (!header) return;
+
+	msync(header, mappedSize, MS_SYNC);
+	munmap(header, mappedSize);
+	::close(fd);
+
+	header = nullptr;
+	records = nullptr;
+	capacity = 0;
+	mappedSize = 0;
+	fd = -1;
+}
+
+/// Writes the mapped pages back to storage now rather than when the kernel gets to them
+void Journal::sync() {
+	if (header) msync(header, mappedSize, MS_SYNC);
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//  EVENTS  ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Claims the next sequence and copies the record into its slot
+void Journal::append(JournalRecord& record) {
+	uint64_t sequence = header->nextSequence.fetch_add(1, std::memory_order_relaxed);
+	record.sequence = sequence;
+	record.check = (uint32_t)sequence;
+	record.timeNs = journalClockNs();
+	memcpy(&records[sequence % capacity], &record, sizeof(JournalRecord));
+}
+
+void Journal::rpm(int motor, float value) {
+	if (!records) return;
+
+	JournalRecord record = {};
+	record.type = journalRpm;
+	record.motor = (uint8_t)motor;
+	record.rpm = value;
+	append(record);
+}
+
+/// A pin of -1 records the output going idle
+void Journal::duty(int motor, int pin, int64_t onNs, int64_t periodNs) {
+	if (!records) return;
+
+	JournalRecord record = {};
+	record.type = journalDuty;
+	record.motor = (uint8_t)motor;
+	record.code = pin < 0 ? 0xFFFF : (uint16_t)pin;
+	record.duty.onNs = (uint32_t)onNs;
+	record.duty.periodNs = (uint32_t)periodNs;
+	append(record);
+}
+
+void Journal::command(journalCommandStage stage, int motor, int cmd, float speed, float duration) {
+	if (!records) return;
+
+	JournalRecord record = {};
+	record.type = journalCommand;
+	record.motor = (uint8_t)motor;
+	record.code = (uint16_t)((cmd & 0xFF) | (stage << 8));
+	record.command.speed = speed;
+	record.command.duration = duration;
+	append(record);
+}
+
+////////////////////////////////////////////////////////////////////////
+
+/// The process wide journal; closed, and so free to append to, until opened
+Journal& journal() {
+	static Journal instance;
+	return instance;
+}
+
+uint64_t journalRecordValid(const JournalRecord& record, uint64_t nextSequence, uint64_t capacity) {
+	if (record.sequence == 0 || record.check != (uint32_t)record.sequence) return 0;
+	if (record.sequence >= nextSequence) return 0;
+	if (nextSequence - record.sequence > capacity) return 0;
+	return record.sequence;
+}
+
+const char* journalEventName(uint8_t type) {
+	switch (type) {
+	case journalRpm:
+		return "rpm";
+	case journalDuty:
+		return "duty";
+	case journalCommand:
+		return "command";
+	default:
+		return "unknown";
+	}
+}
+
+const char* journalStageName(uint8_t stage) {
+	switch (stage) {
+	case cmdQueued:
+		return "queued";
+	case cmdRejected:
+		return "rejected";
+	case cmdStarted:
+		return "started";
+	case cmdCompleted:
+		return "completed";
+	case cmdCancelled:
+		return "cancelled";
+	default:
+		return "unknown";
+	}
+}
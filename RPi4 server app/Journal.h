@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+constexpr char JOURNAL_MAGIC[8] = { 'M', 'O', 'T', 'J', 'R', 'N', 'L', '1' };
+constexpr uint32_t JOURNAL_VERSION = 1;
+constexpr size_t JOURNAL_HEADER_SIZE = 4096;			// records start on the next page
+constexpr size_t JOURNAL_DEFAULT_SIZE = 8 * 1024 * 1024;	// file size, header included
+
+enum journalEvent : uint8_t {
+	journalRpm = 1,		// measured speed
+	journalDuty,		// PWM output setting changed
+	journalCommand		// command lifecycle step
+};
+
+enum journalCommandStage : uint8_t {
+	cmdQueued = 0,		// parsed and queued for its motor
+	cmdRejected,		// failed to parse
+	cmdStarted,			// taken by the motor's execution thread
+	cmdCompleted,
+	cmdCancelled		// ended or skipped by a stop
+};
+
+/// One journal entry. Fixed size so a slot is found by sequence alone.
+/// 'check' repeats the low half of 'sequence' at the far end of the
+/// record: a write torn by a crash leaves the two disagreeing.
+#pragma pack(push, 1)
+struct JournalRecord {
+	uint64_t sequence;		// 1-based, 0 for a slot never written
+	int64_t timeNs;			// CLOCK_REALTIME
+	uint8_t type;			// journalEvent
+	uint8_t motor;			// motor id, also the PWM channel
+	uint16_t code;			// duty: pin (0xFFFF idle); command: mCmd | stage << 8
+	union {
+		float rpm;
+		struct {
+			uint32_t onNs;
+			uint32_t periodNs;
+		} duty;
+		struct {
+			float speed;
+			float duration;
+		} command;
+	};
+	uint32_t check;			// (uint32_t)sequence
+};
+#pragma pack(pop)
+
+static_assert(sizeof(JournalRecord) == 32, "JournalRecord is a file format");
+
+/// First page of the journal file
+struct JournalHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	uint64_t capacity;						// record slots after the header
+	std::atomic<uint64_t> nextSequence;		// next sequence to hand out, in the file so it survives restarts
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the sequence counter lives in shared memory");
+static_assert(sizeof(JournalHeader) <= JOURNAL_HEADER_SIZE, "header fits its page");
+
+/// Fixed-size ring of events in a memory-mapped file. Appending claims a
+/// sequence with one atomic add and copies the record into its slot; the
+/// kernel writes the pages back, so the events of a crashed process are
+/// kept and memory use never grows. Old events are overwritten a lap later.
+class Journal {
+private:
+	JournalHeader* header;
+	JournalRecord* records;
+	uint64_t capacity;
+	size_t mappedSize;
+	int fd;
+
+	void append(JournalRecord& record);
+
+public:
+	Journal();
+	~Journal();
+
+	bool open(const std::string& path, size_t fileSize = JOURNAL_DEFAULT_SIZE);
+	void close();
+	void sync();
+	bool isOpen() const {
+		return records != nullptr;
+	}
+
+	void rpm(int motor, float value);
+	void duty(int motor, int pin, int64_t onNs, int64_t periodNs);
+	void command(journalCommandStage stage, int motor, int cmd, float speed, float duration);
+};
+
+Journal& journal();
+
+/// Sequence number of a record if it is complete and still in the ring,
+/// 0 otherwise
+uint64_t journalRecordValid(const JournalRecord& record, uint64_t nextSequence, uint64_t capacity);
+const char* journalEventName(uint8_t type);
+const char* journalStageName(uint8_t stage);
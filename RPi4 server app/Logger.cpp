@@ -0,0 +1,234 @@
+#include "Logger.h"
+#include "Futex.h"
+#include "RealTime.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <time.h>
+#include <unistd.h>
+
+static int64_t logClockNs() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/// Hands a thread's ring back for reuse when the thread exits
+struct RingOwner {
+	LogRing* ring = nullptr;
+	~RingOwner() {
+		if (ring) ring->owned.store(false, std::memory_order_release);
+	}
+};
+
+static thread_local RingOwner ringOwner;
+
+AsyncLogger::AsyncLogger() : ringCount(0), level(logInfo), dropped(0), written(0),
+	reportedDrops(0), running(false), wake(0) {
+	for (int i = 0; i < LOG_MAX_THREADS; i++) rings[i] = nullptr;
+}
+
+AsyncLogger::~AsyncLogger() {
+	stop();
+	// Rings stay allocated: exiting threads may still hold them
+}
+
+//	SETUP	////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Starts the sink thread; messages logged before are kept until then
+void AsyncLogger::start() {
+	if (running.exchange(true)) return;
+	sink = std::thread([this]() {
+		applyThreadRole(roleLogging);
+		this->sinkLoop();
+	});
+}
+
+/// Writes out everything still queued and stops the sink thread
+void AsyncLogger::stop() {
+	if (!running.exchange(false)) return;
+	wake.fetch_add(1);
+	futexWake(wake, 1);
+	if (sink.joinable()) sink.join();
+}
+
+///	Messages below 'minLevel' are skipped at runtime
+void AsyncLogger::setLevel(int minLevel) {
+	level = std::max((int)logTrace, std::min(minLevel, (int)logOff));
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//	WRITING	////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Returns the calling thread's ring, claiming a free one on first use
+LogRing* AsyncLogger::threadRing() {
+	if (ringOwner.ring) return ringOwner.ring;
+
+	std::lock_guard<std::mutex> lock(registerMutex);
+	int count = ringCount.load(std::memory_order_relaxed);
+	for (int i = 0; i < count; i++) {
+		bool expected = false;
+		if (rings[i]->owned.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+			ringOwner.ring = rings[i];
+			return ringOwner.ring;
+		}
+	}
+	if (count == LOG_MAX_THREADS) return nullptr;
+
+	LogRing* ring = new LogRing();
+	ring->owned.store(true, std::memory_order_relaxed);
+	rings[count] = ring;
+	ringCount.store(count + 1, std::memory_order_release);
+	ringOwner.ring = ring;
+	return ring;
+}
+
+/// Formats a message into the calling thread's ring. Never blocks on I/O.
+void AsyncLogger::write(logLevel msgLevel, logCategory category, const char* format, ...) {
+	LogRing* ring = threadRing();
+	if (!ring) {
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	size_t tail = ring->tail.load(std::memory_order_relaxed);
+	if (tail - ring->head.load(std::memory_order_acquire) >= LOG_RING_SIZE) {
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	LogRecord& record = ring->records[tail & (LOG_RING_SIZE - 1)];
+	record.timeNs = logClockNs();
+	record.level = (uint8_t)msgLevel;
+	record.category = (uint8_t)category;
+
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(record.text, LOG_TEXT_SIZE, format, args);
+	va_end(args);
+	record.length = (uint16_t)std::max(0, std::min(length, (int)LOG_TEXT_SIZE - 1));
+
+	ring->tail.store(tail + 1, std::memory_order_release);
+
+	// Errors and a filling ring are flushed now rather than on the next tick
+	if (msgLevel >= logWarn || tail + 1 - ring->head.load(std::memory_order_relaxed) >= LOG_RING_SIZE / 2) {
+		wake.fetch_add(1, std::memory_order_release);
+		futexWake(wake, 1);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//	SINK	////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Writes every queued record to stderr in time order; returns how many
+size_t AsyncLogger::drain() {
+	static const char* levelTags[] = { "", "", "", "WARNING: ", "ERROR: ", "" };
+	std::vector<const LogRecord*> batch;
+	std::vector<std::pair<LogRing*, size_t>> taken;
+
+	int count = ringCount.load(std::memory_order_acquire);
+	for (int i = 0; i < count; i++) {
+		LogRing* ring = rings[i];
+		size_t head = ring->head.load(std::memory_order_relaxed);
+		size_t tail = ring->tail.load(std::memory_order_acquire);
+		for (size_t pos = head; pos != tail; pos++) {
+			batch.push_back(&ring->records[pos & (LOG_RING_SIZE - 1)]);
+		}
+		taken.emplace_back(ring, tail);
+	}
+	uint64_t lost = dropped.load(std::memory_order_relaxed);
+	if (batch.empty() && lost == reportedDrops) return 0;
+
+	std::stable_sort(batch.begin(), batch.end(), [](const LogRecord* a, const LogRecord* b) {
+		return a->timeNs < b->timeNs;
+	});
+
+	std::string out;
+	out.reserve(batch.size() * 64);
+	for (const LogRecord* record : batch) {
+		out.append(logCategoryName((logCategory)record->category)).append(":\t")
+			.append(levelTags[record->level])
+			.append(record->text, record->length);
+		if (record->length == 0 || record->text[record->length - 1] != '\n') out.push_back('\n');
+	}
+
+	// Release the slots only once their text has been copied out
+	for (auto& entry : taken) {
+		entry.first->head.store(entry.second, std::memory_order_release);
+	}
+
+	if (lost > reportedDrops) {
+		out.append("LOG:\t").append(std::to_string(lost - reportedDrops)).append(" messages dropped\n");
+		reportedDrops = lost;
+	}
+
+	size_t done = 0;
+	while (done < out.size()) {
+		ssize_t n = ::write(STDERR_FILENO, out.data() + done, out.size() - done);
+		if (n <= 0) break;
+		done += n;
+	}
+	written.fetch_add(batch.size(), std::memory_order_relaxed);
+	return batch.size();
+}
+
+/// Drains the rings every LOG_FLUSH_MS, or sooner when woken
+void AsyncLogger::sinkLoop() {
+	while (running.load(std::memory_order_acquire)) {
+		uint32_t seen = wake.load(std::memory_order_acquire);
+		if (drain() == 0) futexWait(wake, seen, LOG_FLUSH_MS);
+	}
+	while (drain() > 0) {}
+}
+
+////////////////////////////////////////////////////////////////////////
+
+uint64_t AsyncLogger::getDropped() const {
+	return dropped.load(std::memory_order_relaxed);
+}
+
+uint64_t AsyncLogger::getWritten() const {
+	return written.load(std::memory_order_relaxed);
+}
+
+/// The process wide logger
+AsyncLogger& logger() {
+	static AsyncLogger instance;
+	return instance;
+}
+
+const char* logCategoryName(logCategory category) {
+	switch (category) {
+	case logServer:
+		return "SERVER";
+	case logParser:
+		return "PARSER";
+	case logCmdPro:
+		return "CMDPRO";
+	case logCmdExe:
+		return "CMDEXE";
+	case logMonitor:
+		return "MONITOR";
+	default:
+		return "LOG";
+	}
+}
+
+/// Accepts a level name or number, -1 if it is neither
+int parseLogLevel(const char* name) {
+	static const char* names[] = { "trace", "debug", "info", "warn", "error", "off" };
+	for (int i = logTrace; i <= logOff; i++) {
+		if (strcmp(name, names[i]) == 0) return i;
+	}
+	if (name[0] >= '0' && name[0] <= '5' && name[1] == '\0') return name[0] - '0';
+	return -1;
+}
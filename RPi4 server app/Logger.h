@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+enum logLevel {
+	logTrace = 0,
+	logDebug,
+	logInfo,
+	logWarn,
+	logError,
+	logOff
+};
+
+enum logCategory {
+	logServer = 0,
+	logParser,
+	logCmdPro,
+	logCmdExe,
+	logMonitor
+};
+
+// Levels below LOG_MIN_LEVEL compile to nothing, arguments included
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 1
+#endif
+
+constexpr size_t LOG_TEXT_SIZE = 232;		// longer messages are truncated
+constexpr size_t LOG_RING_SIZE = 256;		// records per thread, power of two
+constexpr int LOG_MAX_THREADS = 32;
+constexpr int LOG_FLUSH_MS = 20;			// sink wake-up period while idle
+
+/// One formatted message, written by its thread and read by the sink
+struct LogRecord {
+	int64_t timeNs;
+	uint8_t level;
+	uint8_t category;
+	uint16_t length;
+	char text[LOG_TEXT_SIZE];
+};
+
+/// Single producer, single consumer ring owned by one logging thread
+struct LogRing {
+	LogRecord records[LOG_RING_SIZE];
+	alignas(64) std::atomic<size_t> head;	// next record the sink reads
+	alignas(64) std::atomic<size_t> tail;	// next record the owner writes
+	std::atomic<bool> owned;				// a live thread writes to this ring
+
+	LogRing() : head(0), tail(0), owned(false) {}
+};
+
+/// Moves console output off the calling threads. A log call formats into
+/// the caller's own ring and returns; a sink thread drains all rings in
+/// time order and does the blocking writes. A full ring drops the message
+/// rather than stall the caller.
+class AsyncLogger {
+private:
+	LogRing* rings[LOG_MAX_THREADS];
+	std::atomic<int> ringCount;
+	std::mutex registerMutex;		// taken once per thread, on its first message
+
+	std::atomic<int> level;
+	std::atomic<uint64_t> dropped;
+	std::atomic<uint64_t> written;
+	uint64_t reportedDrops;			// sink thread only
+
+	std::thread sink;
+	std::atomic<bool> running;
+	std::atomic<uint32_t> wake;		// futex word, bumped to flush early
+
+	LogRing* threadRing();
+	size_t drain();
+	void sinkLoop();
+
+public:
+	AsyncLogger();
+	~AsyncLogger();
+
+	void start();
+	void stop();
+
+	void setLevel(int minLevel);
+	bool enabled(int msgLevel) const {
+		return msgLevel >= level.load(std::memory_order_relaxed);
+	}
+
+	void write(logLevel msgLevel, logCategory category, const char* format, ...)
+		__attribute__((format(printf, 4, 5)));
+
+	uint64_t getDropped() const;
+	uint64_t getWritten() const;
+};
+
+AsyncLogger& logger();
+const char* logCategoryName(logCategory category);
+int parseLogLevel(const char* name);
+
+#define LOG_AT(lvl, category, ...) \
+	do { if (logger().enabled(lvl)) logger().write(lvl, category, __VA_ARGS__); } while (0)
+
+#if LOG_MIN_LEVEL <= 0
+#define LOG_TRACE(category, ...) LOG_AT(logTrace, category, __VA_ARGS__)
+#else
+#define LOG_TRACE(category, ...) ((void)0)
+#endif
+#if LOG_MIN_LEVEL <= 1
+#define LOG_DEBUG(category, ...) LOG_AT(logDebug, category, __VA_ARGS__)
+#else
+#define LOG_DEBUG(category, ...) ((void)0)
+#endif
+#if LOG_MIN_LEVEL <= 2
+#define LOG_INFO(category, ...) LOG_AT(logInfo, category, __VA_ARGS__)
+#else
+#define LOG_INFO(category, ...) ((void)0)
+#endif
+#if LOG_MIN_LEVEL <= 3
+#define LOG_WARN(category, ...) LOG_AT(logWarn, category, __VA_ARGS__)
+#else
+#define LOG_WARN(category, ...) ((void)0)
+#endif
+#if LOG_MIN_LEVEL <= 4
+#define LOG_ERROR(category, ...) LOG_AT(logError, category, __VA_ARGS__)
+#else
+#define LOG_ERROR(category, ...) ((void)0)
+#endif
@@ -0,0 +1,150 @@
+#include "Metrics.h"
+
+#include <cstdio>
+
+constexpr int PROM_MIN_EXPONENT = 10;	// first exported bucket bound, 2^10 ns ~ 1 us
+
+LatencyHistogram::LatencyHistogram() : count(0), sumNs(0), maxNs(0) {
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		buckets[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+//  BUCKETS ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Bucket of a duration: values below HIST_SUB_BUCKETS map to themselves,
+/// larger ones to their power of two and the next HIST_SUB_BITS bits
+int LatencyHistogram::bucketIndex(int64_t ns) {
+	uint64_t value = (uint64_t)ns;
+	if (value < (uint64_t)HIST_SUB_BUCKETS) return (int)value;
+
+	int exponent = 63 - __builtin_clzll(value);
+	if (exponent > HIST_MAX_EXPONENT) return HIST_BUCKETS - 1;
+	int sub = (int)(value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+	return (exponent - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+/// First value above a bucket
+int64_t LatencyHistogram::bucketUpperNs(int index) {
+	if (index < HIST_SUB_BUCKETS) return index + 1;
+
+	int exponent = index / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+	int sub = index % HIST_SUB_BUCKETS;
+	int64_t width = 1LL << (exponent - HIST_SUB_BITS);
+	return (HIST_SUB_BUCKETS + sub + 1) * width;
+}
+
+/// Copies the counts; a record racing with the copy shows up in some
+/// fields and not yet in others
+void LatencyHistogram::snapshot(HistogramSnapshot& out) const {
+	out.count = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		out.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+		out.count += out.buckets[i];
+	}
+	out.sumNs = sumNs.load(std::memory_order_relaxed);
+	out.maxNs = maxNs.load(std::memory_order_relaxed);
+}
+
+/// Upper bound of the bucket holding the given fraction of the samples,
+/// capped at the largest value seen
+int64_t HistogramSnapshot::percentile(double fraction) const {
+	if (count == 0) return 0;
+
+	uint64_t rank = (uint64_t)(fraction * count);
+	if (rank >= count) rank = count - 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen > rank) {
+			int64_t upper = LatencyHistogram::bucketUpperNs(i) - 1;
+			return upper < maxNs ? upper : maxNs;
+		}
+	}
+	return maxNs;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//  REGISTRY    ////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+ServerMetrics& metrics() {
+	static ServerMetrics instance;
+	return instance;
+}
+
+const char* metricStageName(metricStage stage) {
+	switch (stage) {
+	case stageParse:
+		return "parse";
+	case stageQueue:
+		return "queue";
+	case stageActuation:
+		return "actuation";
+	case stageTotal:
+		return "total";
+	default:
+		return "unknown";
+	}
+}
+
+const char* metricQueueName(metricQueue queue) {
+	switch (queue) {
+	case queueMessage:
+		return "message";
+	case queueResponse:
+		return "response";
+	case queueSpeed:
+		return "speed";
+	case queueCommand:
+		return "command";
+	default:
+		return "unknown";
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//  PROMETHEUS  ////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Starts a metric family; its samples must follow before the next one
+void PrometheusWriter::family(const char* name, const char* type, const char* help) {
+	text.append("# HELP ").append(name).append(" ").append(help).append("\n");
+	text.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+void PrometheusWriter::sample(const char* name, const std::string& labels, double value) {
+	char number[32];
+	snprintf(number, sizeof(number), "%.15g", value);
+
+	text.append(name);
+	if (!labels.empty()) text.append("{").append(labels).append("}");
+	text.append(" ").append(number).append("\n");
+}
+
+/// Writes a histogram in seconds with one cumulative bucket per power of
+/// two from ~1 us up; the finer internal buckets only feed percentiles.
+/// The top power of two also holds every larger value, so it only counts
+/// towards +Inf.
+void PrometheusWriter::histogram(const char* name, const std::string& labels, const HistogramSnapshot& snapshot) {
+	std::string bucketName = std::string(name) + "_bucket";
+	std::string prefix = labels.empty() ? std::string() : labels + ",";
+	char bound[32];
+
+	uint64_t cumulative = 0;
+	int index = 0;
+	for (int exponent = PROM_MIN_EXPONENT; exponent < HIST_MAX_EXPONENT; exponent++) {
+		// Last bucket of this power of two
+		int last = (exponent - HIST_SUB_BITS + 2) * HIST_SUB_BUCKETS - 1;
+		for (; index <= last; index++) cumulative += snapshot.buckets[index];
+
+		snprintf(bound, sizeof(bound), "%g", LatencyHistogram::bucketUpperNs(last) / 1e9);
+		sample(bucketName.c_str(), prefix + "le=\"" + bound + "\"", (double)cumulative);
+	}
+	sample(bucketName.c_str(), prefix + "le=\"+Inf\"", (double)snapshot.count);
+	sample((std::string(name) + "_sum").c_str(), labels, snapshot.sumNs / 1e9);
+	sample((std::string(name) + "_count").c_str(), labels, (double)snapshot.count);
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+constexpr int HIST_SUB_BITS = 2;					// buckets per power of two = 1 << HIST_SUB_BITS
+constexpr int HIST_SUB_BUCKETS = 1 << HIST_SUB_BITS;
+constexpr int HIST_MAX_EXPONENT = 36;				// ~69 s, larger values land in the last bucket
+constexpr int HIST_BUCKETS = (HIST_MAX_EXPONENT - HIST_SUB_BITS + 2) * HIST_SUB_BUCKETS;
+constexpr int METRIC_CHANNELS = 3;					// message, speed and metrics connections
+constexpr int METRIC_MOTORS = 4;
+
+enum metricStage {
+	stageParse = 0,		// received -> parsed
+	stageQueue,			// parsed -> taken by the executor
+	stageActuation,		// taken -> first PWM edge
+	stageTotal,			// received -> first PWM edge
+	stageCount
+};
+
+enum metricQueue {
+	queueMessage = 0,
+	queueResponse,
+	queueSpeed,
+	queueCommand,
+	queueCount
+};
+
+/// Monotonic count that any thread may bump with one relaxed add
+class MetricCounter {
+private:
+	std::atomic<uint64_t> value;
+
+public:
+	MetricCounter() : value(0) {}
+
+	void add(uint64_t n = 1) {
+		value.fetch_add(n, std::memory_order_relaxed);
+	}
+	uint64_t get() const {
+		return value.load(std::memory_order_relaxed);
+	}
+};
+
+/// Last value and high-water mark of a level such as a queue depth.
+/// Plain stores only; with several writers the peak may miss a value
+/// that raced with a higher one.
+class MetricGauge {
+private:
+	std::atomic<int64_t> value;
+	std::atomic<int64_t> peak;
+
+public:
+	MetricGauge() : value(0), peak(0) {}
+
+	void set(int64_t v) {
+		value.store(v, std::memory_order_relaxed);
+		if (v > peak.load(std::memory_order_relaxed)) peak.store(v, std::memory_order_relaxed);
+	}
+	int64_t get() const {
+		return value.load(std::memory_order_relaxed);
+	}
+	int64_t getPeak() const {
+		return peak.load(std::memory_order_relaxed);
+	}
+};
+
+/// Copy of a histogram taken by a reader
+struct HistogramSnapshot {
+	uint64_t count;
+	int64_t sumNs;
+	int64_t maxNs;
+	uint64_t buckets[HIST_BUCKETS];
+
+	int64_t percentile(double fraction) const;
+	int64_t mean() const {
+		return count ? sumNs / (int64_t)count : 0;
+	}
+};
+
+/// Log-linear histogram of durations in ns: every power of two is split
+/// into HIST_SUB_BUCKETS, so a percentile is exact to within 25%.
+/// Each histogram has a single writing thread, which records with plain
+/// loads and stores - no read-modify-write, no lock, no retry - so the
+/// PWM thread and the edge ISR can record without ever being held up.
+/// Readers may snapshot at any time.
+class LatencyHistogram {
+private:
+	std::atomic<uint64_t> buckets[HIST_BUCKETS];
+	std::atomic<uint64_t> count;
+	std::atomic<int64_t> sumNs;
+	std::atomic<int64_t> maxNs;
+
+public:
+	LatencyHistogram();
+
+	static int bucketIndex(int64_t ns);
+	static int64_t bucketUpperNs(int index);
+
+	/// Adds one duration; only ever called from the owning thread
+	void record(int64_t ns) {
+		if (ns < 0) ns = 0;
+		std::atomic<uint64_t>& bucket = buckets[bucketIndex(ns)];
+		bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		sumNs.store(sumNs.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+		if (ns > maxNs.load(std::memory_order_relaxed)) maxNs.store(ns, std::memory_order_relaxed);
+	}
+
+	void snapshot(HistogramSnapshot& out) const;
+};
+
+/// Every metric the server keeps. Values that other modules already
+/// count (PWM periods and overruns, missed edges, log drops) are read
+/// from them when the metrics are reported rather than counted twice.
+struct ServerMetrics {
+	LatencyHistogram stageLatency[METRIC_MOTORS][stageCount];	// the motor's execution thread
+	LatencyHistogram pwmLateness;				// PWM engine thread: wake-up against edge deadline
+	LatencyHistogram edgeInterval[METRIC_MOTORS];	// the motor's edge ISR: time between magnet edges
+	LatencyHistogram stopLatency[METRIC_MOTORS];	// the motor's execution thread: STOP received -> output low
+
+	MetricGauge queueDepth[queueCount];
+	MetricCounter queueFull[queueCount];		// pushes refused or held back by a full queue
+
+	MetricCounter pwmUpdates;					// output settings published to the PWM engine
+	MetricCounter telemetrySamples;				// samples taken for the speed channel
+	MetricCounter telemetryDropped;				// samples lost to a full queue or backlog
+	MetricGauge telemetryStreams;				// distinct subscription streams
+	MetricGauge telemetrySubscribers;			// subscriptions over all streams
+	MetricCounter streamLinesDropped;			// subscription lines lost to a full backlog
+	MetricCounter multicastFrames;				// frames sent on the UDP telemetry channel
+	MetricCounter multicastDatagrams;
+	MetricCounter multicastDropped;				// frames the UDP socket did not take
+	MetricGauge sessions;						// client sessions, attached or waiting for RESUME
+	MetricGauge sessionsDetached;				// sessions whose connection dropped
+	MetricCounter sessionsResumed;
+	MetricCounter sessionsExpired;				// dropped and not resumed in time
+	MetricCounter responsesReplayed;			// responses and frames sent again on RESUME
+
+	MetricCounter commandsAccepted;
+	MetricCounter commandsRejected;				// failed to parse
+	MetricCounter commandsBusy;					// dropped, message or command queue full
+	MetricCounter commandsCancelled;			// ended or skipped by a stop
+
+	MetricCounter threadsStarted;				// worker threads, started once each
+
+	MetricCounter bytesSent[METRIC_CHANNELS];
+	MetricCounter bytesReceived[METRIC_CHANNELS];
+	MetricCounter connectionsOpened[METRIC_CHANNELS];
+	MetricCounter connectionsClosed[METRIC_CHANNELS];
+};
+
+ServerMetrics& metrics();
+
+const char* metricStageName(metricStage stage);
+const char* metricQueueName(metricQueue queue);
+
+/// Builds a Prometheus text exposition (format 0.0.4)
+class PrometheusWriter {
+private:
+	std::string text;
+
+public:
+	void family(const char* name, const char* type, const char* help);
+	void sample(const char* name, const std::string& labels, double value);
+	void histogram(const char* name, const std::string& labels, const HistogramSnapshot& snapshot);
+
+	const std::string& str() const {
+		return text;
+	}
+};
@@ -0,0 +1,66 @@
+#include "MotionPlanner.h"
+
+#include <cstdlib>
+
+MotionPlanner::MotionPlanner() : shape(profileTrapezoid) {
+	setAcceleration(10);
+}
+
+void MotionPlanner::setShape(profileShape newShape) {
+	shape = newShape;
+}
+
+profileShape MotionPlanner::getShape() const {
+	return shape;
+}
+
+/// Acceleration 1 - 10 as MotorController takes it: one power unit every
+/// (11 - acceleration) * 2 ms
+void MotionPlanner::setAcceleration(int acceleration) {
+	if (acceleration < 1) acceleration = 1;
+	if (acceleration > 10) acceleration = 10;
+	stepNs = (int64_t)(11 - acceleration) * 2 * 1000000;
+}
+
+/// Time a full ramp between two power levels takes
+int64_t MotionPlanner::rampNs(int fromPower, int toPower) const {
+	return (int64_t)std::abs(toPower - fromPower) * stepNs;
+}
+
+/// Fraction of an S-curve ramp done at time fraction u (smoothstep)
+static double sCurve(double u) {
+	return u * u * (3.0 - 2.0 * u);
+}
+
+/// Time fraction at which the S-curve reaches 'fraction'
+static double sCurveInverse(double fraction) {
+	double lo = 0.0, hi = 1.0;
+	for (int i = 0; i < 30; i++) {
+		double mid = (lo + hi) / 2;
+		if (sCurve(mid) < fraction) lo = mid;
+		else hi = mid;
+	}
+	return hi;
+}
+
+/// Fills 'points' with the duty steps from 'fromPower' to 'toPower'.
+/// Steps after 'durationNs' are left out; the segment ends where it got to.
+void MotionPlanner::plan(int fromPower, int toPower, int64_t durationNs, std::vector<ProfilePoint>& points) const {
+	points.clear();
+	int steps = std::abs(toPower - fromPower);
+	int direction = toPower > fromPower ? 1 : -1;
+	int64_t total = rampNs(fromPower, toPower);
+
+	for (int k = 1; k <= steps; k++) {
+		int64_t at;
+		if (shape == profileSCurve) {
+			// Level k is applied once the eased ramp has covered k - 1/2 steps
+			at = (int64_t)(sCurveInverse((k - 0.5) / steps) * total);
+		}
+		else {
+			at = (int64_t)(k - 1) * stepNs;
+		}
+		if (at >= durationNs) break;
+		points.push_back(ProfilePoint{ at, fromPower + direction * k });
+	}
+}
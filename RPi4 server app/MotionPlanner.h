@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+enum profileShape {
+	profileTrapezoid = 0,
+	profileSCurve
+};
+
+/// One duty change of a planned profile
+struct ProfilePoint {
+	int64_t atNs;	// from the start of the segment
+	int power;		// 0.1 V units; positive turns CW, negative CCW
+};
+
+/// Turns a power change into the list of duty steps that realise it.
+/// A trapezoid moves one power unit per acceleration step, as the motor
+/// always has; an S-curve takes the same time but eases in and out.
+/// Ramps between opposite signs pass through 0 without stopping.
+class MotionPlanner {
+private:
+	profileShape shape;
+	int64_t stepNs;		// time per power unit at the set acceleration
+
+public:
+	MotionPlanner();
+
+	void setShape(profileShape newShape);
+	profileShape getShape() const;
+	void setAcceleration(int acceleration);
+
+	int64_t rampNs(int fromPower, int toPower) const;
+	void plan(int fromPower, int toPower, int64_t durationNs, std::vector<ProfilePoint>& points) const;
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+constexpr int MAX_PROGRAM_SEGMENTS = 1024;		// after loops are unrolled
+constexpr int MAX_PROGRAM_LOOP_DEPTH = 4;
+constexpr int MAX_PROGRAM_LOOP_COUNT = 1000;
+constexpr float MAX_SEGMENT_MS = 600000.0f;
+constexpr float MAX_SEGMENT_VOLTS = 12.0f;
+constexpr float MAX_SEGMENT_RPM = 10000.0f;
+
+enum segmentKind {
+	segmentVoltage = 0,		// open loop ramp to a voltage
+	segmentRpm,				// closed loop at a measured speed
+	segmentKindCount
+};
+
+/// One step of a motion program, timed from the program start
+struct ProgramSegment {
+	segmentKind kind;
+	float value;			// volts or rpm; negative turns counter clockwise
+	int64_t startNs;
+	int64_t durationNs;
+};
+
+/// Validated program with its loops unrolled, so it runs as one flat list
+/// of absolute deadlines
+struct MotionProgram {
+	std::vector<ProgramSegment> segments;
+	int64_t totalNs = 0;
+};
+
+/// How far a segment's boundaries landed from the plan, ns
+struct SegmentTiming {
+	int64_t startErrorNs;	// first output of the segment against its planned start
+	int64_t endErrorNs;		// end of the segment against its planned end
+};
+
+/// Why a program was rejected; 'reason' is null for a valid program
+struct ProgramError {
+	const char* reason;
+	int statement;			// 1-based statement the reason refers to, 0 if none
+};
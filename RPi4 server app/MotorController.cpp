@@ -1,20 +1,41 @@
 #include "MotorController.h"
+#include "Futex.h"
+
+MotorController::MotorController(int motorId, const MotorPins& motorPins, PwmEngine& engine)
+    : id(motorId), pins(motorPins), lastPowerSet(0), lastDirection(motorPins.cw), acceleration(10),
+      pwmStep(0), lastControl(), cancelSerial(0), runSerial(0), motorMonitor(motorId, motorPins.sensor), pwmEngine(engine) {}
 
 /// Sets the pins and control variables
 int MotorController::setupController() {
     // Set the motor pins as an output
-    pinMode(motorCW, OUTPUT);
-    pinMode(motorCCW, OUTPUT);
+    gpio().pinMode(pins.cw, pinOutput);
+    gpio().pinMode(pins.ccw, pinOutput);
 
     lastPowerSet = 0;
-    lastDirection = motorCW;
+    lastDirection = pins.cw;
     acceleration = 10;
+    planner.setAcceleration(acceleration);
+    lastControl = {};
+    speedController.setGains({ 0.02f, 0.08f, 0.0f, maxSpeed / nominalMaxRpm, 0.0f, (float)maxSpeed, 0.5f });
+
+    setPwmTiming(dutyTable.getFrequency(), dutyTable.getBits());
+    profile.reserve(2 * maxSpeed + 1);
 
     motorMonitor.setupMonitor();
+    pwmEngine.start();
 
     return 0;
 }
 
+/// Motor id, also the PWM channel it is driven on
+int MotorController::getId() const {
+    return id;
+}
+
+const MotorPins& MotorController::getPins() const {
+    return pins;
+}
+
 ////////////////////////////////////////////////////////////////////////
 
 
@@ -24,58 +45,94 @@ int MotorController::setupController() {
 /// 'acceleration' setter
 void MotorController::setAcceleration(int accel) {
 	acceleration = accel;
+	planner.setAcceleration(accel);
 }
 
-/// PWM signal on/off time calculation 
+/// Selects trapezoidal (0) or S-curve (1) ramps
+void MotorController::setProfileShape(int shape) {
+	planner.setShape(shape == profileSCurve ? profileSCurve : profileTrapezoid);
+}
+
+/// Switches the motor's channel to another PWM frequency and duty
+/// resolution, rebuilding the tables once. A running motor keeps its
+/// power from its next period on. Returns false for a setting out of range.
+bool MotorController::setPwmTiming(int frequencyHz, int bits) {
+    if (!validPwmTiming(frequencyHz, bits)) return false;
+
+    dutyTable = DutyTable(frequencyHz, bits);
+    // Every power level the planner can ask for, mapped once
+    for (int power = 0; power <= maxSpeed; power++) {
+        levelStep[power] = (power * dutyTable.steps() + maxSpeed / 2) / maxSpeed;
+    }
+    if (lastPowerSet > 0) applyPower(signedPower());
+    return true;
+}
+
+const DutyTable& MotorController::getDutyTable() const {
+    return dutyTable;
+}
+
+/// Picks the duty step nearest to a fractional power level, so the speed
+/// controller gets the full resolution of the table
 void MotorController::calculatePWM(float speed) {
-    int T = (tick * 1000000);
-    float t = T / maxSpeed;
-    
-    pwmOnTime = speed > maxSpeed ? t * maxSpeed : t * speed;
-    pwmOffTime = T - pwmOnTime;
+    if (speed < 0) speed = 0;
+    if (speed > maxSpeed) speed = maxSpeed;
+    pwmStep = (int)std::lround(speed * dutyTable.steps() / maxSpeed);
 }
 
 /// PWM based powering logic
+/// Hands the on time of the chosen step to the PWM engine thread
 void MotorController::powerMotorPWM(int direction) {
-    std::chrono::microseconds onTime(pwmOnTime);
-    std::chrono::microseconds offTime(pwmOffTime);
+    pwmEngine.setOutputNs(id, direction, dutyTable.onNs(pwmStep), dutyTable.getPeriodNs());
+}
+
+/// Power currently applied; negative while turning counter clockwise
+int MotorController::signedPower() const {
+    return lastDirection == pins.ccw ? -lastPowerSet : lastPowerSet;
+}
 
-    digitalWrite(direction, HIGH);
-    auto start = std::chrono::high_resolution_clock::now();
-    while (std::chrono::high_resolution_clock::now() - start < onTime) {}
+/// Drives the motor at a signed power level from the precomputed table
+void MotorController::applyPower(int power) {
+    int level = power < 0 ? -power : power;
+    if (level > maxSpeed) level = maxSpeed;
+    if (power != 0) lastDirection = power < 0 ? pins.ccw : pins.cw;
 
-    digitalWrite(direction, LOW);
-    start = std::chrono::high_resolution_clock::now();
-    while (std::chrono::high_resolution_clock::now() - start < offTime) {}
+    lastPowerSet = level;
+    pwmEngine.setOutputNs(id, lastDirection, dutyTable.onNs(levelStep[level]), dutyTable.getPeriodNs());
 }
 
-/// Gradually accelerates the motor.
-void MotorController::accelerateMotor(int direction, float speed) {
-    motorMonitor.setMotorInMotion(true);
-    calculatePWM(speed);
-    unsigned long stepStartTime = millis();
-    while (stepStartTime + (11 - acceleration) * 2 > millis()) {
-        powerMotorPWM(direction);
+/// Sleeps until the deadline on the cancel serial, so a stop request ends
+/// the wait at once. Returns false if the command was cancelled.
+bool MotorController::waitUntil(int64_t deadlineNs) {
+    for (;;) {
+        uint32_t cancel = cancelSerial.load(std::memory_order_acquire);
+        if (runSerial < cancel) return false;
+        if (gpio().nowNs() >= deadlineNs) return true;
+        gpio().waitUntilNs(deadlineNs, cancelSerial, cancel);
     }
 }
 
-/// Gradually stops the motor. 
-int MotorController::stopMotor() {
-	int maxDuration = 2000;
-    int direction = lastDirection;
-    int speed = lastPowerSet;
-    if (speed == 0) return 0;
-    unsigned long startTime = millis();
+/// Gradually stops the motor. Returns 1 without finishing if 'interrupted'
+/// reports new work, so the next command can carry on from this speed.
+int MotorController::stopMotor(std::function<bool()> interrupted) {
+	int64_t maxDuration = 2000000000;
+    if (lastPowerSet == 0) {
+        pwmEngine.idle(id);
+        motorMonitor.setMotorInMotion(false);
+        return 0;
+    }
 
-    while (millis() - startTime < maxDuration) {
-        if (lastPowerSet > 0)
-            speed = --lastPowerSet;
-        else break;
+    planner.plan(signedPower(), 0, maxDuration, profile);
+    int64_t startTime = gpio().nowNs();
 
-        accelerateMotor(direction, speed);
+    for (const ProfilePoint& point : profile) {
+        if (!waitUntil(startTime + point.atNs)) return 1;
+        if (interrupted && interrupted()) return 1;
+        applyPower(point.power);
     }
 
-    digitalWrite(direction, LOW);
+    lastPowerSet = 0;
+    pwmEngine.idle(id);
     motorMonitor.setMotorInMotion(false);
 
     return 0;
@@ -83,41 +140,212 @@ int MotorController::stopMotor() {
 
 
 /// Turns the motor in the desired direction, at the set speed for the 
-/// set amount of time.
-/// direction   => should pass values: motorCW or motorCCW
+/// set amount of time. The ramp from the current power is planned up
+/// front; the motor keeps the reached power afterwards, so a following
+/// command blends on from there and only an empty queue stops it.
+/// Returns 1 if a stop request cancelled it on the way.
+/// direction   => should pass values: pins.cw or pins.ccw
 /// speed       => desired motor output speed, fixed to [0.0 - 12.0]
 /// mDuration   => desired duration in ms
 int MotorController::turnMotor(int direction, float desiredSpeed, float mDuration) {
-    unsigned long startTime = millis();
-    if (direction != lastDirection) {
-        stopMotor();
-    }
-    int speed = lastPowerSet;
+    int target = (int)desiredSpeed;
+    if (direction == pins.ccw) target = -target;
+    return driveTo(target, gpio().nowNs(), (int64_t)(mDuration * 1000000.0f));
+}
 
-    while (millis() - startTime < mDuration) {
-        if (lastPowerSet > desiredSpeed)
-            speed = --lastPowerSet;
-        else if (lastPowerSet < desiredSpeed)
-            speed = ++lastPowerSet;
+/// Ramps from the current power to a signed target as planned from
+/// 'startNs' and holds it until 'startNs' + 'durationNs'. Returns 1 if
+/// a stop request cancelled it on the way.
+int MotorController::driveTo(int target, int64_t startNs, int64_t durationNs) {
+    planner.plan(signedPower(), target, durationNs, profile);
+    motorMonitor.setMotorInMotion(true);
+    applyPower(signedPower());
 
-        accelerateMotor(direction, speed);
+    for (const ProfilePoint& point : profile) {
+        if (!waitUntil(startNs + point.atNs)) return 1;
+        applyPower(point.power);
     }
-    lastDirection = direction;
-
-    digitalWrite(direction, LOW);
-
-    return 0;
+    return waitUntil(startNs + durationNs) ? 0 : 1;
 }
 
 /// Turns the motor clockwise
 int MotorController::turnCW(float speed, float mDuration) {
     if (speed > 12.0f) speed = 12.0f;
-    return turnMotor(motorCW, std::round(speed * 10), mDuration);
+    return turnMotor(pins.cw, std::round(speed * 10), mDuration);
 }
 
 
 /// Turns the motor counter clockwise
 int MotorController::turnCCW(float speed, float mDuration) {
     if (speed > 12.0f) speed = 12.0f;
-    return turnMotor(motorCCW, std::round(speed * 10), mDuration);
+    return turnMotor(pins.ccw, std::round(speed * 10), mDuration);
+}
+
+/// Holds the motor at 'targetRpm' for 'mDuration' ms using the measured
+/// speed. The PID controller runs on a fixed CONTROL_TICK_MS tick against
+/// absolute deadlines; settling, overshoot and tick jitter are recorded.
+int MotorController::turnMotorRpm(int direction, float targetRpm, float mDuration) {
+    if (direction != lastDirection && stopMotor() != 0) {
+        return 1;
+    }
+    motorMonitor.startMeasuring();
+    int64_t start = gpio().nowNs();
+    int result = holdRpm(direction, targetRpm, start, start + (int64_t)(mDuration * 1000000.0f));
+    motorMonitor.stopMeasuring();
+
+    return result;
+}
+
+/// Runs the speed loop from 'startNs' to 'endNs'; the caller keeps the
+/// speed measured. Returns 1 if a stop request cancelled it.
+int MotorController::holdRpm(int direction, float targetRpm, int64_t startNs, int64_t endNs) {
+    if (targetRpm < 0) targetRpm = 0;
+    motorMonitor.setMotorInMotion(true);
+
+    // Start from the power already applied so a running motor is not jolted
+    const int64_t tickNs = (int64_t)CONTROL_TICK_MS * 1000000;
+    PidGains gains = speedController.getGains();
+    speedController.reset(lastPowerSet - gains.kff * targetRpm);
+
+    ControlRecorder recorder;
+    int64_t next = startNs;
+    recorder.begin(targetRpm, startNs);
+
+    bool cancelled = false;
+    while (next < endNs) {
+        if (!waitUntil(next)) {
+            cancelled = true;
+            break;
+        }
+        int64_t now = gpio().nowNs();
+        float measured = motorMonitor.getRpm();
+        recorder.tick(measured, now, now - next);
+
+        float power = speedController.update(targetRpm, measured, CONTROL_TICK_MS / 1000.0f);
+        calculatePWM(power);
+        powerMotorPWM(direction);
+        lastPowerSet = (int)std::round(power);
+
+        next += tickNs;
+        if (now > next) next = now;
+    }
+    lastDirection = direction;
+    lastControl = recorder.finish();
+
+    return cancelled ? 1 : 0;
+}
+
+/// Turns the motor at a measured speed; negative rpm turns counter clockwise
+int MotorController::turnRpm(float targetRpm, float mDuration) {
+    if (targetRpm < 0) return turnMotorRpm(pins.ccw, -targetRpm, mDuration);
+    return turnMotorRpm(pins.cw, targetRpm, mDuration);
+}
+
+/// Runs every segment of a program back to back against absolute
+/// deadlines from one start time, so a late segment does not shift the
+/// ones after it. Records where each segment's boundaries actually fell.
+/// Returns 1 if a stop request cancelled it.
+int MotorController::runProgram(const MotionProgram& program, std::vector<SegmentTiming>& timing) {
+    bool closedLoop = false;
+    for (const ProgramSegment& segment : program.segments) closedLoop |= segment.kind == segmentRpm;
+    if (closedLoop) motorMonitor.startMeasuring();
+
+    timing.assign(program.segments.size(), SegmentTiming{ 0, 0 });
+    int64_t start = gpio().nowNs();
+    int result = 0;
+
+    for (size_t i = 0; i < program.segments.size() && result == 0; i++) {
+        const ProgramSegment& segment = program.segments[i];
+        int64_t segmentStart = start + segment.startNs;
+        int64_t segmentEnd = segmentStart + segment.durationNs;
+        timing[i].startErrorNs = gpio().nowNs() - segmentStart;
+
+        if (segment.kind == segmentVoltage) {
+            result = driveTo((int)std::round(segment.value * 10), segmentStart, segment.durationNs);
+        }
+        else {
+            int direction = segment.value < 0 ? pins.ccw : pins.cw;
+            int64_t from = segmentStart;
+            if (direction != lastDirection && lastPowerSet > 0) {
+                // Reversing: ramp down to 0 within the segment, then close the loop
+                int64_t rampNs = std::min(planner.rampNs(signedPower(), 0), segment.durationNs);
+                result = driveTo(0, from, rampNs);
+                from += rampNs;
+            }
+            if (result == 0) result = holdRpm(direction, std::fabs(segment.value), from, segmentEnd);
+            if (result == 0 && !waitUntil(segmentEnd)) result = 1;
+        }
+        timing[i].endErrorNs = gpio().nowNs() - segmentEnd;
+    }
+
+    if (closedLoop) motorMonitor.stopMeasuring();
+    return result;
+}
+
+/// Replaces the closed loop gains
+void MotorController::setSpeedGains(const PidGains& gains) {
+    speedController.setGains(gains);
+}
+
+/// Returns how the last closed loop run went
+ControlStats MotorController::getControlStats() const {
+    return lastControl;
+}
+
+/// Returns the PWM engine timing statistics
+PwmStats MotorController::getPwmStats() const {
+    return pwmEngine.getStats();
+}
+
+/// Records the time of the next rising edge driven for this motor
+void MotorController::armEdgeCapture() {
+    pwmEngine.armEdgeCapture(id);
+}
+
+/// Returns the captured rising edge time, or 0 if none was driven yet
+int64_t MotorController::getCapturedEdge() const {
+    return pwmEngine.getCapturedEdge(id);
+}
+
+/// Returns the output this motor's PWM channel is driving
+PwmOutput MotorController::getOutput() const {
+    return pwmEngine.getOutput(id);
+}
+
+////////////////////////////////////////////////////////////////////////
+
+
+//  STOP    ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Marks the command about to run; a stop with a higher serial cancels it
+void MotorController::beginCommand(uint32_t serial) {
+    runSerial = serial;
+}
+
+/// Whether a command with this serial was received before the latest stop
+bool MotorController::isCancelled(uint32_t serial) const {
+    return serial < cancelSerial.load(std::memory_order_acquire);
+}
+
+/// Cuts the drive within a PWM period and cancels the running command and
+/// every one received before 'serial'. Safe from any thread; the
+/// execution thread finishes the stop with clearStop().
+void MotorController::requestStop(uint32_t serial) {
+    pwmEngine.halt(id);
+    cancelSerial.store(serial, std::memory_order_release);
+    futexWake(cancelSerial, 1);
+}
+
+/// Waits until the PWM engine has pulled the output low, at most until
+/// 'deadlineNs'; 'atNs' is when it did. Returns false if it has not.
+bool MotorController::waitStopApplied(int64_t deadlineNs, int64_t& atNs) {
+    return pwmEngine.waitHalt(id, deadlineNs, atNs);
+}
+
+/// Takes the halted motor as standing still and lets commands drive it again
+void MotorController::clearStop() {
+    lastPowerSet = 0;
+    motorMonitor.setMotorInMotion(false);
+    pwmEngine.release(id);
 }
@@ -1,37 +1,101 @@
 #include "MotorMonitor.h"
+#include "PwmEngine.h"
+#include "SpeedController.h"
+#include "MotionPlanner.h"
+#include "MotionProgram.h"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <vector>
 #include <cmath>
 #include <chrono>
 #include <thread>
 
-const int motorCW = 17;
+const int motorCW = 17;		// H-bridge inputs of the first motor
 const int motorCCW = 18;
 
+/// GPIO pins of one motor: the two H-bridge inputs and the magnet sensor
+struct MotorPins {
+	int cw;
+	int ccw;
+	int sensor;
+};
+
+const MotorPins defaultMotorPins = { motorCW, motorCCW, detectMagnet };
+
 const int maxSpeed = 120;  // equivalent 12V
+const float nominalMaxRpm = 3000.0f;  // unloaded speed at 12V, for feed-forward
 
-const int frequency = 1000; // Hz
-const float tick = 1.0 / frequency; // s
+static_assert(MAX_MOTORS <= PWM_MAX_CHANNELS, "every motor has its own PWM channel");
 
+/// Drives one motor through its own channel of a shared PWM engine.
+/// Directions are given as the motor's H-bridge pins.
 class MotorController {
 private:
+	int id;
+	MotorPins pins;
+	
 	int lastPowerSet;
 	int lastDirection;
 	int acceleration;
 	
-	int pwmOnTime, pwmOffTime;
+	DutyTable dutyTable;			// on times at the channel's frequency and resolution
+	int levelStep[maxSpeed + 1];	// duty step per power level
+	int pwmStep;
+	
+	SpeedController speedController;
+	ControlStats lastControl;
+	
+	MotionPlanner planner;
+	std::vector<ProfilePoint> profile;	// reused so planning does not allocate
+	
+	std::atomic<uint32_t> cancelSerial;	// futex word: commands with a lower serial are cancelled
+	uint32_t runSerial;					// serial of the command being executed
+	
+	int signedPower() const;
+	void applyPower(int power);
+	bool waitUntil(int64_t deadlineNs);
+	int driveTo(int target, int64_t startNs, int64_t durationNs);
+	int holdRpm(int direction, float targetRpm, int64_t startNs, int64_t endNs);
 
 public:
+	MotorController(int motorId, const MotorPins& motorPins, PwmEngine& engine);
+	
 	int setupController();
+	int getId() const;
+	const MotorPins& getPins() const;
 	
 	void setAcceleration(int accel);
 
+	bool setPwmTiming(int frequencyHz, int bits);
+	const DutyTable& getDutyTable() const;
+
 	void calculatePWM(float);
 	void powerMotorPWM(int direction);
-	void accelerateMotor(int direction, float speed);
-	int stopMotor();
+	void setProfileShape(int shape);
+	int stopMotor(std::function<bool()> interrupted = nullptr);
 	int turnMotor(int direction, float desiredSpeed, float mDuration);
 	int turnCW(float speed, float duration);
 	int turnCCW(float speed, float duration);
+	int turnMotorRpm(int direction, float targetRpm, float mDuration);
+	int turnRpm(float targetRpm, float duration);
+	int runProgram(const MotionProgram& program, std::vector<SegmentTiming>& timing);
+	
+	void setSpeedGains(const PidGains& gains);
+	ControlStats getControlStats() const;
+	PwmStats getPwmStats() const;
+	
+	void armEdgeCapture();
+	int64_t getCapturedEdge() const;
+	PwmOutput getOutput() const;
+	
+	void beginCommand(uint32_t serial);
+	bool isCancelled(uint32_t serial) const;
+	void requestStop(uint32_t serial);
+	bool waitStopApplied(int64_t deadlineNs, int64_t& atNs);
+	void clearStop();
 	
 	MotorMonitor motorMonitor;
+	PwmEngine& pwmEngine;		// shared by every motor; this one drives channel 'id'
 
 };
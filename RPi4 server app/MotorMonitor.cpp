@@ -1,10 +1,35 @@
 #include "MotorMonitor.h"
 
-MotorMonitor* MotorMonitor::instance = nullptr;
+#include "Logger.h"
+#include "RealTime.h"
+#include "Metrics.h"
+#include "Journal.h"
 
-MotorMonitor::MotorMonitor() : detectMagnetRE(false) {
-	instance = this;
-	setupMonitor();
+#include <algorithm>
+
+std::atomic<MotorMonitor*> MotorMonitor::instances[MAX_MOTORS];
+
+// wiringPi handlers take no argument, so each slot gets its own entry point
+void (*const MotorMonitor::edgeWrappers[MAX_MOTORS])() = {
+	&MotorMonitor::edgeDetectWrapper<0>, &MotorMonitor::edgeDetectWrapper<1>,
+	&MotorMonitor::edgeDetectWrapper<2>, &MotorMonitor::edgeDetectWrapper<3>,
+};
+static_assert(MAX_MOTORS == 4, "one edge wrapper per motor");
+
+MotorMonitor::MotorMonitor(int motorId, int pin) : measure(false), motorInMotion(false), edgeTimes(EDGE_RING_SIZE),
+	missedEdges(0), filterMode(filterAverage), filterWindow(4), pulsesPerRevolution(defaultPulsesPerRevolution), rpm(0.0f), lastEdgeNs(0),
+	id(motorId), sensorPin(pin), measureWorker("monitor", roleMonitor), measureUsers(0) {
+	MotorMonitor* expected = nullptr;
+	if (id < 0 || id >= MAX_MOTORS || !instances[id].compare_exchange_strong(expected, this)) {
+		LOG_ERROR(logMonitor, "No edge interrupt slot for motor %d, its speed will read 0", id);
+		id = -1;
+	}
+}
+
+MotorMonitor::~MotorMonitor() {
+	stopMeasuringSpeed();
+	measureWorker.shutdown();
+	if (id >= 0) instances[id] = nullptr;
 }
 
 //	SETUP	////////////////////////////////////////////////////////////
@@ -12,21 +37,33 @@ MotorMonitor::MotorMonitor() : detectMagnetRE(false) {
 
 /// Set up pins and control variables
 void MotorMonitor::setupMonitor() {	
-	pinMode(detectMagnet, INPUT);
-	wiringPiISR(detectMagnet, INT_EDGE_RISING, &MotorMonitor::edgeDetectWrapper);
+	gpio().pinMode(sensorPin, pinInput);
+	if (id >= 0) gpio().registerISR(sensorPin, edgeRising, edgeWrappers[id]);
 
-	detectMagnetRE = false;
 	measure = false;
 	motorInMotion = false;
 }
 
 /// Rising edge handle function
+/// Only timestamps the edge; the measuring thread does the maths
 void MotorMonitor::handleEdgeDetect() {
-	detectMagnetRE.store(true);
+	// The interrupt thread belongs to wiringPi; give it the monitor's CPU once
+	static thread_local bool roleApplied = (applyThreadRole(roleMonitor), true);
+	(void)roleApplied;
+
+	int64_t now = gpio().nowNs();
+	if (lastEdgeNs > 0) metrics().edgeInterval[id].record(now - lastEdgeNs);
+	lastEdgeNs = now;
+
+	if (!edgeTimes.push(now)) {
+		missedEdges.fetch_add(1, std::memory_order_relaxed);
+	}
 }
 
-///	Rising edge wrapper function
+///	Rising edge wrapper function of one monitor slot
+template <int slot>
 void MotorMonitor::edgeDetectWrapper() {
+	MotorMonitor* instance = instances[slot].load(std::memory_order_acquire);
 	if(instance) {
 		instance -> handleEdgeDetect();
 	}
@@ -42,31 +79,143 @@ void MotorMonitor::setMotorInMotion(bool value) {
 void MotorMonitor::setMeasure(bool value) {
 	measure = value;
 }
+///	Selects the period filter, applied from the next edge on
+void MotorMonitor::setFilter(int mode, int window) {
+	if (mode < filterNone || mode > filterMedian) mode = filterAverage;
+	filterMode = mode;
+	filterWindow = std::max(1, std::min(window, MAX_FILTER_WINDOW));
+}
+///	Sensor edges per turn, 1 - MAX_PULSES_PER_REVOLUTION. Returns false if out of range.
+bool MotorMonitor::setPulsesPerRevolution(int pulses) {
+	if (pulses < 1 || pulses > MAX_PULSES_PER_REVOLUTION) return false;
+	pulsesPerRevolution = pulses;
+	return true;
+}
+///	Edges lost because the ring was full
+uint64_t MotorMonitor::getMissedEdges() const {
+	return missedEdges.load(std::memory_order_relaxed);
+}
+///	Latest measured speed, 0 while not measuring
+float MotorMonitor::getRpm() const {
+	return rpm.load(std::memory_order_relaxed);
+}
+
+/// Starts measuring for a new user. Telemetry and closed loop control
+/// both need the speed; the measuring loop runs while either does.
+void MotorMonitor::startMeasuring() {
+	std::lock_guard<std::mutex> lock(measureMutex);
+	if (measureUsers++ > 0) return;
 
-/// Measures the time between 2 rising edges on the detection pin
-/// Sets the 'rpm' variable accordingly
-void MotorMonitor::measureSpeed(float* rpm) {
-	unsigned long lastHit = millis();
-	unsigned long hitTime;
+	measureWorker.wait();
 	measure = true;
+	measureWorker.run([this]() { this->measureSpeed(); });
+}
+
+/// Releases one user; the last one stops the measuring loop and waits for it
+void MotorMonitor::stopMeasuring() {
+	std::lock_guard<std::mutex> lock(measureMutex);
+	if (measureUsers == 0 || --measureUsers > 0) return;
+
+	stopMeasuringSpeed();
+	measureWorker.wait();
+}
+
+/// Derives the speed from the exact period between rising edges on the
+/// detection pin and publishes it to 'rpm'. Sleeps until the ISR
+/// delivers an edge; a sensor that stays silent decays the speed to 0.
+void MotorMonitor::measureSpeed() {
+	PeriodFilter filter;
+	int mode = filterMode;
+	int window = filterWindow;
+	filter.configure((rpmFilter)mode, window);
+
+	int64_t lastHit = 0;
+	int64_t hitTime;
+	rpm = 0.0f;
+
+	// Edges from before the measurement started say nothing about now
+	while (edgeTimes.tryPop(hitTime)) {}
 	
 	while (measure) {
-		if (!motorInMotion) {
-			*rpm = 0.0f;
+		if (mode != filterMode || window != filterWindow) {
+			mode = filterMode;
+			window = filterWindow;
+			filter.configure((rpmFilter)mode, window);
 		}
-		else if (detectMagnetRE) {
-			detectMagnetRE = false;
-			hitTime = millis();
-			*rpm = (1000.0f / (hitTime - lastHit)) * 60.0f;
+
+		if (edgeTimes.waitPop(hitTime, EDGE_WAIT_MS)) {
+			if (motorInMotion && lastHit > 0 && hitTime > lastHit) {
+				int64_t period = filter.add(hitTime - lastHit);
+				float measured = 60.0e9f / (period * pulsesPerRevolution.load(std::memory_order_relaxed));
+				rpm.store(measured, std::memory_order_relaxed);
+				journal().rpm(id, measured);
+			}
 			lastHit = hitTime;
 		}
-
-		delay(1);
+		
+		if (!motorInMotion) {
+			if (rpm.exchange(0.0f, std::memory_order_relaxed) != 0.0f) journal().rpm(id, 0.0f);
+			filter.reset();
+			lastHit = 0;
+		}
+		else if (lastHit > 0) {
+			// No edge yet: the speed is at most one turn per elapsed time
+			int64_t silent = gpio().nowNs() - lastHit;
+			if (silent >= STALL_NS) {
+				if (rpm.exchange(0.0f, std::memory_order_relaxed) != 0.0f) journal().rpm(id, 0.0f);
+				filter.reset();
+			}
+			else if (silent > 0) {
+				float bound = 60.0e9f / (silent * pulsesPerRevolution.load(std::memory_order_relaxed));
+				if (bound < rpm.load(std::memory_order_relaxed))
+					rpm.store(bound, std::memory_order_relaxed);
+			}
+		}
 	}
-	std::cerr << "MONITOR STOP MEASURE\n";
+	rpm = 0.0f;
+	LOG_DEBUG(logMonitor, "Speed measurement stopped");
 }
 
 ///	Stops measuring speed
 void MotorMonitor::stopMeasuringSpeed() {
 	measure = false;
+	edgeTimes.notifyAll();
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//	FILTER	////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+PeriodFilter::PeriodFilter() : count(0), next(0), window(1), mode(filterNone) {}
+
+void PeriodFilter::configure(rpmFilter filterMode, int filterWindow) {
+	mode = filterMode;
+	window = std::max(1, std::min(filterWindow, MAX_FILTER_WINDOW));
+	reset();
+}
+
+void PeriodFilter::reset() {
+	count = 0;
+	next = 0;
+}
+
+/// Adds a period and returns the filtered period
+int64_t PeriodFilter::add(int64_t periodNs) {
+	samples[next] = periodNs;
+	next = (next + 1) % window;
+	if (count < window) count++;
+
+	if (mode == filterAverage) {
+		int64_t sum = 0;
+		for (int i = 0; i < count; i++) sum += samples[i];
+		return sum / count;
+	}
+	if (mode == filterMedian) {
+		int64_t sorted[MAX_FILTER_WINDOW];
+		std::copy(samples, samples + count, sorted);
+		std::nth_element(sorted, sorted + count / 2, sorted + count);
+		return sorted[count / 2];
+	}
+	return periodNs;
 }
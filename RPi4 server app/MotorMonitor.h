@@ -1,30 +1,83 @@
 #include <iostream>
 #include <chrono>
-#include <wiringPi.h>
+#include "GpioBackend.h"
+#include "RingQueue.h"
+#include "Executor.h"
 #include <atomic>
+#include <mutex>
 
-const int detectMagnet = 24;
+const int detectMagnet = 24;		// sensor pin of the first motor
+const int defaultPulsesPerRevolution = 1;	// magnets passing the sensor per turn
+constexpr int MAX_PULSES_PER_REVOLUTION = 64;
+
+constexpr int MAX_MOTORS = 4;		// one monitor, and edge ISR slot, per motor
+
+constexpr size_t EDGE_RING_SIZE = 256;
+constexpr int MAX_FILTER_WINDOW = 32;
+constexpr int EDGE_WAIT_MS = 100;		// how often a silent sensor is re-checked
+constexpr int64_t STALL_NS = 1000000000;	// no edge for this long reads as stopped
+
+enum rpmFilter {
+	filterNone = 0,
+	filterAverage,
+	filterMedian
+};
+
+/// Smooths magnet periods over a sliding window
+class PeriodFilter {
+private:
+	int64_t samples[MAX_FILTER_WINDOW];
+	int count;
+	int next;
+	int window;
+	rpmFilter mode;
+
+public:
+	PeriodFilter();
+	void configure(rpmFilter filterMode, int filterWindow);
+	void reset();
+	int64_t add(int64_t periodNs);
+};
 
 class MotorMonitor {
 private:
-	bool measure;
-	bool motorInMotion;
-	std::atomic<bool> detectMagnetRE;
+	std::atomic<bool> measure;
+	std::atomic<bool> motorInMotion;
+	RingQueue<int64_t> edgeTimes;	// rising edge timestamps written by the ISR
+	std::atomic<uint64_t> missedEdges;
+	std::atomic<int> filterMode;
+	std::atomic<int> filterWindow;
+	std::atomic<int> pulsesPerRevolution;	// sensor edges per turn
+	std::atomic<float> rpm;			// latest measured speed
+	int64_t lastEdgeNs;				// ISR only
+	
+	int id;							// motor id, also the ISR slot
+	int sensorPin;
+	
+	Worker measureWorker;			// runs measureSpeed, kept between uses
+	std::mutex measureMutex;
+	int measureUsers;				// guarded by measureMutex
 	
 	void handleEdgeDetect();
-	static void edgeDetectWrapper();
-	static MotorMonitor* instance;
+	template <int slot> static void edgeDetectWrapper();
+	static std::atomic<MotorMonitor*> instances[MAX_MOTORS];
+	static void (*const edgeWrappers[MAX_MOTORS])();
 
 public:
-	MotorMonitor();
+	explicit MotorMonitor(int motorId = 0, int pin = detectMagnet);
+	~MotorMonitor();
 	void setupMonitor();
-	bool getDetectMagnetRE() const;
 
 	
 	void setMotorInMotion(bool value);
 	void setMeasure(bool value);
-	void setMagnetRE(bool value);
+	void setFilter(int mode, int window);
+	bool setPulsesPerRevolution(int pulses);
+	uint64_t getMissedEdges() const;
+	float getRpm() const;
 	
-	void measureSpeed(float* rpm);
+	void startMeasuring();
+	void stopMeasuring();
+	void measureSpeed();
 	void stopMeasuringSpeed();
 };
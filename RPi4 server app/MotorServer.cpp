@@ -1,5 +1,49 @@
 #include "MotorServer.h"
+#include "Logger.h"
+#include "RealTime.h"
+#include "Journal.h"
+
+#include <random>
+
+constexpr uint64_t msgListenerTag = 1;
+constexpr uint64_t spdListenerTag = 2;
+constexpr uint64_t wakeTag = 3;
+constexpr uint64_t metricsListenerTag = 4;
+constexpr int firstConnId = 16;	// ids below are reserved for the tags above
+
+MotorServer::MotorServer(const std::vector<MotorPins>& motorPins) : running(false), doSpeedMeasure(false), samplerActive(false), multicastOn(false),
+    messageQueue(MESSAGE_QUEUE_SIZE), responseQueue(RESPONSE_QUEUE_SIZE),
+    speedQueue(SPEED_QUEUE_SIZE),
+    epollFd(-1), nextConnId(firstConnId), telemetryRateHz(TELEMETRY_TEXT_RATE), nextStreamId(1), detachedSessions(0), stopSerial(0), bindAddress("192.168.0.100"),
+    serverMsgSocket(-1), serverSpdSocket(-1), serverMetricsSocket(-1) {
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    size_t count = motorPins.size() < (size_t)MAX_MOTORS ? motorPins.size() : MAX_MOTORS;
+    if (count < motorPins.size()) LOG_WARN(logServer, "Only %d motors are supported", MAX_MOTORS);
+    for (size_t id = 0; id < count; id++) {
+        motors.push_back(std::make_unique<MotorUnit>((int)id, motorPins[id], pwmEngine));
+    }
+
+    // Threads start with their first task, so an unused server starts none
+    networkWorker = &executor.add("network", roleNetwork);
+    processingWorker = &executor.add("processing", roleNetwork);
+    samplerWorker = &executor.add("sampler", roleNetwork);
+    for (size_t id = 0; id < motors.size(); id++) executionWorkers.push_back(&executor.add("execution", roleControl));
+}
 
+MotorUnit::MotorUnit(int id, const MotorPins& pins, PwmEngine& engine)
+    : controller(id, pins, engine), commandQueue(COMMAND_QUEUE_SIZE), parseLatency(), queueLatency(),
+      actuationLatency(), totalLatency(), stopPending(false), stopConnId(-1), stopRecvNs(0), activeConnId(-1) {}
+
+///	Number of motors the server drives
+size_t MotorServer::motorCount() const {
+    return motors.size();
+}
+
+///	Controller of one motor; ids run from 0 to motorCount() - 1
+MotorController& MotorServer::motor(int id) {
+    return motors[id]->controller;
+}
 
 //  HELPERS ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////
@@ -19,18 +63,60 @@ std::string MotorServer::to_string_with_precision(float value, int precision) {
     return str;
 }
 
-///	Starts the speed measurement threads
+///	Starts speed measurement on every motor and the sampling loop. Both run
+///	on workers kept between uses, so toggling measurement starts no threads.
 void MotorServer::startMonitorSpeedMeasure() {
+	std::lock_guard<std::mutex> lock(speedMeasureMutex);
+	if (doSpeedMeasure) return;
 	doSpeedMeasure = true;
-	std::thread([this]() { this->motorController.motorMonitor.measureSpeed(&rpm); }).detach();
-	
-	std::thread([this]() { this-> measureSpeedLoop(); }).detach();
+	for (auto& unit : motors) unit->controller.motorMonitor.startMeasuring();
+
+	// A loop stopped a moment ago carries on unless it already decided to return
+	if (samplerActive) return;
+	samplerWorker->wait();
+	samplerActive = true;
+	samplerWorker->run([this]() { this->measureSpeedLoop(); });
 }
 
-///	Stops the speed measurement threads
+///	Stops speed measurement on every motor; the sampling loop returns when
+///	it next wakes up. A client that asked for it or the multicast channel
+///	keeps it on while the server runs.
 void MotorServer::stopMonitorSpeedMeasure() {
+	std::lock_guard<std::mutex> lock(speedMeasureMutex);
+	if (!doSpeedMeasure || (running && (multicastOn || !speedMeasureClients.empty()))) return;
 	doSpeedMeasure = false;
-	motorController.motorMonitor.stopMeasuringSpeed();
+	for (auto& unit : motors) unit->controller.motorMonitor.stopMeasuring();
+}
+
+///	TSI: the client wants speed measured until it sends TSO or leaves
+void MotorServer::addSpeedMeasureClient(int connId) {
+	{
+		std::lock_guard<std::mutex> lock(speedMeasureMutex);
+		speedMeasureClients.insert(connId);
+	}
+	startMonitorSpeedMeasure();
+}
+
+///	Drops the client's interest in speed measurement; it stops with the last one
+void MotorServer::removeSpeedMeasureClient(int connId) {
+	{
+		std::lock_guard<std::mutex> lock(speedMeasureMutex);
+		if (speedMeasureClients.erase(connId) == 0) return;
+	}
+	stopMonitorSpeedMeasure();
+}
+
+///	State of a simulated motor next to what the monitor measures
+std::string MotorServer::simulationString(int id) {
+    SimGpioBackend* sim = dynamic_cast<SimGpioBackend*>(&gpio());
+    if (!sim || id >= (int)sim->motorCount()) return "<<SERVER>>\tMotor " + std::to_string(id) + " is not simulated.";
+
+    SimMotorState state = sim->motorState(id);
+    char text[192];
+    snprintf(text, sizeof(text), "<<SERVER>>\tSim motor %d: %.1f rpm (measured %.1f), %.3f A, %.1f revolutions, %llu pulses, clock x%g",
+        id, state.rpm, motors[id]->controller.motorMonitor.getRpm(), state.currentA, state.revolutions,
+        (unsigned long long)state.pulses, sim->getTimeScale());
+    return text;
 }
 
 ///	Returns the string representation of a bool
@@ -38,6 +124,104 @@ std::string MotorServer::get_string_from_bool(bool value) {
     return value ? "True" : "False";
 }
 
+///	Formats the PWM engine statistics for the client
+std::string MotorServer::pwmStatsString(const PwmStats& stats) {
+    std::string str = "<<SERVER>>\tPWM periods: ";
+    str.append(std::to_string(stats.periods))
+        .append(" overruns: ").append(std::to_string(stats.overruns))
+        .append(" jitter mean/max: ").append(std::to_string(stats.meanJitterNs / 1000))
+        .append("/").append(std::to_string(stats.maxJitterNs / 1000))
+        .append("us cpu: ").append(to_string_with_precision(stats.cpuLoad * 100.0f, 2)).append("%");
+    return str;
+}
+
+///	Formats a motor's PWM frequency and duty resolution for the client
+std::string MotorServer::pwmTimingString(const DutyTable& table) {
+    char text[160];
+    snprintf(text, sizeof(text), "<<SERVER>>\tPWM timing: %d Hz, %d bits (%d steps of %.1f ns), table error %.2g%%",
+        table.getFrequency(), table.getBits(), table.steps(), (double)table.getPeriodNs() / table.steps(),
+        table.maxTableError() * 100.0);
+    return text;
+}
+
+///	Formats the result of a closed loop run for the client
+std::string MotorServer::controlStatsString(const ControlStats& stats) {
+    std::string str = "<<SERVER>>\tSpeed control target: ";
+    str.append(to_string_with_precision(stats.targetRpm, -1))
+        .append("rpm final: ").append(to_string_with_precision(stats.finalRpm, -1))
+        .append("rpm overshoot: ").append(to_string_with_precision(stats.overshootPct, 1))
+        .append("% settling: ")
+        .append(stats.settlingNs < 0 ? std::string("not settled") : std::to_string(stats.settlingNs / 1000000) + "ms")
+        .append(" tick jitter mean/max: ").append(std::to_string(stats.meanJitterNs / 1000))
+        .append("/").append(std::to_string(stats.maxJitterNs / 1000)).append("us");
+    return str;
+}
+
+///	Adds one sample to a command path stage
+static void addSample(StageLatency& stage, int64_t ns) {
+    if (ns < 0) ns = 0;
+    stage.count++;
+    stage.sumNs += ns;
+    stage.lastNs = ns;
+    if (ns > stage.maxNs) stage.maxNs = ns;
+}
+
+///	Formats one command path stage as mean/max/last in microseconds
+static std::string stageString(const char* name, const StageLatency& stage) {
+    int64_t mean = stage.count ? stage.sumNs / (int64_t)stage.count : 0;
+    std::string str = name;
+    str.append(" ").append(std::to_string(mean / 1000))
+        .append("/").append(std::to_string(stage.maxNs / 1000))
+        .append("/").append(std::to_string(stage.lastNs / 1000));
+    return str;
+}
+
+///	Records the stage latencies of a command that drove the motor
+void MotorServer::recordLatency(MotorUnit& unit, const CommandTimestamps& ts) {
+    if (ts.firstEdgeNs == 0) return;
+    addSample(unit.parseLatency, ts.parseNs - ts.recvNs);
+    addSample(unit.queueLatency, ts.dequeueNs - ts.parseNs);
+    addSample(unit.actuationLatency, ts.firstEdgeNs - ts.dequeueNs);
+    addSample(unit.totalLatency, ts.firstEdgeNs - ts.recvNs);
+
+    LatencyHistogram* stages = metrics().stageLatency[unit.controller.getId()];
+    stages[stageParse].record(ts.parseNs - ts.recvNs);
+    stages[stageQueue].record(ts.dequeueNs - ts.parseNs);
+    stages[stageActuation].record(ts.firstEdgeNs - ts.dequeueNs);
+    stages[stageTotal].record(ts.firstEdgeNs - ts.recvNs);
+}
+
+///	Formats the command-to-actuation latency of a motor for the client
+std::string MotorServer::latencyString(const MotorUnit& unit) {
+    std::string str = "<<SERVER>>\tLatency over ";
+    str.append(std::to_string(unit.totalLatency.count)).append(" commands, mean/max/last us: ")
+        .append(stageString("recv->parse", unit.parseLatency)).append(", ")
+        .append(stageString("parse->dequeue", unit.queueLatency)).append(", ")
+        .append(stageString("dequeue->edge", unit.actuationLatency)).append(", ")
+        .append(stageString("total", unit.totalLatency));
+    return str;
+}
+
+///	Names a command with its arguments, and its motor when there are several
+std::string MotorServer::commandLabel(const MotorCommand& command) {
+    std::string str;
+    if (motors.size() > 1) str.append(1, MOTOR_PREFIX).append(std::to_string(command.motor)).append(" ");
+    if (command.program) {
+        return str.append(enumToString(command.cmd)).append(" ")
+            .append(std::to_string(command.program->segments.size())).append(" segments ")
+            .append(to_string_with_precision(command.program->totalNs / 1e6f, -1)).append("ms");
+    }
+    if (command.cmd == mCmd::PwmFrequency) {
+        str.append(enumToString(command.cmd)).append(" ").append(std::to_string((int)command.speed)).append("Hz");
+        if (command.duration > 0) str.append(" ").append(std::to_string((int)command.duration)).append(" bits");
+        return str;
+    }
+    str.append(enumToString(command.cmd)).append(" ")
+        .append(to_string_with_precision(command.speed, 2)).append(command.cmd == mCmd::rotateRpm ? "rpm " : "V ")
+        .append(to_string_with_precision(command.duration, -1)).append("ms");
+    return str;
+}
+
 /// Get string value from command enumerator
 std::string MotorServer::enumToString(mCmd value) {
     switch (value) {
@@ -53,6 +237,30 @@ std::string MotorServer::enumToString(mCmd value) {
 		return "Turn Off Speed Measurement";
     case mCmd::Acc:
 		return "Set Acceleration";
+    case mCmd::PwmInfo:
+		return "PWM Statistics";
+    case mCmd::LatencyInfo:
+		return "Latency Statistics";
+    case mCmd::RpmFilter:
+		return "Set RPM Filter";
+    case mCmd::rotateRpm:
+		return "Rotate At RPM";
+    case mCmd::Profile:
+		return "Set Motion Profile";
+    case mCmd::RtInfo:
+		return "Real-Time Status";
+    case mCmd::MetricsInfo:
+		return "Metrics";
+    case mCmd::Stop:
+		return "Stop";
+    case mCmd::EmergencyStop:
+		return "Emergency Stop";
+    case mCmd::Program:
+		return "Program";
+    case mCmd::SimInfo:
+		return "Simulation Status";
+    case mCmd::PwmFrequency:
+		return "Set PWM Frequency";
     case mCmd::quit:
         return "Quit";
     default:
@@ -60,352 +268,997 @@ std::string MotorServer::enumToString(mCmd value) {
     }
 }
 
-/// Parse the command recieved from client and return command structure
-std::tuple<mCmd, float, float> MotorServer::parseCommand(std::string message) {
-    if (message == "") {
-        std::cout << "PARSER:\tRecieved empty command.\n";
-        return std::tuple<mCmd, float, float>(mCmd::none, 0, 0);
+///	Formats a rejected command and the reason for the client
+std::string MotorServer::parseErrorResponse(const std::string& message, const ParsedCommand& parsed) {
+    std::string str = "<<SERVER>>\tCommand '";
+    str.append(message).append("'\trejected: ").append(parseErrorString(parsed.error));
+    if (parsed.errorArg > 0) str.append(" ").append(std::to_string(parsed.errorArg));
+    str.append(".");
+    return str;
+}
+
+/// Records the depth a push left a queue at, or that it was full
+template <typename T>
+static bool countPush(bool pushed, const RingQueue<T>& queue, metricQueue id) {
+    if (pushed) metrics().queueDepth[id].set(queue.size());
+    else metrics().queueFull[id].add();
+    return pushed;
+}
+
+/// Queue push wrappers; return false when the queue is full
+bool MotorServer::pushMessage(ClientMessage message) {
+    return countPush(messageQueue.push(std::move(message)), messageQueue, queueMessage);
+}
+bool MotorServer::pushResponse(OutMessage response) {
+    return countPush(responseQueue.push(std::move(response)), responseQueue, queueResponse);
+}
+bool MotorServer::pushSpeed(SharedTelemetryBatch speed) {
+    return countPush(speedQueue.push(std::move(speed)), speedQueue, queueSpeed);
+}
+bool MotorServer::pushCommand(MotorCommand command) {
+    RingQueue<MotorCommand>& queue = motors[command.motor]->commandQueue;
+    return countPush(queue.push(command), queue, queueCommand);
+}
+
+/// Queue pop wrappers; return false when the queue is empty
+bool MotorServer::popMessage(ClientMessage& message) {
+    return messageQueue.tryPop(message);
+}
+bool MotorServer::popResponse(OutMessage& response) {
+    return responseQueue.tryPop(response);
+}
+bool MotorServer::popSpeed(SharedTelemetryBatch& speed) {
+    return speedQueue.tryPop(speed);
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//  CONNECTION  ////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+///	Enqueues a response for one client connection
+void MotorServer::sendResponse(int connId, const std::string& response) {
+	if (!pushResponse(OutMessage{ connId, response, false })) {
+		LOG_WARN(logServer, "Response queue full, dropped response to client %d", connId);
+		return;
+	}
+	wakeNetwork();
+}
+
+/// Enqueues a batch of speed samples for every speed client. The batch is
+/// shared, never copied, by the sessions and streams that read it.
+void MotorServer::sendSpeed(TelemetryBatch batch) {
+	size_t samples = batch.size();
+	if (pushSpeed(std::make_shared<const TelemetryBatch>(std::move(batch)))) wakeNetwork();
+	else metrics().telemetryDropped.add(samples);
+}
+
+/// Wakes the network loop so it picks up queued responses and speeds
+void MotorServer::wakeNetwork() {
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        LOG_ERROR(logServer, "Failed to wake network loop");
     }
+}
 
-    std::istringstream iss(message);
-    std::vector<std::string> tokens;
+///	Creates a non-blocking socket listening on an address and port
+int MotorServer::openListener(const char* address, int port, const char* name) {
+    int listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenSocket < 0) {
+        LOG_ERROR(logServer, "%s socket creation failed", name);
+        return -1;
+    }
+    LOG_INFO(logServer, "%s socket created", name);
+
+    int reuse = 1;
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
-    std::string token;
-    while (std::getline(iss, token, ' ')) {
-        tokens.push_back(token);
+    // Set server address
+    struct sockaddr_in serverAddr;
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = inet_addr(address);
+    serverAddr.sin_port = htons(port);
+
+    // Bind socket to address
+    if (bind(listenSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+        LOG_ERROR(logServer, "Bind %s socket failed", name);
+        close(listenSocket);
+        return -1;
     }
+    LOG_INFO(logServer, "%s socket binded successfully.", name);
 
-    std::string commandRaw = tokens[0];
+    // Listen for incoming connections
+    if (listen(listenSocket, SOMAXCONN) < 0) {
+        LOG_ERROR(logServer, "%s listen failed", name);
+        close(listenSocket);
+        return -1;
+    }
+    LOG_INFO(logServer, "%s server listening for client connections on %s:%d", name, address, port);
 
-    float speed = 0;
-    float duration = 0.0;
-    mCmd cmd = mCmd::none;
+    return listenSocket;
+}
 
-    if (tokens.size() > 1) {
-        try {
-            speed = std::stof(tokens[1]);
-            duration = std::stof(tokens[2]);
+///	Accepts every pending connection on a listening socket
+void MotorServer::acceptClients(int listenSocket, mChannel channel) {
+    struct sockaddr_in clientAddr;
+    socklen_t addrSize = sizeof(clientAddr);
+
+    while (true) {
+        int newSocket = accept4(listenSocket, (struct sockaddr*)&clientAddr, &addrSize, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newSocket < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_ERROR(logServer, "Accept failed");
+            }
+            return;
         }
-        catch (const std::exception& e) {
-            std::cout << "PARSER:\tInvalid argument value.\n";
+
+        // Responses are short lines written as they happen; Nagle would hold
+        // each one back until the client's delayed ACK
+        int noDelay = 1;
+        setsockopt(newSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        // Get the client IP address
+        char clientIP[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(clientAddr.sin_addr), clientIP, INET_ADDRSTRLEN);
+
+        int connId = nextConnId++;
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.u64 = connId;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, newSocket, &event) < 0) {
+            LOG_ERROR(logServer, "Failed to watch client socket");
+            close(newSocket);
+            continue;
         }
+
+        ClientConnection& conn = connections[connId];
+        conn.fd = newSocket;
+        conn.channel = channel;
+        conn.peer = clientIP;
+        metrics().connectionsOpened[channel].add();
+        if (channel == metricsChannel) continue;
+        LOG_INFO(logServer, "%s client %d connected from %s",
+            channel == msgChannel ? "Message" : "Speed", connId, clientIP);
     }
+}
+
+/// Whether a message is SESSION or RESUME, handled by the network loop on either channel
+static bool isSessionCommand(const std::string& message) {
+    size_t end = message.find_first_of(" \t");
+    std::string keyword = message.substr(0, end);
+    return keyword == "SESSION" || keyword == "RESUME";
+}
 
-    if (commandRaw == "RCW")
-        cmd = mCmd::rotateCW;
-    else if (commandRaw == "RCCW")
-        cmd = mCmd::rotateCCW;
-    else if (commandRaw == "TSI")
-        cmd = mCmd::SpdOn;
-    else if (commandRaw == "TSO")
-        cmd = mCmd::SpdOff;
-    else if (commandRaw == "ACC")
-        cmd = mCmd::Acc;
-    else if (commandRaw == "quit")
-        cmd = mCmd::quit;
+///	Reads everything available on a client socket and queues every
+///	complete command it carries
+void MotorServer::readClient(int connId) {
+    char buffer[BUFFER_SIZE];
 
-    std::tuple<mCmd, float, float> ret(cmd, speed, duration);
-    std::cout << "PARSER:\tParsed command [" << enumToString(std::get<0>(ret)) << "] with speed [" << std::get<1>(ret) << "] for [" << std::get<2>(ret) << "]ms.\n";
+    while (true) {
+        auto it = connections.find(connId);
+        if (it == connections.end()) return;
+
+        ssize_t bytesRead = recv(it->second.fd, buffer, BUFFER_SIZE, 0);
+        if (bytesRead > 0) {
+            metrics().bytesReceived[it->second.channel].add(bytesRead);
+            if (it->second.channel == metricsChannel) {
+                // Whatever the request, answer with the dump and hang up
+                if (!it->second.closing) {
+                    it->second.outBuffer = metricsHttpResponse();
+                    it->second.closing = true;
+                }
+                continue;
+            }
 
+            int64_t recvNs = gpio().nowNs();
+            size_t droppedBefore = it->second.decoder.droppedCommands();
+
+            decoded.clear();
+            it->second.decoder.feed(buffer, bytesRead, decoded);
+            bool speedSession = it->second.channel == spdChannel;
+            for (const std::string& message : decoded) {
+                // A RESUME moves the socket onto the resumed connection, which reads on from here
+                if (isSessionCommand(message)) {
+                    connId = handleSessionCommand(connId, message);
+                    continue;
+                }
+                if (speedSession && (message.compare(0, 4, "MODE") == 0 || message.compare(0, 3, "SUB") == 0
+                        || message.compare(0, 5, "UNSUB") == 0))
+                    handleSpeedCommand(connId, message);
+                else
+                    handleClientData(connId, message, recvNs);
+            }
 
-    return ret;
+            it = connections.find(connId);
+            if (it == connections.end()) return;
+            if (it->second.decoder.droppedCommands() != droppedBefore) {
+                pushResponse(OutMessage{ connId, "<<SERVER>>\tCommand too long, dropped.", false });
+            }
+        }
+        else if (bytesRead == 0) {
+            if (it->second.channel != metricsChannel) LOG_INFO(logServer, "Client %d disconnected", connId);
+            closeClient(connId);
+            return;
+        }
+        else if (errno == EINTR) {
+            continue;
+        }
+        else {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_WARN(logServer, "Receive from client %d failed", connId);
+                closeClient(connId);
+            }
+            return;
+        }
+    }
 }
 
+///	Queues a received message for processing and acknowledges it
+void MotorServer::handleClientData(int connId, const std::string& message, int64_t recvNs) {
+    LOG_DEBUG(logServer, "Received message from client %d: %s", connId, message.c_str());
+    if (handlePriorityCommand(connId, message, recvNs)) return;
 
-void MotorServer::pushMessage(std::string message) {
-	std::unique_lock<std::mutex> lock(messageMutex);
-    messageQueue.push(message);
-    lock.unlock();
-}
-void MotorServer::pushResponse(std::string response) {
-	std::unique_lock<std::mutex> lock(responseMutex);
-    responseQueue.push(response);
-    lock.unlock();
-}
-void MotorServer::pushSpeed(std::string speed) {
-	std::unique_lock<std::mutex> lock(speedMutex);
-    speedQueue.push(speed);
-    lock.unlock();
-}
-void MotorServer::pushCommand(std::tuple<mCmd, float, float> command) {
-	std::unique_lock<std::mutex> lock(commandMutex);
-    commandQueue.push(command);
-    lock.unlock();
+    std::string response = "<<SERVER>>\tCommand '";
+    if (pushMessage(ClientMessage{ connId, message, recvNs, stopSerial })) {
+        metrics().commandsAccepted.add();
+        response.append(message).append("'\trecieved.");
+    }
+    else {
+        metrics().commandsBusy.add();
+        response.append(message).append("'\tdropped, server busy.");
+    }
+    pushResponse(OutMessage{ connId, response, false });
 }
 
-std::string MotorServer::popMessage() {
-	std::unique_lock<std::mutex> lock(messageMutex);
-    std::string message = messageQueue.front();
-    messageQueue.pop();
-    lock.unlock();
-    return message;
-}
-std::string MotorServer::popResponse() {
-	std::unique_lock<std::mutex> lock(responseMutex);
-    std::string message = responseQueue.front();
-    responseQueue.pop();
-    lock.unlock();
-    return message;
+///	Acts on STOP, ESTOP and quit right here instead of queueing them behind
+///	the commands they are meant to end. Returns false for any other message,
+///	including a stop that does not parse, which then takes the normal path.
+bool MotorServer::handlePriorityCommand(int connId, const std::string& message, int64_t recvNs) {
+    if (message.find("STOP") == std::string::npos && message.find("quit") == std::string::npos) return false;
+
+    ParsedCommand parsed = parseCommand(message);
+    if (parsed.error != parseOk || parsed.motor >= motors.size()) return false;
+
+    switch (parsed.cmd) {
+    case mCmd::Stop:
+        requestStop(*motors[parsed.motor], connId, recvNs);
+        break;
+    case mCmd::EmergencyStop:
+        for (auto& unit : motors) requestStop(*unit, connId, recvNs);
+        break;
+    case mCmd::quit:
+        // The client's running commands end with it; nobody is left for the report
+        for (auto& unit : motors) {
+            if (unit->activeConnId.load(std::memory_order_acquire) == connId) requestStop(*unit, -1, recvNs);
+        }
+        break;
+    default:
+        return false;
+    }
+
+    metrics().commandsAccepted.add();
+    journal().command(cmdQueued, parsed.motor, (int)parsed.cmd, 0.0f, 0.0f);
+    pushResponse(OutMessage{ connId, "<<SERVER>>\tCommand '" + message + "'\trecieved.", false });
+    if (parsed.cmd == mCmd::quit) quitClient(connId);
+    return true;
 }
-std::string MotorServer::popSpeed() {
-	std::unique_lock<std::mutex> lock(speedMutex);
-    std::string speed = speedQueue.front();
-    speedQueue.pop();
-    lock.unlock();
-    return speed;
+
+///	Cuts a motor's drive and cancels its running and queued commands. Its
+///	execution thread confirms the stop and reports the latency to 'connId'.
+void MotorServer::requestStop(MotorUnit& unit, int connId, int64_t recvNs) {
+    unit.controller.requestStop(++stopSerial);
+    unit.stopConnId.store(connId, std::memory_order_relaxed);
+    unit.stopRecvNs.store(recvNs, std::memory_order_relaxed);
+    unit.stopPending.store(true, std::memory_order_release);
+
+    // Wakes an idle execution thread; a full queue means it is awake anyway
+    unit.commandQueue.push(MotorCommand{ mCmd::none, 0.0f, 0.0f, -1, unit.controller.getId(), {}, 0 });
+    LOG_INFO(logServer, "Stop requested for motor %d", unit.controller.getId());
 }
-std::tuple<mCmd, float, float> MotorServer::popCommand() {
-	std::unique_lock<std::mutex> lock(commandMutex);
-    std::tuple<mCmd, float, float> cmd = commandQueue.front();
-    commandQueue.pop();
-    lock.unlock();
-    return cmd;
+
+///	Drops 'sent' bytes from the front of the output, in the order flushClient
+///	handed them to the socket
+static void consumeSent(ClientConnection& conn, size_t sent, bool chunkFirst) {
+    auto takeChunk = [&conn, &sent]() {
+        size_t size = conn.streamBacklog.front().text->size();
+        size_t taken = std::min(sent, size - conn.chunkOffset);
+        conn.chunkOffset += taken;
+        sent -= taken;
+        if (conn.chunkOffset == size) {
+            conn.streamBytes -= size;
+            conn.streamBacklog.pop_front();
+            conn.chunkOffset = 0;
+        }
+    };
+
+    if (chunkFirst) takeChunk();
+    size_t taken = std::min(sent, conn.outBuffer.size());
+    conn.outBuffer.erase(0, taken);
+    sent -= taken;
+    while (sent > 0 && !conn.streamBacklog.empty()) takeChunk();
 }
 
-////////////////////////////////////////////////////////////////////////
+///	Writes as much pending output as the socket accepts
+void MotorServer::flushClient(int connId) {
+    auto it = connections.find(connId);
+    if (it == connections.end()) return;
+    ClientConnection& conn = it->second;
+    if (conn.fd < 0) {
+        // A dropped session: its output waits in the replay ring
+        if (conn.closing) closeClient(connId);
+        return;
+    }
 
-//  CONNECTION  ////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////
+    while (!conn.outBuffer.empty() || !conn.streamBacklog.empty()) {
+        // A partly sent chunk goes first so its lines stay whole; the
+        // chunks are sent straight from the buffers their stream shares
+        struct iovec iov[FLUSH_IOV_MAX];
+        int count = 0;
+        bool chunkFirst = conn.chunkOffset > 0;
+        if (chunkFirst) {
+            const std::string& text = *conn.streamBacklog.front().text;
+            iov[count++] = { (void*)(text.data() + conn.chunkOffset), text.size() - conn.chunkOffset };
+        }
+        if (!conn.outBuffer.empty()) iov[count++] = { (void*)conn.outBuffer.data(), conn.outBuffer.size() };
+        for (size_t i = chunkFirst ? 1 : 0; i < conn.streamBacklog.size() && count < FLUSH_IOV_MAX; i++) {
+            const std::string& text = *conn.streamBacklog[i].text;
+            iov[count++] = { (void*)text.data(), text.size() };
+        }
 
-///	Enqueues response messages
-void MotorServer::sendResponse(const std::string& response) {
-	pushResponse(response);
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(conn.fd, &msg, MSG_NOSIGNAL);
+        if (sent > 0) {
+            metrics().bytesSent[conn.channel].add(sent);
+            consumeSent(conn, sent, chunkFirst);
+        }
+        else if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!conn.writeArmed) {
+                struct epoll_event event;
+                event.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+                event.data.u64 = connId;
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.fd, &event);
+                conn.writeArmed = true;
+            }
+            return;
+        }
+        else {
+            LOG_WARN(logServer, "Failed to send to client %d", connId);
+            closeClient(connId);
+            return;
+        }
+    }
+
+    if (conn.writeArmed) {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.u64 = connId;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.fd, &event);
+        conn.writeArmed = false;
+    }
+    if (conn.closing) {
+        closeClient(connId);
+    }
 }
 
-/// Enqueues speed messages
-void MotorServer::sendSpeed(std::string speed) {
-	pushSpeed(speed);
+///	Closes a client connection and forgets its pending output. A connection
+///	with a session only loses its socket and waits for RESUME, unless it is
+///	closing on purpose or the server stops.
+void MotorServer::closeClient(int connId) {
+    auto it = connections.find(connId);
+    if (it == connections.end()) return;
+    ClientConnection& conn = it->second;
+    if (running && !conn.sessionToken.empty() && !conn.closing) {
+        if (conn.fd >= 0) detachClient(connId, conn);
+        return;
+    }
+
+    mChannel channel = conn.channel;
+    if (channel == msgChannel) removeSpeedMeasureClient(connId);
+    while (!conn.streamIds.empty()) leaveStream(connId, conn, conn.streamIds.back());
+    if (conn.fd >= 0) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, conn.fd, nullptr);
+        close(conn.fd);
+        metrics().connectionsClosed[channel].add();
+    }
+    if (!conn.sessionToken.empty()) {
+        auto found = sessions.find(conn.sessionToken);
+        if (found != sessions.end()) {
+            if (found->second.msgConnId == connId) found->second.msgConnId = -1;
+            if (found->second.spdConnId == connId) found->second.spdConnId = -1;
+            if (found->second.msgConnId < 0 && found->second.spdConnId < 0) sessions.erase(found);
+        }
+    }
+    connections.erase(it);
+    updateSessionMetrics();
+    if (channel != metricsChannel) LOG_INFO(logServer, "Client %d socket closed.", connId);
+
+    if (channel == spdChannel) {
+        updateTelemetryRate();
+        updateStreamMetrics();
+    }
 }
 
-///	Dequeues response and speed messages and sends them via the appropreate channels
-void MotorServer::responseLoop() {
-    while (true) {
-        if (!responseQueue.empty()) {
-            std::string response = popResponse();
+///	Moves queued responses and speeds into the connection output buffers
+void MotorServer::dispatchOutgoing() {
+    OutMessage response;
+    while (popResponse(response)) {
+        auto it = connections.find(response.connId);
+        if (it == connections.end()) {
+            LOG_DEBUG(logServer, "Failed to send response to client %d", response.connId);
+            continue;
+        }
+        if (!it->second.sessionToken.empty()) {
+            if (!response.text.empty()) recordResponse(it->second, response.text);
+        }
+        else {
+            it->second.outBuffer.append(response.text);
+            if (!response.text.empty()) it->second.outBuffer.push_back('\n');
+        }
 
-            if (send(clientMsgSocket, response.c_str(), response.size(), 0) < 0) {
-                std::cerr << "SERVER:\tFailed to send response to client\n";
+        if (response.close) {
+            it->second.closing = true;
+            // The speed connection paired with a quitting client through its
+            // session goes with it; unpaired ones may belong to another client
+            auto found = sessions.find(it->second.sessionToken);
+            auto paired = connections.find(found != sessions.end() ? found->second.spdConnId : -1);
+            if (paired != connections.end()) {
+                paired->second.closing = true;
+                if (paired->second.fd < 0) closeClient(paired->first);
             }
-            else {
-                std::cerr << "SERVER:\tResponse sent to client.\n";
-            }
-
         }
-        if (!speedQueue.empty()) {
-            std::string response = popSpeed();
+    }
 
-            if (send(clientSpdSocket, response.c_str(), response.size(), 0) < 0) {
-                std::cerr << "SERVER:\tFailed to send speed to client\n";
+    SharedTelemetryBatch batch;
+    while (popSpeed(batch)) {
+        multicastSender.feed(*batch);
+        // Each stream does its work once, however many subscribers it has
+        for (auto& stream : streams) {
+            StreamChunk chunk = stream->feed(*batch);
+            if (!chunk.text) continue;
+            for (int subscriber : stream->subscribers) {
+                auto it = connections.find(subscriber);
+                if (it != connections.end()) queueChunk(it->second, chunk);
             }
-            else {
-                //std::cerr << "SERVER:\tSpeed sent to client.\n";
+        }
+        for (auto& entry : connections) {
+            ClientConnection& conn = entry.second;
+            if (conn.channel != spdChannel || !conn.streamIds.empty()) continue;
+            for (const TelemetryFrame& frame : *batch) {
+                appendTelemetry(conn, frame);
             }
-
         }
-        delay(1);
+    }
+
+    std::vector<int> pending;
+    for (auto& entry : connections) {
+        const ClientConnection& conn = entry.second;
+        if (!conn.writeArmed && (!conn.outBuffer.empty() || !conn.streamBacklog.empty() || conn.closing))
+            pending.push_back(entry.first);
+    }
+    for (int connId : pending) {
+        flushClient(connId);
     }
 }
 
-///	Opens and maintains the message exchange channel
-int MotorServer::serverLoop() {
-    int newSocket;
-    struct sockaddr_in serverAddr, speedAddr, clientAddr, clientSpdAddr;
-    socklen_t addrSize = sizeof(struct sockaddr_in);
-    char buffer[BUFFER_SIZE] = { 0 };
+///	Serves the message and speed channels for any number of clients
+int MotorServer::networkLoop() {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        LOG_ERROR(logServer, "Epoll creation failed");
+        return 1;
+    }
 
-    // Create socket
-    if ((serverMsgSocket = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        std::cerr << "SERVER:\tMessage socket creation failed\n";
+    serverMsgSocket = openListener(bindAddress.c_str(), recvPort, "Message");
+    serverSpdSocket = openListener(bindAddress.c_str(), speedPort, "Speed");
+    if (serverMsgSocket < 0 || serverSpdSocket < 0) {
+        if (serverMsgSocket >= 0) close(serverMsgSocket);
+        if (serverSpdSocket >= 0) close(serverSpdSocket);
+        close(epollFd);
         return 1;
     }
-    std::cerr << "SERVER:\tMessage socket created\n";
 
-    // Set server address
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = inet_addr("192.168.0.100");
-    serverAddr.sin_port = htons(recvPort);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = msgListenerTag;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, serverMsgSocket, &event);
+    event.data.u64 = spdListenerTag;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, serverSpdSocket, &event);
+    event.data.u64 = wakeTag;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+
+    // Metrics are a diagnostic; the motor is served without them
+    serverMetricsSocket = openListener(METRICS_ADDRESS, metricsPort, "Metrics");
+    if (serverMetricsSocket >= 0) {
+        event.data.u64 = metricsListenerTag;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, serverMetricsSocket, &event);
+    }
 
+    // Observers on the multicast channel are passive, so it is sampled from the start
+    if (!multicast.address.empty() && multicastSender.open(multicast)) {
+        multicastOn = true;
+        updateTelemetryRate();
+        startMonitorSpeedMeasure();
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (running) {
+        // Dropped sessions are checked for expiry while any wait for RESUME
+        int count = epoll_wait(epollFd, events, MAX_EVENTS, detachedSessions ? SESSION_EXPIRY_CHECK_MS : -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERROR(logServer, "Epoll wait failed");
+            break;
+        }
 
-    // Get the server IP address
-    char serverIP[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(serverAddr.sin_addr), serverIP, INET_ADDRSTRLEN);
+        for (int i = 0; i < count; i++) {
+            uint64_t tag = events[i].data.u64;
+            uint32_t flags = events[i].events;
 
-    // Bind socket to address
-    if (bind(serverMsgSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-        std::cerr << "SERVER:\tBind message socket failed\n";
-        return 1;
+            if (tag == msgListenerTag) {
+                acceptClients(serverMsgSocket, msgChannel);
+            }
+            else if (tag == spdListenerTag) {
+                acceptClients(serverSpdSocket, spdChannel);
+            }
+            else if (tag == metricsListenerTag) {
+                acceptClients(serverMetricsSocket, metricsChannel);
+            }
+            else if (tag == wakeTag) {
+                uint64_t value;
+                while (read(wakeFd, &value, sizeof(value)) > 0) {}
+            }
+            else {
+                int connId = (int)tag;
+                if (flags & EPOLLIN) readClient(connId);
+                if (flags & EPOLLOUT) flushClient(connId);
+                if (flags & (EPOLLERR | EPOLLHUP)) closeClient(connId);
+            }
+        }
+
+        dispatchOutgoing();
+        expireSessions();
     }
-    std::cerr << "SERVER:\tMessage socket binded successfully.\n";
 
+    // Shut down: drop every client, then the listeners
+    std::vector<int> ids;
+    for (auto& entry : connections) ids.push_back(entry.first);
+    for (int connId : ids) closeClient(connId);
+
+    close(serverMsgSocket);
+    close(serverSpdSocket);
+    if (serverMetricsSocket >= 0) close(serverMetricsSocket);
+    multicastSender.close();
+    close(epollFd);
+    LOG_INFO(logServer, "Server sockets closed.");
+    return 0;
+}
 
-    bool running = true;
-    bool clientMsgConnected = false;
+///	Configures the telemetry of a speed connection: MODE TEXT|BIN [rate Hz]
+///	sets up its session, SUB and UNSUB manage its subscriptions
+void MotorServer::handleSpeedCommand(int connId, const std::string& message) {
+    auto it = connections.find(connId);
+    if (it == connections.end()) return;
+    ClientConnection& conn = it->second;
 
-    while (running) {
-        // MESSAGES
+    std::istringstream iss(message);
+    std::string keyword, mode;
+    iss >> keyword;
+    if (keyword == "SUB" || keyword == "UNSUB") {
+        std::string args;
+        std::getline(iss, args);
+        if (keyword == "SUB") subscribe(connId, conn, args);
+        else unsubscribe(connId, conn, args);
+        return;
+    }
 
-        // Listen for incoming connections
-        if (listen(serverMsgSocket, 5) < 0) {
-            std::cerr << "SERVER:\tMessage listen failed\n";
-            return 1;
-        }
+    int rate = 0;
+    iss >> mode >> rate;
 
-        std::cout << "SERVER:\tMessage server listening for client connection on " << serverIP << ":" << recvPort << std::endl;
+    std::string response = "<<SERVER>>\t";
+    if (mode != "TEXT" && mode != "BIN") {
+        response.append("Unknown telemetry mode '").append(mode).append("'.");
+    }
+    else {
+        if (rate <= 0) rate = mode == "BIN" ? TELEMETRY_MAX_RATE : TELEMETRY_TEXT_RATE;
+        if (rate > TELEMETRY_MAX_RATE) rate = TELEMETRY_MAX_RATE;
+
+        conn.binaryTelemetry = mode == "BIN";
+        conn.telemetryRateHz = rate;
+        conn.ticks = TickDecimator();
+        conn.telemetrySeq = 0;
+        updateTelemetryRate();
+
+        response.append("Telemetry mode ").append(mode).append(" at ")
+            .append(std::to_string(rate)).append(" Hz.");
+    }
+    // The acknowledgement is always a text line, ahead of any binary frames
+    conn.outBuffer.append(response).push_back('\n');
+}
 
-        // Accept incoming connection
-        if ((newSocket = accept(serverMsgSocket, (struct sockaddr*)&clientAddr, &addrSize)) < 0) {
-            std::cerr << "SERVER:\tMessage accept failed\n";
-            return 1;
-        }
+///	Sets the sampling rate to the fastest rate any speed session,
+///	subscription stream or the multicast channel asked for
+void MotorServer::updateTelemetryRate() {
+    int rate = TELEMETRY_TEXT_RATE;
+    for (auto& entry : connections) {
+        if (entry.second.channel == spdChannel && entry.second.streamIds.empty() && entry.second.telemetryRateHz > rate)
+            rate = entry.second.telemetryRateHz;
+    }
+    for (auto& stream : streams) {
+        if (stream->getSpec().rateHz > rate) rate = stream->getSpec().rateHz;
+    }
+    if (multicastSender.isOpen() && multicastSender.getRateHz() > rate) rate = multicastSender.getRateHz();
+    telemetryRateHz = rate;
+}
 
-        // Get the client IP address
-        char clientIP[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &(clientAddr.sin_addr), clientIP, INET_ADDRSTRLEN);
-        std::cerr << "SERVER:\tMessage client connected from " << clientIP << '\n';
+///	Subscribes a speed connection to the stream for a spec, which is
+///	created when nobody has asked for that spec yet
+void MotorServer::subscribe(int connId, ClientConnection& conn, const std::string& args) {
+    StreamSpec spec;
+    std::string response = "<<SERVER>>\t";
+    const char* error = parseStreamSpec(args, spec);
+    if (error) {
+        response.append("Invalid subscription: ").append(error).append(".");
+        conn.outBuffer.append(response).push_back('\n');
+        return;
+    }
 
-        clientMsgSocket = newSocket;
-		clientMsgConnected = true;
+    TelemetryStream* stream = nullptr;
+    for (auto& candidate : streams) {
+        if (candidate->getSpec() == spec) stream = candidate.get();
+    }
+    if (!stream) {
+        streams.push_back(std::make_unique<TelemetryStream>(nextStreamId++, spec));
+        stream = streams.back().get();
+    }
 
-        // Receive data from client
-        ssize_t bytesRead;
-        while ((bytesRead = recv(clientMsgSocket, buffer, BUFFER_SIZE, 0)) > 0 && clientMsgConnected) {
-			if(buffer == "quit") {
-				quitClient();
-				break;
-			}
-            std::cout << "SERVER:\tReceived message from client: " << buffer << std::endl;
-            pushMessage(buffer);
+    int id = stream->getId();
+    if (std::find(conn.streamIds.begin(), conn.streamIds.end(), id) == conn.streamIds.end()) {
+        stream->subscribers.push_back(connId);
+        conn.streamIds.push_back(id);
+    }
+    updateTelemetryRate();
+    updateStreamMetrics();
 
-            std::tuple<mCmd, float, float> cmd = parseCommand(buffer);
-            std::string response = "<<SERVER>>\tCommand '";
-            response.append(buffer).append("'\trecieved.");
-            sendResponse(response);
-
-            memset(buffer, 0, BUFFER_SIZE); // Clear buffer
-        }
-
-		if (clientMsgConnected) {
-			if (bytesRead == 0) {
-				std::cout << "SERVER:\tClient message channel disconnected\n";
-				clientMsgConnected = false;
-				clientMsgSocket = -1;
-			}
-			else if (bytesRead == -1) {
-				std::cerr << "SERVER:\tReceive message failed\n";
-				clientMsgConnected = false;
-				clientMsgSocket = -2;
-				return 1;
-			}
-		}
-
-        close(clientMsgSocket); // Close connection
-        std::cerr << "SERVER:\tClient message socket closed.\n";
-    }
-    close(serverMsgSocket); // Close server socket
-    return 0;
+    response.append("Subscribed #").append(std::to_string(id)).append(": ").append(describeStreamSpec(spec))
+        .append(", ").append(std::to_string(stream->subscribers.size())).append(" subscriber(s).");
+    conn.outBuffer.append(response).push_back('\n');
 }
 
-///	Opens and maintains the speed exchange channel
-int MotorServer::speedLoop() {
-    int newSocket;
-    struct sockaddr_in serverAddr, speedAddr, clientAddr, clientSpdAddr;
-    socklen_t addrSize = sizeof(struct sockaddr_in);
-    char buffer[BUFFER_SIZE] = { 0 };
+///	UNSUB id|ALL; reports how many lines the subscription lost to backpressure
+void MotorServer::unsubscribe(int connId, ClientConnection& conn, const std::string& args) {
+    std::istringstream iss(args);
+    std::string target;
+    iss >> target;
 
-    // Create socket
-    if ((serverSpdSocket = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        std::cerr << "SERVER:\tSpeed socket creation failed\n";
-        return 1;
+    std::string response = "<<SERVER>>\t";
+    int left = 0;
+    if (target == "ALL") {
+        while (!conn.streamIds.empty()) left += leaveStream(connId, conn, conn.streamIds.back());
+    }
+    else {
+        int id = atoi(target.c_str() + (target.compare(0, 1, "#") == 0));
+        left = leaveStream(connId, conn, id);
     }
-    std::cerr << "SERVER:\tSpeed socket created\n";
 
-    // Set server address    
-    speedAddr.sin_family = AF_INET;
-    speedAddr.sin_addr.s_addr = inet_addr("192.168.0.100");
-    speedAddr.sin_port = htons(speedPort);
+    if (left == 0) {
+        response.append("Not subscribed to '").append(target).append("'.");
+    }
+    else {
+        response.append("Unsubscribed from ").append(std::to_string(left)).append(" stream(s), ")
+            .append(std::to_string(conn.droppedLines)).append(" line(s) dropped.");
+    }
+    conn.outBuffer.append(response).push_back('\n');
+    updateTelemetryRate();
+    updateStreamMetrics();
+}
 
+///	Takes a connection off a stream and drops the stream once nobody is left.
+///	Chunks already queued for the connection are still sent.
+bool MotorServer::leaveStream(int connId, ClientConnection& conn, int streamId) {
+    auto own = std::find(conn.streamIds.begin(), conn.streamIds.end(), streamId);
+    if (own == conn.streamIds.end()) return false;
+    conn.streamIds.erase(own);
+
+    for (auto it = streams.begin(); it != streams.end(); ++it) {
+        if ((*it)->getId() != streamId) continue;
+        std::vector<int>& subscribers = (*it)->subscribers;
+        subscribers.erase(std::remove(subscribers.begin(), subscribers.end(), connId), subscribers.end());
+        if (subscribers.empty()) streams.erase(it);
+        break;
+    }
+    return true;
+}
 
-    // Get the server IP address
-    char serverSpeedIP[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(speedAddr.sin_addr), serverSpeedIP, INET_ADDRSTRLEN);
+///	Queues a stream's chunk for one subscriber. A chunk that does not fit
+///	the subscriber's backlog is dropped for that subscriber alone; the
+///	stream sequence shows the gap.
+void MotorServer::queueChunk(ClientConnection& conn, const StreamChunk& chunk) {
+    if (conn.streamBytes + chunk.text->size() > MAX_SPEED_BACKLOG) {
+        conn.droppedLines += chunk.lines;
+        metrics().streamLinesDropped.add(chunk.lines);
+        return;
+    }
+    conn.streamBacklog.push_back(chunk);
+    conn.streamBytes += chunk.text->size();
+}
 
-    // Bind socket to address
-    if (bind(serverSpdSocket, (struct sockaddr*)&speedAddr, sizeof(speedAddr)) < 0) {
-        std::cerr << "SERVER:\tBind speed socket failed\n";
-        return 1;
+void MotorServer::updateStreamMetrics() {
+    size_t subscribers = 0;
+    for (auto& stream : streams) subscribers += stream->subscribers.size();
+    metrics().telemetryStreams.set(streams.size());
+    metrics().telemetrySubscribers.set(subscribers);
+}
+
+///	Adds a sample to a speed session if it is due at the session's rate.
+///	Samples that do not fit the backlog are dropped but keep their sequence
+///	number, so binary clients can see the gap. The text stream only carries
+///	the first motor.
+void MotorServer::appendTelemetry(ClientConnection& conn, const TelemetryFrame& frame) {
+    if (!conn.ticks.due(frame.timestampNs, conn.telemetryRateHz) || (!conn.binaryTelemetry && frame.motor != 0)) return;
+
+    uint32_t sequence = conn.telemetrySeq++;
+    if (conn.binaryTelemetry && !conn.sessionToken.empty()) {
+        TelemetryFrame kept = frame;
+        kept.sequence = sequence;
+        recordFrame(conn, kept);
+    }
+    if (conn.fd < 0) return;
+    if (conn.outBuffer.size() >= MAX_SPEED_BACKLOG) {
+        conn.droppedSamples++;
+        metrics().telemetryDropped.add();
+        return;
     }
-    std::cerr << "SERVER:\tSpeed server socket binded successfully.\n";
 
+    if (conn.binaryTelemetry) {
+        TelemetryFrame out = frame;
+        out.sequence = sequence;
+        conn.outBuffer.append(reinterpret_cast<const char*>(&out), sizeof(out));
+    }
+    else {
+        conn.outBuffer.append(to_string_with_precision(frame.rpm, 2));
+    }
+}
 
-    bool running = true;
-    bool clientSpdConnected = false;
+/// Drops the client's interest in speed measurement and disconnects it
+/// once its responses are sent
+void MotorServer::quitClient(int connId) {
+	LOG_INFO(logServer, "Client %d quit.", connId);
+    removeSpeedMeasureClient(connId);
+	pushResponse(OutMessage{ connId, "", true });
+	wakeNetwork();
+}
+////////////////////////////////////////////////////////////////////////
 
-    while (running) {
-        // SPEED
+//  SESSIONS    ////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+static int64_t steadyNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// 128 random bits in hex
+static std::string newSessionToken() {
+    std::random_device device;
+    char text[33];
+    snprintf(text, sizeof(text), "%08x%08x%08x%08x", device(), device(), device(), device());
+    return text;
+}
 
-        // Listen for incoming connections
-        if (listen(serverSpdSocket, 5) < 0) {
-            std::cerr << "SERVER:\tSpeed listen failed\n";
-            return 1;
+///	SESSION starts a session on the message channel; on the speed channel
+///	SESSION <token> joins one. RESUME <token> [last seq] moves this socket
+///	onto the session's dropped connection. Returns the connection the
+///	socket belongs to afterwards.
+int MotorServer::handleSessionCommand(int connId, const std::string& message) {
+    auto it = connections.find(connId);
+    if (it == connections.end()) return connId;
+
+    std::istringstream iss(message);
+    std::string keyword, token, lastSeq;
+    iss >> keyword >> token >> lastSeq;
+    if (keyword == "RESUME") return resumeSession(connId, token, lastSeq);
+
+    startSession(connId, it->second, token);
+    return connId;
+}
+
+/// Answers a session command; message channel answers are numbered like any response
+static void sessionReply(MotorServer& server, int connId, ClientConnection& conn, const std::string& text) {
+    if (conn.channel == msgChannel) server.sendResponse(connId, text);
+    else conn.outBuffer.append(text).push_back('\n');
+}
+
+void MotorServer::startSession(int connId, ClientConnection& conn, const std::string& token) {
+    std::string response = "<<SERVER>>\t";
+    if (!conn.sessionToken.empty()) {
+        response.append("Session ").append(conn.sessionToken).append(" already started.");
+    }
+    else if (conn.channel == msgChannel) {
+        if (sessions.size() >= MAX_SESSIONS) {
+            response.append("Too many sessions.");
+        }
+        else {
+            std::string created = newSessionToken();
+            sessions[created] = SessionLinks{ connId, -1 };
+            conn.sessionToken = created;
+            response.append("Session ").append(created).append(" started.");
+            LOG_INFO(logServer, "Client %d started a session", connId);
+        }
+    }
+    else {
+        auto found = sessions.find(token);
+        if (found == sessions.end()) {
+            response.append("Session '").append(token).append("' unknown.");
+        }
+        else if (found->second.spdConnId >= 0) {
+            response.append("Session ").append(token).append(" already has a speed connection, RESUME it.");
+        }
+        else {
+            found->second.spdConnId = connId;
+            conn.sessionToken = token;
+            response.append("Speed connection joined session ").append(token).append(".");
         }
+    }
+    sessionReply(*this, connId, conn, response);
+    updateSessionMetrics();
+}
 
-        std::cout << "SERVER:\tSpeed server listening for client connection on " << serverSpeedIP << ":" << recvPort << std::endl;
+///	Moves the socket of 'connId' onto the session's connection for the same
+///	channel, closing that one's socket if it has not noticed the drop yet.
+///	Responses the client missed after 'lastSeq' are replayed first, then
+///	the connection carries on, so running commands still report to it.
+int MotorServer::resumeSession(int connId, const std::string& token, const std::string& lastSeqText) {
+    ClientConnection& conn = connections[connId];
+    auto found = sessions.find(token);
+    int oldId = -1;
+    if (found != sessions.end()) oldId = conn.channel == msgChannel ? found->second.msgConnId : found->second.spdConnId;
+    auto oldIt = connections.find(oldId);
+    if (oldIt == connections.end() || oldId == connId || !conn.sessionToken.empty()) {
+        sessionReply(*this, connId, conn, "<<SERVER>>\tSession '" + token + "' cannot be resumed on this connection.");
+        return connId;
+    }
 
-        // Accept incoming connection
-        if ((newSocket = accept(serverSpdSocket, (struct sockaddr*)&clientSpdAddr, &addrSize)) < 0) {
-            std::cerr << "SERVER:\tAccept speed failed\n";
-            return 1;
+    char* end = nullptr;
+    uint64_t lastSeq = strtoull(lastSeqText.c_str(), &end, 10);
+    bool haveLast = !lastSeqText.empty() && *end == '\0';
+
+    ClientConnection& old = oldIt->second;
+    while (!old.streamIds.empty()) leaveStream(oldId, old, old.streamIds.back());
+    while (!conn.streamIds.empty()) leaveStream(connId, conn, conn.streamIds.back());
+    if (old.fd >= 0) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, old.fd, nullptr);
+        close(old.fd);
+        metrics().connectionsClosed[old.channel].add();
+    }
+    old.fd = conn.fd;
+    old.peer = conn.peer;
+    old.decoder = std::move(conn.decoder);
+    old.outBuffer.clear();
+    old.streamBacklog.clear();
+    old.streamBytes = 0;
+    old.chunkOffset = 0;
+    old.writeArmed = false;
+    old.closing = false;
+    old.detachedNs = 0;
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.u64 = oldId;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, old.fd, &event);
+    connections.erase(connId);
+
+    size_t replayed = 0;
+    uint64_t lost = 0;
+    if (old.channel == msgChannel) {
+        uint64_t first = old.replay.empty() ? old.sessionSeq + 1 : old.replay.front().seq;
+        if (first > lastSeq + 1) lost = first - lastSeq - 1;
+        for (const ReplayEntry& entry : old.replay) {
+            if (entry.seq <= lastSeq) continue;
+            old.outBuffer.append(entry.text);
+            replayed++;
+        }
+        recordResponse(old, "<<SERVER>>\tResumed session " + token + " after " + std::to_string(lastSeq) + ": "
+            + std::to_string(replayed) + " responses replayed, " + std::to_string(lost) + " lost.");
+    }
+    else {
+        // The acknowledgement goes ahead of the binary frames
+        std::string frames;
+        if (haveLast && old.binaryTelemetry) {
+            uint32_t first = old.replayFrames.empty() ? old.telemetrySeq : old.replayFrames.front().sequence;
+            if ((int32_t)(first - (uint32_t)lastSeq) > 1) lost = first - (uint32_t)lastSeq - 1;
+            for (const TelemetryFrame& frame : old.replayFrames) {
+                if ((int32_t)(frame.sequence - (uint32_t)lastSeq) <= 0) continue;
+                frames.append(reinterpret_cast<const char*>(&frame), sizeof(frame));
+                replayed++;
+            }
         }
+        old.outBuffer.append("<<SERVER>>\tResumed session " + token + ": " + std::to_string(replayed) + " frames replayed, "
+            + std::to_string(lost) + " lost.\n").append(frames);
+        updateTelemetryRate();
+        updateStreamMetrics();
+    }
+    metrics().sessionsResumed.add();
+    metrics().responsesReplayed.add(replayed);
+    LOG_INFO(logServer, "Client %d resumed the session of client %d, %zu replayed", connId, oldId, replayed);
+    updateSessionMetrics();
+    return oldId;
+}
 
-        // Get the client IP address
-        char clientSpdIP[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &(clientSpdAddr.sin_addr), clientSpdIP, INET_ADDRSTRLEN);
-        std::cerr << "SERVER:\tSpeed client connected from " << clientSpdIP << '\n';
+///	Numbers a response, keeps it for replay and sends it if attached
+void MotorServer::recordResponse(ClientConnection& conn, const std::string& text) {
+    ReplayEntry entry{ ++conn.sessionSeq, std::to_string(conn.sessionSeq) };
+    entry.text.append("\t").append(text).push_back('\n');
+    if (conn.fd >= 0) conn.outBuffer.append(entry.text);
+
+    conn.replayBytes += entry.text.size();
+    conn.replay.push_back(std::move(entry));
+    while (conn.replay.size() > SESSION_REPLAY_RESPONSES || conn.replayBytes > SESSION_REPLAY_BYTES) {
+        conn.replayBytes -= conn.replay.front().text.size();
+        conn.replay.pop_front();
+    }
+}
 
-        clientSpdSocket = newSocket;
-        clientSpdConnected = true;
+void MotorServer::recordFrame(ClientConnection& conn, const TelemetryFrame& frame) {
+    conn.replayFrames.push_back(frame);
+    if (conn.replayFrames.size() > SESSION_REPLAY_FRAMES) conn.replayFrames.pop_front();
+}
 
-        // Receive data from client
-        ssize_t bytesRead;
-        while ((bytesRead = recv(clientSpdSocket, buffer, BUFFER_SIZE, 0)) > 0 && clientSpdConnected) {
-            std::cout << "SERVER:\tReceived speed from client: " << buffer << std::endl;
-            pushMessage(buffer);
+///	Drops the socket of a connection with a session but keeps the
+///	connection, which collects its output for RESUME. Subscriptions end.
+void MotorServer::detachClient(int connId, ClientConnection& conn) {
+    while (!conn.streamIds.empty()) leaveStream(connId, conn, conn.streamIds.back());
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, conn.fd, nullptr);
+    close(conn.fd);
+    conn.fd = -1;
+    conn.outBuffer.clear();
+    conn.streamBacklog.clear();
+    conn.streamBytes = 0;
+    conn.chunkOffset = 0;
+    conn.writeArmed = false;
+    conn.detachedNs = steadyNowNs();
+    metrics().connectionsClosed[conn.channel].add();
+    LOG_INFO(logServer, "Client %d dropped, its session waits %d s for RESUME", connId, SESSION_LINGER_MS / 1000);
+
+    updateSessionMetrics();
+    if (conn.channel == spdChannel) {
+        updateTelemetryRate();
+        updateStreamMetrics();
+    }
+}
 
-            std::string response = "<<SERVER>>\tCommand '";
-            response.append(buffer).append("'\trecieved.");
-            sendResponse(response);
-
-            memset(buffer, 0, BUFFER_SIZE); // Clear buffer
-        }
-
-		if(clientSpdConnected) {
-			if (bytesRead == 0) {
-				std::cout << "SERVER:\tClient speed channel disconnected.\n";
-				clientSpdConnected = false;
-				clientSpdSocket = -1;
-			}
-			else if (bytesRead == -1) {
-				std::cerr << "SERVER:\tReceive speed failed.\n";
-				clientSpdConnected = false;
-				clientSpdSocket = -2;
-			}
-		}
-
-        close(clientSpdSocket); // Close connection
-            std::cerr << "SERVER:\tClient speed socket closed.\n";
-    }
-    close(serverSpdSocket); // Close server socket
-            std::cerr << "SERVER:\tServer speed socket closed.\n";
-    return 0;
+///	Closes dropped sessions that were not resumed within SESSION_LINGER_MS
+void MotorServer::expireSessions() {
+    if (detachedSessions == 0) return;
+
+    int64_t now = steadyNowNs();
+    std::vector<int> expired;
+    for (auto& entry : connections) {
+        if (entry.second.fd < 0 && now - entry.second.detachedNs >= SESSION_LINGER_MS * 1000000LL) expired.push_back(entry.first);
+    }
+    for (int connId : expired) {
+        LOG_INFO(logServer, "Session of client %d expired", connId);
+        connections[connId].closing = true;
+        closeClient(connId);
+        metrics().sessionsExpired.add();
+    }
 }
 
-/// Sets connection variables to false and stops measuring speed
-void MotorServer::quitClient() {
-	std::cerr << "Client quit.\n";
-	clientMsgConnected = false;
-	clientSpdConnected = false;
-    stopMonitorSpeedMeasure();
+void MotorServer::updateSessionMetrics() {
+    size_t detached = 0;
+    for (auto& entry : connections) {
+        if (entry.second.fd < 0) detached++;
+    }
+    detachedSessions = detached;
+    metrics().sessions.set(sessions.size());
+    metrics().sessionsDetached.set(detached);
 }
+
 ////////////////////////////////////////////////////////////////////////
 
 //  MESSAGE PROCESSING  ////////////////////////////////////////////////
@@ -413,120 +1266,606 @@ void MotorServer::quitClient() {
 
 /// Parse the commands recieved from client and push them to the command queue
 void MotorServer::commandProcessingLoop() {
-    while (true) {
-        while (!messageQueue.empty()) {
-            std::string message = popMessage();
+    ClientMessage message;
+    while (running) {
+        if (!messageQueue.waitPop(message)) continue;
             
-            std::cerr << "CMDPRO:\t" << message << '\n';
+        LOG_DEBUG(logCmdPro, "%s", message.text.c_str());
+
+        ParsedCommand parsed = parseCommand(message.text);
+        CommandTimestamps ts = { message.recvNs, gpio().nowNs(), 0, 0 };
+        if (parsed.error == parseOk && parsed.motor >= motors.size()) parsed.error = errInvalidMotor;
+        if (parsed.error != parseOk) {
+            metrics().commandsRejected.add();
+            journal().command(cmdRejected, parsed.motor, (int)parsed.cmd, parsed.speed, parsed.duration);
+            LOG_WARN(logParser, "%s in '%s'", parseErrorString(parsed.error), message.text.c_str());
+            sendResponse(message.connId, parseErrorResponse(message.text, parsed));
+            continue;
+        }
 
-            std::tuple<mCmd, float, float> cmd = parseCommand(message);
-            std::cerr << "CMDPRO:\tCommand parsed.\n";
-            
-            pushCommand(cmd);
+        // Programs are validated in full here, so a bad one never reaches the motor
+        std::shared_ptr<MotionProgram> program;
+        if (parsed.cmd == mCmd::Program) {
+            program = std::make_shared<MotionProgram>();
+            ProgramError error = parseProgram(std::string_view(message.text).substr(parsed.argsOffset), *program);
+            if (error.reason) {
+                metrics().commandsRejected.add();
+                journal().command(cmdRejected, parsed.motor, (int)parsed.cmd, 0.0f, 0.0f);
+                LOG_WARN(logParser, "Invalid program, statement %d: %s", error.statement, error.reason);
+                std::string response = "<<SERVER>>\tCommand '";
+                response.append(message.text).append("'\trejected: Invalid program");
+                if (error.statement > 0) response.append(", statement ").append(std::to_string(error.statement));
+                sendResponse(message.connId, response.append(": ").append(error.reason).append("."));
+                continue;
+            }
+            parsed.speed = (float)program->segments.size();
+            parsed.duration = program->totalNs / 1e6f;
+        }
+        LOG_DEBUG(logParser, "Parsed command [%s] for motor %d with speed [%g] for [%g]ms.", enumToString(parsed.cmd).c_str(), parsed.motor, parsed.speed, parsed.duration);
             
-            std::cerr << "CMDPRO:\tCommand pushed to queue.\n";
+        // A motor with a full command queue turns the command away, so its
+        // backlog does not hold up the commands for the other motors
+        MotorCommand command{ parsed.cmd, parsed.speed, parsed.duration, message.connId, parsed.motor, ts, message.serial, program };
+        if (!pushCommand(command)) {
+            metrics().commandsBusy.add();
+            LOG_WARN(logCmdPro, "Command queue of motor %d full", command.motor);
+            std::string response = "<<SERVER>>\tCommand '";
+            response.append(message.text).append("'\tdropped, motor ").append(std::to_string(command.motor)).append(" busy.");
+            sendResponse(message.connId, response);
+            continue;
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        journal().command(cmdQueued, command.motor, (int)command.cmd, command.speed, command.duration);
+        LOG_DEBUG(logCmdPro, "Command pushed to queue.");
     }
 }
 
-/// Takes commands from the command queue and executes them
-void MotorServer::commandExecutionLoop() {
-    while (true) {
-        while (!commandQueue.empty()) {
-            std::tuple<mCmd, float, float> command = popCommand();
+/// Takes commands from a motor's command queue and executes them.
+/// Commands a stop cancelled are skipped, or end within a PWM period
+/// if they are running; the stop itself is confirmed here.
+void MotorServer::commandExecutionLoop(MotorUnit& unit) {
+    MotorController& motorController = unit.controller;
+    RingQueue<MotorCommand>& commandQueue = unit.commandQueue;
+    MotorCommand command;
+    std::vector<SegmentTiming> programTiming;
+    while (running) {
+        bool popped = commandQueue.waitPop(command);
+        if (unit.stopPending.load(std::memory_order_acquire)) confirmStop(unit);
+        if (!popped || command.cmd == mCmd::none) continue;
+
+        if (motorController.isCancelled(command.serial)) {
+            metrics().commandsCancelled.add();
+            journal().command(cmdCancelled, command.motor, (int)command.cmd, command.speed, command.duration);
+            sendResponse(command.connId, "<<SERVER>>\tCancelled '" + commandLabel(command) + "'.");
+            continue;
+        }
+        command.ts.dequeueNs = gpio().nowNs();
+        journal().command(cmdStarted, command.motor, (int)command.cmd, command.speed, command.duration);
+        motorController.beginCommand(command.serial);
+        unit.activeConnId.store(command.connId, std::memory_order_release);
 
-            mCmd cmd = std::get<0>(command);
-            float speed = std::get<1>(command);
-            float duration = std::get<2>(command);
+        mCmd cmd = command.cmd;
+        float speed = command.speed;
+        float duration = command.duration;
 
-            std::cerr << "CMDEXE:\tExecuting " << enumToString(cmd) << '\n';
+        LOG_DEBUG(logCmdExe, "Executing %s", enumToString(cmd).c_str());
 
-            if (cmd != mCmd::SpdOn && cmd != mCmd::SpdOff) {
-                std::string exeString = "<<SERVER>>\tExecuting '";
-                exeString.append(enumToString(cmd)).append(" ")
-                    .append(to_string_with_precision(speed, 2)).append("V ")
-                    .append(to_string_with_precision(duration, -1)).append("ms'...");
+        bool isQuery = cmd == mCmd::PwmInfo || cmd == mCmd::LatencyInfo || cmd == mCmd::RtInfo
+            || cmd == mCmd::MetricsInfo || cmd == mCmd::SimInfo;
+        if (cmd != mCmd::SpdOn && cmd != mCmd::SpdOff && !isQuery) {
+            std::string exeString = "<<SERVER>>\tExecuting '";
+            exeString.append(commandLabel(command)).append("'...");
 
-                sendResponse(exeString);
-            }
+            sendResponse(command.connId, exeString);
+        }
 
-            switch (cmd) {
-				case mCmd::rotateCW:
-					motorController.turnCW(speed, duration);
-					break;
-				case mCmd::rotateCCW:
-					motorController.turnCCW(speed, duration);
-					break;
-				case mCmd::SpdOn:
-					startMonitorSpeedMeasure();
-					break;
-				case mCmd::SpdOff:
-					stopMonitorSpeedMeasure();
-					break;
-				case mCmd::Acc:
-					motorController.setAcceleration(speed);
-					break;
-				case mCmd::quit:
-					quitClient();
-					break;
-				default:
-					break;
-            }
-            std::cerr << "CMDEXE:\tCompleted " << enumToString(cmd) << '\n';
-            if (cmd == mCmd::SpdOn || cmd == mCmd::SpdOff) {
-                std::string exeString = "<<SERVER>>\tSpeed measurement set to: '";
-                exeString.append(get_string_from_bool(doSpeedMeasure)).append("'.");
+        switch (cmd) {
+			case mCmd::rotateCW:
+				motorController.armEdgeCapture();
+				motorController.turnCW(speed, duration);
+				command.ts.firstEdgeNs = motorController.getCapturedEdge();
+				recordLatency(unit, command.ts);
+				break;
+			case mCmd::rotateCCW:
+				motorController.armEdgeCapture();
+				motorController.turnCCW(speed, duration);
+				command.ts.firstEdgeNs = motorController.getCapturedEdge();
+				recordLatency(unit, command.ts);
+				break;
+			case mCmd::rotateRpm:
+				motorController.armEdgeCapture();
+				motorController.turnRpm(speed, duration);
+				command.ts.firstEdgeNs = motorController.getCapturedEdge();
+				recordLatency(unit, command.ts);
+				sendResponse(command.connId, controlStatsString(motorController.getControlStats()));
+				break;
+			case mCmd::Program:
+				motorController.armEdgeCapture();
+				motorController.runProgram(*command.program, programTiming);
+				command.ts.firstEdgeNs = motorController.getCapturedEdge();
+				recordLatency(unit, command.ts);
+				if (motorController.isCancelled(command.serial)) break;
+				for (const std::string& line : programReport(*command.program, programTiming)) sendResponse(command.connId, line);
+				break;
+			case mCmd::SpdOn:
+				addSpeedMeasureClient(command.connId);
+				break;
+			case mCmd::SpdOff:
+				removeSpeedMeasureClient(command.connId);
+				break;
+			case mCmd::Acc:
+				motorController.setAcceleration(speed);
+				break;
+			case mCmd::Profile:
+				motorController.setProfileShape((int)speed);
+				break;
+			case mCmd::RpmFilter:
+				motorController.motorMonitor.setFilter((int)speed, (int)duration);
+				break;
+			case mCmd::PwmInfo:
+				sendResponse(command.connId, pwmStatsString(pwmEngine.getStats()));
+				sendResponse(command.connId, pwmTimingString(motorController.getDutyTable()));
+				break;
+			case mCmd::PwmFrequency:
+				// The resolution is kept unless given
+				if (motorController.setPwmTiming((int)speed, duration > 0 ? (int)duration : motorController.getDutyTable().getBits()))
+					sendResponse(command.connId, pwmTimingString(motorController.getDutyTable()));
+				else
+					sendResponse(command.connId, "<<SERVER>>\tPWM frequency must be " + std::to_string(PWM_MIN_FREQUENCY) + " - "
+						+ std::to_string(PWM_MAX_FREQUENCY) + " Hz and resolution " + std::to_string(PWM_MIN_BITS) + " - "
+						+ std::to_string(PWM_MAX_BITS) + " bits.");
+				break;
+			case mCmd::LatencyInfo:
+				sendResponse(command.connId, latencyString(unit));
+				break;
+			case mCmd::RtInfo:
+				sendResponse(command.connId, "<<SERVER>>\t" + realTimeReport());
+				break;
+			case mCmd::MetricsInfo:
+				for (const std::string& line : metricsStrings()) sendResponse(command.connId, line);
+				break;
+			case mCmd::SimInfo:
+				sendResponse(command.connId, simulationString(command.motor));
+				break;
+			case mCmd::quit:
+				// Handled below, once the completion is queued
+				break;
+			default:
+				break;
+        }
+        unit.activeConnId.store(-1, std::memory_order_release);
+
+        if (motorController.isCancelled(command.serial)) {
+            LOG_DEBUG(logCmdExe, "Cancelled %s", enumToString(cmd).c_str());
+            metrics().commandsCancelled.add();
+            journal().command(cmdCancelled, command.motor, (int)cmd, speed, duration);
+            sendResponse(command.connId, "<<SERVER>>\tCancelled '" + commandLabel(command) + "'.");
+            continue;
+        }
+        LOG_DEBUG(logCmdExe, "Completed %s", enumToString(cmd).c_str());
+        journal().command(cmdCompleted, command.motor, (int)cmd, speed, duration);
+        if (cmd == mCmd::SpdOn || cmd == mCmd::SpdOff) {
+            std::string exeString = "<<SERVER>>\tSpeed measurement set to: '";
+            exeString.append(get_string_from_bool(doSpeedMeasure)).append("'.");
 
-                sendResponse(exeString);
-            }
-            else {
-                std::string compString = "<<SERVER>>\tCompleted '";
-                compString.append(enumToString(cmd)).append(" ")
-                    .append(to_string_with_precision(speed, 2)).append("V ")
-                    .append(to_string_with_precision(duration, -1)).append("ms'");
-                sendResponse(compString);
-            }
+            sendResponse(command.connId, exeString);
+        }
+        else if (!isQuery) {
+            std::string compString = "<<SERVER>>\tCompleted '";
+            compString.append(commandLabel(command)).append("'");
+            sendResponse(command.connId, compString);
+        }
+        if (cmd == mCmd::quit) {
+            quitClient(command.connId);
+        }
+
+        // Ramp the motor down once there is nothing left to run; a command
+        // arriving meanwhile takes over from the speed reached so far
+        if (commandQueue.empty()) motorController.stopMotor([&commandQueue]() { return !commandQueue.empty(); });
+    }
+}
+
+///	Sums up how closely a program kept to its plan, then lists the first
+///	PROGRAM_REPORT_SEGMENTS segments with their own deviations
+std::vector<std::string> MotorServer::programReport(const MotionProgram& program, const std::vector<SegmentTiming>& timing) {
+    std::vector<std::string> lines;
+    int64_t startSum = 0, startMax = 0, endSum = 0, endMax = 0;
+    for (const SegmentTiming& t : timing) {
+        int64_t startError = t.startErrorNs < 0 ? -t.startErrorNs : t.startErrorNs;
+        int64_t endError = t.endErrorNs < 0 ? -t.endErrorNs : t.endErrorNs;
+        startSum += startError;
+        endSum += endError;
+        startMax = std::max(startMax, startError);
+        endMax = std::max(endMax, endError);
+    }
+    size_t count = timing.empty() ? 1 : timing.size();
+
+    char text[160];
+    snprintf(text, sizeof(text), "<<SERVER>>\tProgram timing over %zu segments, start deviation mean/max us: %.1f/%.1f, end deviation mean/max us: %.1f/%.1f",
+        timing.size(), startSum / 1000.0 / count, startMax / 1000.0, endSum / 1000.0 / count, endMax / 1000.0);
+    lines.push_back(text);
+
+    for (size_t i = 0; i < timing.size() && i < PROGRAM_REPORT_SEGMENTS; i++) {
+        const ProgramSegment& segment = program.segments[i];
+        const char* name = segment.kind == segmentRpm ? "RPM" : segment.value < 0 ? "CCW" : "CW";
+        float value = segment.kind == segmentRpm ? segment.value : std::fabs(segment.value);
+        snprintf(text, sizeof(text), "<<SERVER>>\tSegment %zu %s %g%s %gms: start %+.1f us, end %+.1f us",
+            i + 1, name, value, segment.kind == segmentRpm ? "" : "V", segment.durationNs / 1e6,
+            timing[i].startErrorNs / 1000.0, timing[i].endErrorNs / 1000.0);
+        lines.push_back(text);
+    }
+    if (timing.size() > PROGRAM_REPORT_SEGMENTS) {
+        lines.push_back("<<SERVER>>\t... " + std::to_string(timing.size() - PROGRAM_REPORT_SEGMENTS) + " more segments");
+    }
+    return lines;
+}
+
+///	Waits for the PWM engine to cut a stopped motor, reports how long that
+///	took from the stop's arrival and lets the motor be driven again
+void MotorServer::confirmStop(MotorUnit& unit) {
+    MotorController& controller = unit.controller;
+    unit.stopPending.store(false, std::memory_order_relaxed);
+    int connId = unit.stopConnId.load(std::memory_order_relaxed);
+    int64_t recvNs = unit.stopRecvNs.load(std::memory_order_relaxed);
+
+    int64_t haltNs = 0;
+    int64_t deadline = gpio().nowNs() + (int64_t)STOP_CONFIRM_TIMEOUT_MS * 1000000;
+    bool applied = controller.waitStopApplied(deadline, haltNs);
+    controller.clearStop();
+    journal().command(cmdCompleted, controller.getId(), (int)mCmd::Stop, 0.0f, 0.0f);
+
+    std::string str = "<<SERVER>>\tStopped";
+    if (motors.size() > 1) str.append(" motor ").append(std::to_string(controller.getId()));
+    if (!applied) {
+        LOG_WARN(logCmdExe, "Stop of motor %d not confirmed by the PWM engine", controller.getId());
+        if (connId >= 0) sendResponse(connId, str.append(", output not confirmed low."));
+        return;
+    }
+
+    int64_t latency = haltNs > recvNs ? haltNs - recvNs : 0;
+    metrics().stopLatency[controller.getId()].record(latency);
+    LOG_INFO(logCmdExe, "Motor %d stopped %lld us after the request", controller.getId(), (long long)(latency / 1000));
+    if (connId >= 0) {
+        str.append(": output low ").append(to_string_with_precision(latency / 1000.0f, 1)).append(" us after receipt.");
+        sendResponse(connId, str);
+    }
+}
+////////////////////////////////////////////////////////////////////////
+
+//  METRICS ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+static const char* const CHANNEL_NAMES[METRIC_CHANNELS] = { "message", "speed", "metrics" };
 
+///	Formats p50/p99/p99.9/max of a histogram in microseconds
+static std::string percentileString(const HistogramSnapshot& snapshot) {
+    char text[96];
+    snprintf(text, sizeof(text), "%.1f/%.1f/%.1f/%.1f",
+        snapshot.percentile(0.5) / 1000.0, snapshot.percentile(0.99) / 1000.0,
+        snapshot.percentile(0.999) / 1000.0, snapshot.maxNs / 1000.0);
+    return text;
+}
+
+///	Refreshes the queue depth gauges from the queues themselves
+void MotorServer::sampleQueueDepths() {
+    ServerMetrics& m = metrics();
+    m.queueDepth[queueMessage].set(messageQueue.size());
+    m.queueDepth[queueResponse].set(responseQueue.size());
+    m.queueDepth[queueSpeed].set(speedQueue.size());
+    size_t commands = 0;
+    for (auto& unit : motors) commands += unit->commandQueue.size();
+    m.queueDepth[queueCommand].set(commands);
+}
+
+///	Formats the metrics for the client, one response line per group
+std::vector<std::string> MotorServer::metricsStrings() {
+    ServerMetrics& m = metrics();
+    HistogramSnapshot snapshot;
+    std::vector<std::string> lines;
+    sampleQueueDepths();
+
+    std::string str;
+    for (size_t id = 0; id < motors.size(); id++) {
+        str = "<<SERVER>>\tMetrics ";
+        if (motors.size() > 1) str.append("motor ").append(std::to_string(id)).append(" ");
+        str.append("latency p50/p99/p99.9/max us:");
+        for (int stage = 0; stage < stageCount; stage++) {
+            m.stageLatency[id][stage].snapshot(snapshot);
+            str.append(stage ? ", " : " ").append(metricStageName((metricStage)stage))
+                .append(" ").append(percentileString(snapshot));
         }
-        motorController.stopMotor();
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        lines.push_back(str.append(" over ").append(std::to_string(snapshot.count)).append(" commands"));
+    }
+
+    str = "<<SERVER>>\tMetrics queues depth/peak/full:";
+    for (int queue = 0; queue < queueCount; queue++) {
+        str.append(queue ? ", " : " ").append(metricQueueName((metricQueue)queue))
+            .append(" ").append(std::to_string(m.queueDepth[queue].get()))
+            .append("/").append(std::to_string(m.queueDepth[queue].getPeak()))
+            .append("/").append(std::to_string(m.queueFull[queue].get()));
+    }
+    lines.push_back(str);
+
+    PwmStats pwm = pwmEngine.getStats();
+    m.pwmLateness.snapshot(snapshot);
+    str = "<<SERVER>>\tMetrics PWM periods: ";
+    str.append(std::to_string(pwm.periods)).append(" overruns: ").append(std::to_string(pwm.overruns))
+        .append(" updates: ").append(std::to_string(m.pwmUpdates.get()))
+        .append(" lateness p50/p99/p99.9/max us: ").append(percentileString(snapshot));
+    lines.push_back(str);
+
+    for (size_t id = 0; id < motors.size(); id++) {
+        m.edgeInterval[id].snapshot(snapshot);
+        str = "<<SERVER>>\tMetrics ";
+        if (motors.size() > 1) str.append("motor ").append(std::to_string(id)).append(" ");
+        str.append("edges: ").append(std::to_string(snapshot.count))
+            .append(" missed: ").append(std::to_string(motors[id]->controller.motorMonitor.getMissedEdges()))
+            .append(" interval p50/p99/p99.9/max us: ").append(percentileString(snapshot));
+        lines.push_back(str);
+    }
+
+    for (size_t id = 0; id < motors.size(); id++) {
+        m.stopLatency[id].snapshot(snapshot);
+        str = "<<SERVER>>\tMetrics ";
+        if (motors.size() > 1) str.append("motor ").append(std::to_string(id)).append(" ");
+        str.append("stops: ").append(std::to_string(snapshot.count))
+            .append(" latency p50/p99/p99.9/max us: ").append(percentileString(snapshot));
+        lines.push_back(str);
+    }
+
+    str = "<<SERVER>>\tMetrics commands accepted/rejected/busy/cancelled: ";
+    str.append(std::to_string(m.commandsAccepted.get()))
+        .append("/").append(std::to_string(m.commandsRejected.get()))
+        .append("/").append(std::to_string(m.commandsBusy.get()))
+        .append("/").append(std::to_string(m.commandsCancelled.get()))
+        .append(" telemetry samples/dropped: ").append(std::to_string(m.telemetrySamples.get()))
+        .append("/").append(std::to_string(m.telemetryDropped.get()))
+        .append(" streams/subscribers: ").append(std::to_string(m.telemetryStreams.get()))
+        .append("/").append(std::to_string(m.telemetrySubscribers.get()))
+        .append(" stream lines dropped: ").append(std::to_string(m.streamLinesDropped.get()))
+        .append(" multicast frames/datagrams/dropped: ").append(std::to_string(m.multicastFrames.get()))
+        .append("/").append(std::to_string(m.multicastDatagrams.get()))
+        .append("/").append(std::to_string(m.multicastDropped.get()))
+        .append(" sessions open/detached/resumed/expired: ").append(std::to_string(m.sessions.get()))
+        .append("/").append(std::to_string(m.sessionsDetached.get()))
+        .append("/").append(std::to_string(m.sessionsResumed.get()))
+        .append("/").append(std::to_string(m.sessionsExpired.get()))
+        .append(" replayed: ").append(std::to_string(m.responsesReplayed.get()))
+        .append(" threads started: ").append(std::to_string(m.threadsStarted.get()));
+    lines.push_back(str);
+
+    str = "<<SERVER>>\tMetrics connections open/total, bytes sent/received:";
+    for (int channel = 0; channel < METRIC_CHANNELS; channel++) {
+        uint64_t opened = m.connectionsOpened[channel].get();
+        str.append(channel ? ", " : " ").append(CHANNEL_NAMES[channel])
+            .append(" ").append(std::to_string(opened - m.connectionsClosed[channel].get()))
+            .append("/").append(std::to_string(opened))
+            .append(" ").append(std::to_string(m.bytesSent[channel].get()))
+            .append("/").append(std::to_string(m.bytesReceived[channel].get()));
+    }
+    lines.push_back(str);
+    return lines;
+}
+
+///	Formats every metric in the Prometheus text format
+std::string MotorServer::metricsText() {
+    ServerMetrics& m = metrics();
+    HistogramSnapshot snapshot;
+    PrometheusWriter out;
+    sampleQueueDepths();
+
+    out.family("motor_command_latency_seconds", "histogram", "Command path latency per stage, up to the first PWM edge.");
+    for (size_t id = 0; id < motors.size(); id++) {
+        for (int stage = 0; stage < stageCount; stage++) {
+            m.stageLatency[id][stage].snapshot(snapshot);
+            out.histogram("motor_command_latency_seconds", "motor=\"" + std::to_string(id)
+                + "\",stage=\"" + metricStageName((metricStage)stage) + "\"", snapshot);
+        }
+    }
+    out.family("motor_commands_total", "counter", "Commands received, by outcome.");
+    out.sample("motor_commands_total", "result=\"accepted\"", m.commandsAccepted.get());
+    out.sample("motor_commands_total", "result=\"rejected\"", m.commandsRejected.get());
+    out.sample("motor_commands_total", "result=\"busy\"", m.commandsBusy.get());
+    out.sample("motor_commands_total", "result=\"cancelled\"", m.commandsCancelled.get());
+    out.family("motor_stop_latency_seconds", "histogram", "Time from a STOP arriving to the motor output being low.");
+    for (size_t id = 0; id < motors.size(); id++) {
+        m.stopLatency[id].snapshot(snapshot);
+        out.histogram("motor_stop_latency_seconds", "motor=\"" + std::to_string(id) + "\"", snapshot);
     }
+
+    out.family("motor_queue_depth", "gauge", "Items waiting in a server queue.");
+    for (int queue = 0; queue < queueCount; queue++)
+        out.sample("motor_queue_depth", std::string("queue=\"") + metricQueueName((metricQueue)queue) + "\"", m.queueDepth[queue].get());
+    out.family("motor_queue_depth_peak", "gauge", "Highest depth a push left a server queue at.");
+    for (int queue = 0; queue < queueCount; queue++)
+        out.sample("motor_queue_depth_peak", std::string("queue=\"") + metricQueueName((metricQueue)queue) + "\"", m.queueDepth[queue].getPeak());
+    out.family("motor_queue_full_total", "counter", "Pushes refused or held back by a full queue.");
+    for (int queue = 0; queue < queueCount; queue++)
+        out.sample("motor_queue_full_total", std::string("queue=\"") + metricQueueName((metricQueue)queue) + "\"", m.queueFull[queue].get());
+
+    PwmStats pwm = pwmEngine.getStats();
+    out.family("motor_pwm_periods_total", "counter", "PWM periods driven.");
+    out.sample("motor_pwm_periods_total", "", pwm.periods);
+    out.family("motor_pwm_overruns_total", "counter", "PWM periods whose deadline had already passed.");
+    out.sample("motor_pwm_overruns_total", "", pwm.overruns);
+    out.family("motor_pwm_updates_total", "counter", "Output settings published to the PWM engine.");
+    out.sample("motor_pwm_updates_total", "", m.pwmUpdates.get());
+    m.pwmLateness.snapshot(snapshot);
+    out.family("motor_pwm_wake_lateness_seconds", "histogram", "PWM thread wake-up lateness against edge deadlines.");
+    out.histogram("motor_pwm_wake_lateness_seconds", "", snapshot);
+
+    out.family("motor_edge_interval_seconds", "histogram", "Time between magnet sensor edges.");
+    for (size_t id = 0; id < motors.size(); id++) {
+        m.edgeInterval[id].snapshot(snapshot);
+        out.histogram("motor_edge_interval_seconds", "motor=\"" + std::to_string(id) + "\"", snapshot);
+    }
+    out.family("motor_edges_missed_total", "counter", "Magnet edges lost to a full edge ring.");
+    for (size_t id = 0; id < motors.size(); id++)
+        out.sample("motor_edges_missed_total", "motor=\"" + std::to_string(id) + "\"", motors[id]->controller.motorMonitor.getMissedEdges());
+    out.family("motor_rpm", "gauge", "Latest measured speed.");
+    for (size_t id = 0; id < motors.size(); id++)
+        out.sample("motor_rpm", "motor=\"" + std::to_string(id) + "\"", motors[id]->controller.motorMonitor.getRpm());
+
+    out.family("motor_telemetry_samples_total", "counter", "Speed samples taken for the speed channel.");
+    out.sample("motor_telemetry_samples_total", "", m.telemetrySamples.get());
+    out.family("motor_telemetry_dropped_total", "counter", "Speed samples lost to a full queue or client backlog.");
+    out.sample("motor_telemetry_dropped_total", "", m.telemetryDropped.get());
+    out.family("motor_telemetry_streams", "gauge", "Distinct telemetry subscription streams.");
+    out.sample("motor_telemetry_streams", "", m.telemetryStreams.get());
+    out.family("motor_telemetry_subscribers", "gauge", "Telemetry subscriptions over all streams.");
+    out.sample("motor_telemetry_subscribers", "", m.telemetrySubscribers.get());
+    out.family("motor_stream_lines_dropped_total", "counter", "Subscription lines lost to a full client backlog.");
+    out.sample("motor_stream_lines_dropped_total", "", m.streamLinesDropped.get());
+    out.family("motor_multicast_frames_total", "counter", "Telemetry frames sent on the UDP multicast channel.");
+    out.sample("motor_multicast_frames_total", "", m.multicastFrames.get());
+    out.family("motor_multicast_datagrams_total", "counter", "Datagrams sent on the UDP multicast channel.");
+    out.sample("motor_multicast_datagrams_total", "", m.multicastDatagrams.get());
+    out.family("motor_multicast_dropped_total", "counter", "Telemetry frames the UDP multicast socket did not take.");
+    out.sample("motor_multicast_dropped_total", "", m.multicastDropped.get());
+    out.family("motor_sessions", "gauge", "Client sessions, attached or waiting for RESUME.");
+    out.sample("motor_sessions", "", m.sessions.get());
+    out.family("motor_sessions_detached", "gauge", "Client sessions whose connection dropped.");
+    out.sample("motor_sessions_detached", "", m.sessionsDetached.get());
+    out.family("motor_sessions_resumed_total", "counter", "Client sessions resumed on a new connection.");
+    out.sample("motor_sessions_resumed_total", "", m.sessionsResumed.get());
+    out.family("motor_sessions_expired_total", "counter", "Dropped client sessions not resumed in time.");
+    out.sample("motor_sessions_expired_total", "", m.sessionsExpired.get());
+    out.family("motor_responses_replayed_total", "counter", "Responses and telemetry frames sent again on RESUME.");
+    out.sample("motor_responses_replayed_total", "", m.responsesReplayed.get());
+
+    out.family("motor_threads_started_total", "counter", "Worker threads started; each is reused until shutdown.");
+    out.sample("motor_threads_started_total", "", m.threadsStarted.get());
+
+    out.family("motor_bytes_sent_total", "counter", "Bytes written to client sockets.");
+    for (int channel = 0; channel < METRIC_CHANNELS; channel++)
+        out.sample("motor_bytes_sent_total", std::string("channel=\"") + CHANNEL_NAMES[channel] + "\"", m.bytesSent[channel].get());
+    out.family("motor_bytes_received_total", "counter", "Bytes read from client sockets.");
+    for (int channel = 0; channel < METRIC_CHANNELS; channel++)
+        out.sample("motor_bytes_received_total", std::string("channel=\"") + CHANNEL_NAMES[channel] + "\"", m.bytesReceived[channel].get());
+    out.family("motor_connections", "gauge", "Open client connections.");
+    for (int channel = 0; channel < METRIC_CHANNELS; channel++)
+        out.sample("motor_connections", std::string("channel=\"") + CHANNEL_NAMES[channel] + "\"",
+            m.connectionsOpened[channel].get() - m.connectionsClosed[channel].get());
+    out.family("motor_connections_total", "counter", "Client connections accepted.");
+    for (int channel = 0; channel < METRIC_CHANNELS; channel++)
+        out.sample("motor_connections_total", std::string("channel=\"") + CHANNEL_NAMES[channel] + "\"", m.connectionsOpened[channel].get());
+
+    out.family("motor_log_dropped_total", "counter", "Log messages dropped by a full log ring.");
+    out.sample("motor_log_dropped_total", "", logger().getDropped());
+    return out.str();
+}
+
+///	Wraps the metrics text in a minimal HTTP/1.0 response
+std::string MotorServer::metricsHttpResponse() {
+    std::string body = metricsText();
+    std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ";
+    response.append(std::to_string(body.size())).append("\r\nConnection: close\r\n\r\n").append(body);
+    return response;
 }
+
 ////////////////////////////////////////////////////////////////////////
 
 //  SPEED MEASUREMENT   ////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////
 
-///	Enqueues speed data to be sent
+///	Takes one telemetry sample of a motor's state
+TelemetryFrame MotorServer::sampleTelemetry(const MotorUnit& unit, int64_t nowNs) {
+    const MotorController& controller = unit.controller;
+    TelemetryFrame frame = {};
+    frame.magic = TELEMETRY_MAGIC;
+    frame.size = sizeof(TelemetryFrame);
+    frame.timestampNs = nowNs;
+    frame.rpm = controller.motorMonitor.getRpm();
+    frame.motor = (uint8_t)controller.getId();
+
+    PwmOutput out = controller.getOutput();
+    if (out.pin >= 0 && out.periodNs > 0) {
+        frame.duty = (uint16_t)((out.onNs * 65535) / out.periodNs);
+        frame.direction = out.pin == controller.getPins().cw ? dirCW : dirCCW;
+    }
+    return frame;
+}
+
+///	Samples every motor at the rate the sessions need and enqueues the
+///	samples in batches, so fast sessions cost one wakeup per TELEMETRY_BATCH_NS
 void MotorServer::measureSpeedLoop() {
-    while (doSpeedMeasure) {
-        sendSpeed(to_string_with_precision(rpm, 2));
-        delay(100);
+    TelemetryBatch batch;
+    int64_t next = gpio().nowNs();
+
+    while (true) {
+        if (!doSpeedMeasure) {
+            std::lock_guard<std::mutex> lock(speedMeasureMutex);
+            if (!doSpeedMeasure) {
+                samplerActive = false;
+                break;
+            }
+        }
+        int64_t period = 1000000000LL / telemetryRateHz.load();
+        int64_t sampleNs = gpio().nowNs();
+        for (auto& unit : motors) batch.push_back(sampleTelemetry(*unit, sampleNs));
+        metrics().telemetrySamples.add(motors.size());
+
+        int64_t now = gpio().nowNs();
+        if (batch.size() + motors.size() > TELEMETRY_BATCH_MAX || now + period - batch.front().timestampNs > TELEMETRY_BATCH_NS) {
+            sendSpeed(std::move(batch));
+            batch = TelemetryBatch();
+            batch.reserve(TELEMETRY_BATCH_MAX);
+        }
+
+        next += period;
+        if (next < now) next = now;	// skip samples missed during a stall
+        gpio().sleepUntilNs(next);
     }
-    std::cerr << "LOOP MEASURE STOP\n";
+    if (!batch.empty()) sendSpeed(std::move(batch));
+    LOG_DEBUG(logMonitor, "Speed sampling stopped");
 }
 
 ////////////////////////////////////////////////////////////////////////
 
-///	Sets up the controller and monitor and starts the server's threads
+///	Sets up the controllers and monitors and runs the server's loops on
+///	its workers. Returns once the network loop has ended and every worker
+///	is joined.
 void MotorServer::startServer() {
-    motorController.setupController();
+    for (auto& unit : motors) {
+        unit->controller.setupController();
+        if (!unit->controller.setPwmTiming(pwmFrequency, pwmBits))
+            LOG_WARN(logServer, "PWM %d Hz, %d bits is out of range, motor %d keeps %d Hz, %d bits", pwmFrequency, pwmBits,
+                unit->controller.getId(), unit->controller.getDutyTable().getFrequency(), unit->controller.getDutyTable().getBits());
+        if (!unit->controller.motorMonitor.setPulsesPerRevolution(pulsesPerRevolution))
+            LOG_WARN(logServer, "%d pulses per revolution is out of range, motor %d keeps %d", pulsesPerRevolution,
+                unit->controller.getId(), defaultPulsesPerRevolution);
+    }
+    running = true;
     
     //  start command processing loop
-    std::thread([this]() { this->commandProcessingLoop(); }).detach();
-
-    //  start command execution loop
-    std::thread([this]() { this->commandExecutionLoop(); }).detach();
+    processingWorker->run([this]() { this->commandProcessingLoop(); });
 
-    // start response thread
-    std::thread([this]() { this->responseLoop(); }).detach();
-
-    //  start speed listening loop
-    std::thread([this]() { this->speedLoop(); }).detach();
+    //  start a command execution loop per motor
+    for (size_t id = 0; id < motors.size(); id++) {
+        MotorUnit* motor = motors[id].get();
+        executionWorkers[id]->run([this, motor]() { this->commandExecutionLoop(*motor); });
+    }
 
-    //  start server listening loop
-    std::thread([this]() { this->serverLoop(); }).join();
+    //  run network loop until stopServer
+    networkWorker->run([this]() { this->networkLoop(); });
+    networkWorker->wait();
 
+    // Running commands are cut like a stop; queued ones are left unrun
+    running = false;
+    stopMonitorSpeedMeasure();
+    for (auto& unit : motors) {
+        if (unit->activeConnId.load(std::memory_order_acquire) >= 0) requestStop(*unit, -1, gpio().nowNs());
+    }
+    executor.shutdown([this]() {
+        messageQueue.notifyAll();
+        for (auto& unit : motors) unit->commandQueue.notifyAll();
+    });
+    LOG_DEBUG(logServer, "Server workers joined.");
 }
 
+///	Stops the network loop; startServer returns once all sockets are closed
+void MotorServer::stopServer() {
+    running = false;
+    wakeNetwork();
+    messageQueue.notifyAll();
+    for (auto& unit : motors) unit->commandQueue.notifyAll();
+}
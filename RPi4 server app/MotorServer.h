@@ -1,18 +1,37 @@
 #include "MotorController.h"
+#include "RingQueue.h"
+#include "CommandDecoder.h"
+#include "CommandParser.h"
+#include "Telemetry.h"
+#include "TelemetryStream.h"
+#include "TelemetryMulticast.h"
+#include "Metrics.h"
+#include "Executor.h"
+#include "SimGpioBackend.h"
 
 #include <iostream>
 #include <cstring>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <queue>
+#include <fcntl.h>
+#include <errno.h>
 #include <thread>
-#include <mutex>
 #include <chrono> 
 #include <sstream>
 #include <vector>
 #include <string>
+#include <atomic>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
 
 
 //  CORE    ////////////////////////////////////////////////////////////
@@ -20,75 +39,285 @@
 
 constexpr int recvPort = 12345;
 constexpr int speedPort = 12346;
+constexpr int metricsPort = 12347;			// Prometheus text, loopback only
+constexpr const char* METRICS_ADDRESS = "127.0.0.1";
 constexpr int BUFFER_SIZE = 1024;
+constexpr int MAX_EVENTS = 64;
+constexpr size_t MAX_SPEED_BACKLOG = 64 * 1024;	// unsent telemetry kept per connection
+
+constexpr size_t MESSAGE_QUEUE_SIZE = 1024;
+constexpr size_t RESPONSE_QUEUE_SIZE = 4096;
+constexpr size_t SPEED_QUEUE_SIZE = 1024;
+constexpr size_t COMMAND_QUEUE_SIZE = 256;
+constexpr int STOP_CONFIRM_TIMEOUT_MS = 50;		// longest wait for the PWM engine to cut a stopped motor
+constexpr size_t PROGRAM_REPORT_SEGMENTS = 32;	// segments listed one by one after a program
+constexpr int FLUSH_IOV_MAX = 16;				// buffers handed to one sendmsg
+constexpr size_t MAX_SESSIONS = 64;
+constexpr size_t SESSION_REPLAY_RESPONSES = 256;	// responses a session keeps for RESUME
+constexpr size_t SESSION_REPLAY_BYTES = 64 * 1024;
+constexpr size_t SESSION_REPLAY_FRAMES = 4096;		// binary telemetry frames a session keeps for RESUME
+constexpr int SESSION_LINGER_MS = 30000;			// how long a dropped session waits for RESUME
+constexpr int SESSION_EXPIRY_CHECK_MS = 1000;
+
+
+enum mChannel {
+    msgChannel = 0,
+    spdChannel,
+    metricsChannel
+};
+
+static_assert(metricsChannel < METRIC_CHANNELS, "every channel has its traffic metrics");
+static_assert(MAX_MOTORS <= METRIC_MOTORS, "every motor has its latency metrics");
+
+/// A response kept for replay, numbered and framed as it was sent
+struct ReplayEntry {
+    uint64_t seq;
+    std::string text;
+};
+
+/// Connections carrying a session, -1 for a channel that has not joined
+struct SessionLinks {
+    int msgConnId;
+    int spdConnId;
+};
 
+/// A connected client socket, owned by the network loop
+struct ClientConnection {
+    int fd = -1;
+    mChannel channel = msgChannel;
+    std::string peer;
+    std::string outBuffer;		// data not yet accepted by the socket
+    bool writeArmed = false;	// waiting for EPOLLOUT
+    bool closing = false;		// close once outBuffer is flushed
+    CommandDecoder decoder;		// splits the received stream into commands
+    
+    // Telemetry session, speed channel only
+    bool binaryTelemetry = false;
+    int telemetryRateHz = TELEMETRY_TEXT_RATE;
+    TickDecimator ticks;
+    uint32_t telemetrySeq = 0;
+    uint64_t droppedSamples = 0;
+    
+    // Subscriptions replace the session above. Their chunks are shared with
+    // the other subscribers and queued here until the socket takes them.
+    std::vector<int> streamIds;
+    std::deque<StreamChunk> streamBacklog;
+    size_t streamBytes = 0;		// queued chunk bytes, counted against MAX_SPEED_BACKLOG
+    size_t chunkOffset = 0;		// bytes of the front chunk already sent
+    uint64_t droppedLines = 0;
+    
+    // Session: output is numbered and the latest kept, so a client that
+    // reconnects with RESUME gets what it missed. A dropped connection with
+    // a session stays, without a socket (fd -1), and keeps filling the ring.
+    std::string sessionToken;		// empty without a session
+    uint64_t sessionSeq = 0;		// number of the latest response
+    std::deque<ReplayEntry> replay;	// message channel
+    size_t replayBytes = 0;
+    std::deque<TelemetryFrame> replayFrames;	// speed channel, binary mode
+    int64_t detachedNs = 0;			// steady clock, when the socket went
+};
+
+/// Data addressed to a single client connection
+struct OutMessage {
+    int connId;
+    std::string text;
+    bool close;
+};
 
-enum mCmd {
-    none = 0,
-    rotateCW,
-    rotateCCW,
-    SpdOn,
-    SpdOff,
-    Acc,
-    quit
+/// Client message tagged with the connection it arrived on
+struct ClientMessage {
+    int connId;
+    std::string text;
+    int64_t recvNs;
+    uint32_t serial;		// stops requested before it arrived
+};
+
+/// Backend clock timestamps of a command on its way to the motor, ns
+struct CommandTimestamps {
+    int64_t recvNs;			// read from the socket
+    int64_t parseNs;		// parsed into a command
+    int64_t dequeueNs;		// taken by the execution loop
+    int64_t firstEdgeNs;	// first PWM period driven for it, 0 if none
+};
+
+/// Running figures for one stage of the command path
+struct StageLatency {
+    uint64_t count;
+    int64_t sumNs;
+    int64_t maxNs;
+    int64_t lastNs;
+};
+
+/// Parsed command and the connection its responses go to
+struct MotorCommand {
+    mCmd cmd;
+    float speed;
+    float duration;
+    int connId;
+    int motor;
+    CommandTimestamps ts;
+    uint32_t serial;		// a stop with a higher serial cancels it
+    std::shared_ptr<const MotionProgram> program;	// PROG only
+};
+
+/// One motor with the commands waiting for it. Each unit has its own
+/// execution thread; all of them share the server's PWM engine.
+struct MotorUnit {
+    MotorController controller;
+    RingQueue<MotorCommand> commandQueue;
+    
+    // Command path latency, only touched by the unit's execution thread
+    StageLatency parseLatency, queueLatency, actuationLatency, totalLatency;
+    
+    // Latest stop, set by the network thread and reported by the execution thread
+    std::atomic<bool> stopPending;
+    std::atomic<int> stopConnId;			// -1 when nobody waits for the report
+    std::atomic<int64_t> stopRecvNs;
+    std::atomic<int> activeConnId;			// client of the running command, -1 if none
+    
+    MotorUnit(int id, const MotorPins& pins, PwmEngine& engine);
 };
 
 class MotorServer {
 private:
-    bool doSpeedMeasure;
-    float rpm;
-    bool clientMsgConnected;
-	bool clientSpdConnected;
+    std::atomic<bool> running;
+    std::atomic<bool> doSpeedMeasure;
+    std::mutex speedMeasureMutex;		// orders TSI and TSO from several threads
+    bool samplerActive;				// the sampling loop has not decided to return; guarded by speedMeasureMutex
+    std::atomic<bool> multicastOn;		// the multicast channel is open and keeps measurement on
+    std::unordered_set<int> speedMeasureClients;	// message connections that sent TSI; guarded by speedMeasureMutex
 	
-    std::queue<std::string> messageQueue; // Queue to store received messages
-    std::queue<std::string> responseQueue; // Queue to store messages to send
-    std::queue<std::string> speedQueue; // Queue to store speed to send
-    std::queue<std::tuple<mCmd, float, float>> commandQueue; // Queue to store commands to execute
-	
-	// Mutex to synchronize access to the queues
-    std::mutex messageMutex, speedMutex, responseMutex, commandMutex; 
+    // Bounded lock-free queues; consumers sleep on them while idle
+    RingQueue<ClientMessage> messageQueue; // Queue to store received messages
+    RingQueue<OutMessage> responseQueue; // Queue to store messages to send
+    RingQueue<SharedTelemetryBatch> speedQueue; // Queue to store speed to send
+    
+    // Motors, each with its queue of commands to execute
+    PwmEngine pwmEngine;
+    std::vector<std::unique_ptr<MotorUnit>> motors;
+    
+    bool pushMessage(ClientMessage);
+    bool pushResponse(OutMessage);
+    bool pushSpeed(SharedTelemetryBatch);
+    bool pushCommand(MotorCommand);
+    
+    bool popMessage(ClientMessage&);
+    bool popResponse(OutMessage&);
+    bool popSpeed(SharedTelemetryBatch&);
+    
+    // Network loop state, only touched by the network thread
+    int epollFd;
+    int wakeFd;
+    int nextConnId;
+    std::unordered_map<int, ClientConnection> connections;
+    std::vector<std::string> decoded;
     
-    void pushMessage(std::string);
-    void pushResponse(std::string);
-    void pushSpeed(std::string);
-    void pushCommand(std::tuple<mCmd, float, float>);
+    // Sample rate the telemetry sessions need, set by the network thread
+    std::atomic<int> telemetryRateHz;
+    void updateTelemetryRate();
+    void handleSpeedCommand(int connId, const std::string& message);
+    void appendTelemetry(ClientConnection& conn, const TelemetryFrame& frame);
     
-    std::string popMessage();
-    std::string popResponse();
-    std::string popSpeed();
-    std::tuple<mCmd, float, float> popCommand();
+    // Subscription streams, one per distinct spec, only touched by the network thread
+    std::vector<std::unique_ptr<TelemetryStream>> streams;
+    int nextStreamId;
+    void subscribe(int connId, ClientConnection& conn, const std::string& args);
+    void unsubscribe(int connId, ClientConnection& conn, const std::string& args);
+    bool leaveStream(int connId, ClientConnection& conn, int streamId);
+    void queueChunk(ClientConnection& conn, const StreamChunk& chunk);
+    void updateStreamMetrics();
+    
+    // Sessions by token, only touched by the network thread
+    std::unordered_map<std::string, SessionLinks> sessions;
+    size_t detachedSessions;
+    int handleSessionCommand(int connId, const std::string& message);
+    void startSession(int connId, ClientConnection& conn, const std::string& token);
+    int resumeSession(int connId, const std::string& token, const std::string& lastSeq);
+    void recordResponse(ClientConnection& conn, const std::string& text);
+    void recordFrame(ClientConnection& conn, const TelemetryFrame& frame);
+    void detachClient(int connId, ClientConnection& conn);
+    void expireSessions();
+    void updateSessionMetrics();
+    
+    // UDP telemetry for passive observers, only touched by the network thread
+    TelemetryMulticast multicastSender;
+    TelemetryFrame sampleTelemetry(const MotorUnit& motor, int64_t nowNs);
+    
+    void recordLatency(MotorUnit&, const CommandTimestamps&);
+    
+    void sampleQueueDepths();
+    std::string metricsHttpResponse();
+    
+    int openListener(const char* address, int port, const char* name);
+    void acceptClients(int listenSocket, mChannel channel);
+    void readClient(int connId);
+    void handleClientData(int connId, const std::string& message, int64_t recvNs);
+    bool handlePriorityCommand(int connId, const std::string& message, int64_t recvNs);
+    
+    // Stops, numbered by the network thread in the order they arrive
+    uint32_t stopSerial;
+    void requestStop(MotorUnit& unit, int connId, int64_t recvNs);
+    void confirmStop(MotorUnit& unit);
+    void flushClient(int connId);
+    void closeClient(int connId);
+    void dispatchOutgoing();
+    void wakeNetwork();
+    
+    // Long-lived loops; declared last so they are joined before anything they use goes
+    Executor executor;
+    Worker* networkWorker;
+    Worker* processingWorker;
+    Worker* samplerWorker;
+    std::vector<Worker*> executionWorkers;		// one per motor
     
 public:
+    explicit MotorServer(const std::vector<MotorPins>& motorPins = { defaultMotorPins });
+    
     std::string enumToString(mCmd);
     float absoluteValue(float);
     std::string to_string_with_precision(float, int);
     std::string get_string_from_bool(bool);
-    std::tuple<mCmd, float, float> parseCommand(std::string);
+    std::string pwmStatsString(const PwmStats&);
+    std::string pwmTimingString(const DutyTable&);
+    std::string controlStatsString(const ControlStats&);
+    std::string latencyString(const MotorUnit&);
+    std::string commandLabel(const MotorCommand&);
+    std::vector<std::string> programReport(const MotionProgram&, const std::vector<SegmentTiming>&);
+    std::vector<std::string> metricsStrings();
+    std::string metricsText();
+    std::string parseErrorResponse(const std::string&, const ParsedCommand&);
+    std::string simulationString(int id);
     
     void stopMonitorSpeedMeasure();
     void startMonitorSpeedMeasure();
+    void addSpeedMeasureClient(int connId);
+    void removeSpeedMeasureClient(int connId);
 
+    std::string bindAddress;
+    int pwmFrequency = PWM_DEFAULT_FREQUENCY;	// every motor's PWM until FRQ changes it
+    int pwmBits = PWM_DEFAULT_BITS;
+    int pulsesPerRevolution = defaultPulsesPerRevolution;	// sensor edges per turn of every motor
+    MulticastConfig multicast;				// UDP telemetry, off while its address is empty
 	int serverMsgSocket;
 	int serverSpdSocket;
-    int clientMsgSocket;
-    int clientSpdSocket;
+	int serverMetricsSocket;
 
-    void sendResponse(const std::string&);
-    void sendSpeed(std::string speed);
+    void sendResponse(int connId, const std::string&);
+    void sendSpeed(TelemetryBatch batch);
     
-    void responseLoop();
-    int serverLoop();
-    int speedLoop();
+    int networkLoop();
     void measureSpeedLoop();
     void startPushingSpeed();
     
-    void quitClient();
+    void quitClient(int connId);
 
 
     void commandProcessingLoop();
-    void commandExecutionLoop();
+    void commandExecutionLoop(MotorUnit&);
 
     void startServer();
-
-    MotorController motorController;
+    void stopServer();
+    
+    size_t motorCount() const;
+    MotorController& motor(int id);
 };
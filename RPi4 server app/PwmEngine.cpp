@@ -0,0 +1,418 @@
+#include "PwmEngine.h"
+#include "GpioBackend.h"
+#include "Futex.h"
+#include "RealTime.h"
+#include "Metrics.h"
+#include "Journal.h"
+
+#include <algorithm>
+#include <cmath>
+#include <time.h>
+
+constexpr int noPin = 0xFF;
+constexpr uint64_t fieldMask = (1ULL << 28) - 1;
+constexpr uint64_t haltedSetting = ((uint64_t)noPin << 56) | fieldMask;	// idle, and refuses new settings
+constexpr int idleTimeoutMs = 100;	// re-check rate while no output is set
+constexpr uint64_t cpuSampleInterval = 256;	// engine passes between CPU time samples
+
+PwmEngine::PwmEngine() : running(false), updates(0) {
+	for (int channel = 0; channel < PWM_MAX_CHANNELS; channel++) {
+		settings[channel].store(pack(-1, 0, 0), std::memory_order_relaxed);
+		captureArmed[channel].store(false, std::memory_order_relaxed);
+		capturedEdgeNs[channel].store(0, std::memory_order_relaxed);
+		haltRequests[channel].store(0, std::memory_order_relaxed);
+		haltsApplied[channel].store(0, std::memory_order_relaxed);
+		haltedAtNs[channel].store(0, std::memory_order_relaxed);
+		activePin[channel] = -1;
+		pinIsHigh[channel] = false;
+		risingNext[channel] = true;
+		edgeAtNs[channel] = 0;
+		periodStartNs[channel] = 0;
+		onNs[channel] = 0;
+		periodNs[channel] = 0;
+	}
+	resetStats();
+}
+
+PwmEngine::~PwmEngine() {
+	stop();
+}
+
+//  SETUP   ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Starts the engine thread
+void PwmEngine::start() {
+    if (running.exchange(true)) return;
+    worker = std::thread([this]() {
+        applyThreadRole(rolePwm);
+        this->engineLoop();
+    });
+}
+
+/// Stops the engine thread and leaves every driven pin low
+void PwmEngine::stop() {
+    if (!running.exchange(false)) return;
+    updates.fetch_add(1);
+    futexWake(updates, 1);
+    if (worker.joinable()) worker.join();
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//  OUTPUT  ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Packs an output setting into a single word so it can be swapped atomically
+uint64_t PwmEngine::pack(int pin, int64_t onNs, int64_t periodNs) {
+    uint64_t p = pin < 0 ? noPin : (uint64_t)pin & 0xFF;
+    return (p << 56) | (((uint64_t)onNs & fieldMask) << 28) | ((uint64_t)periodNs & fieldMask);
+}
+
+/// Splits a packed setting into pin and timings
+PwmOutput PwmEngine::unpack(uint64_t value) {
+    PwmOutput out;
+    out.pin = (int)(value >> 56) == noPin ? -1 : (int)(value >> 56);
+    out.onNs = (value >> 28) & fieldMask;
+    out.periodNs = value & fieldMask;
+    return out;
+}
+
+bool PwmEngine::validChannel(int channel) {
+    return channel >= 0 && channel < PWM_MAX_CHANNELS;
+}
+
+/// Stores a new setting and wakes the engine if it is waiting idle.
+/// A halted channel keeps its halt until it is released.
+void PwmEngine::publish(int channel, uint64_t value) {
+    uint64_t current = settings[channel].load(std::memory_order_acquire);
+    do {
+        if (current == value || current == haltedSetting) return;
+    } while (!settings[channel].compare_exchange_weak(current, value, std::memory_order_acq_rel, std::memory_order_acquire));
+    metrics().pwmUpdates.add();
+    PwmOutput output = unpack(value);
+    journal().duty(channel, output.pin, output.onNs, output.periodNs);
+    gpio().pwmChanged(channel, output.pin, output.onNs, output.periodNs);
+    updates.fetch_add(1, std::memory_order_release);
+    futexWake(updates, 1);
+}
+
+/// Sets the pin a channel drives and its on/off times. Takes effect on
+/// the channel's next period, or on the engine's next pass if it was idle.
+void PwmEngine::setOutput(int channel, int pin, int onTimeUs, int offTimeUs) {
+    if (onTimeUs < 0) onTimeUs = 0;
+    if (offTimeUs < 0) offTimeUs = 0;
+    int64_t on = (int64_t)onTimeUs * 1000;
+    setOutputNs(channel, pin, on, on + (int64_t)offTimeUs * 1000);
+}
+
+/// As setOutput, with the on time and the whole period in nanoseconds
+void PwmEngine::setOutputNs(int channel, int pin, int64_t onNs, int64_t periodNs) {
+    if (!validChannel(channel)) return;
+    if (periodNs < 0) periodNs = 0;
+    onNs = std::max<int64_t>(0, std::min(onNs, periodNs));
+    publish(channel, pack(pin, onNs, periodNs));
+}
+
+/// Drives no pin on a channel; the pin it drove is pulled low
+void PwmEngine::idle(int channel) {
+    if (validChannel(channel)) publish(channel, pack(-1, 0, 0));
+}
+
+/// Cuts a channel's output at its next edge at the latest, whatever it
+/// was set to, and ignores new settings until release(). haltApplied()
+/// reports when the engine has pulled the pin low.
+void PwmEngine::halt(int channel) {
+    if (!validChannel(channel)) return;
+    if (settings[channel].exchange(haltedSetting, std::memory_order_acq_rel) != haltedSetting) {
+        metrics().pwmUpdates.add();
+        journal().duty(channel, -1, 0, 0);
+        gpio().pwmChanged(channel, -1, 0, 0);
+    }
+    // Counted after the swap, so the engine never confirms a halt it cannot see yet
+    haltRequests[channel].fetch_add(1, std::memory_order_release);
+    updates.fetch_add(1, std::memory_order_release);
+    futexWake(updates, 1);
+}
+
+/// Lets a halted channel take settings again; it stays idle until given one
+void PwmEngine::release(int channel) {
+    if (!validChannel(channel)) return;
+    uint64_t halted = haltedSetting;
+    settings[channel].compare_exchange_strong(halted, pack(-1, 0, 0), std::memory_order_acq_rel);
+}
+
+/// True once the engine has acted on every halt of the channel; 'atNs' is
+/// when it did so for the latest
+bool PwmEngine::haltApplied(int channel, int64_t& atNs) const {
+    if (!validChannel(channel)) return false;
+    uint32_t requested = haltRequests[channel].load(std::memory_order_acquire);
+    if (haltsApplied[channel].load(std::memory_order_acquire) != requested) return false;
+    atNs = haltedAtNs[channel].load(std::memory_order_relaxed);
+    return true;
+}
+
+/// Sleeps until the engine has acted on every halt of the channel or the
+/// backend clock passes 'deadlineNs'. Returns haltApplied() at that point.
+bool PwmEngine::waitHalt(int channel, int64_t deadlineNs, int64_t& atNs) {
+    if (!validChannel(channel)) return false;
+    for (;;) {
+        uint32_t seen = haltsApplied[channel].load(std::memory_order_acquire);
+        if (haltApplied(channel, atNs)) return true;
+        if (gpio().nowNs() >= deadlineNs) return false;
+        gpio().waitUntilNs(deadlineNs, haltsApplied[channel], seen);
+    }
+}
+
+/// Returns the setting a channel is driving
+PwmOutput PwmEngine::getOutput(int channel) const {
+    if (!validChannel(channel)) return unpack(pack(-1, 0, 0));
+    return unpack(settings[channel].load(std::memory_order_acquire));
+}
+
+/// Records the time of the next rising edge the channel drives
+void PwmEngine::armEdgeCapture(int channel) {
+    if (!validChannel(channel)) return;
+    capturedEdgeNs[channel].store(0, std::memory_order_relaxed);
+    captureArmed[channel].store(true, std::memory_order_release);
+}
+
+/// Returns the captured rising edge time, or 0 if none was driven yet
+int64_t PwmEngine::getCapturedEdge(int channel) const {
+    if (!validChannel(channel)) return 0;
+    return capturedEdgeNs[channel].load(std::memory_order_acquire);
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//  TIMING  ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Records how late the thread woke up against an edge deadline
+void PwmEngine::recordWake(int64_t deadlineNs, int64_t now) {
+    int64_t late = now - deadlineNs;
+    if (late < 0) late = 0;
+
+    edges.fetch_add(1, std::memory_order_relaxed);
+    jitterSumNs.fetch_add(late, std::memory_order_relaxed);
+    if (late > jitterMaxNs.load(std::memory_order_relaxed))
+        jitterMaxNs.store(late, std::memory_order_relaxed);
+    metrics().pwmLateness.record(late);
+}
+
+/// Schedules the rising edge of a channel's next period
+void PwmEngine::nextPeriod(int channel, int64_t now) {
+    risingNext[channel] = true;
+    edgeAtNs[channel] = periodStartNs[channel] + periodNs[channel];
+    periods.fetch_add(1, std::memory_order_relaxed);
+
+    // Resynchronise instead of bursting through missed periods
+    if (now > edgeAtNs[channel]) {
+        overruns.fetch_add(1, std::memory_order_relaxed);
+        edgeAtNs[channel] = now;
+    }
+}
+
+/// Rising edge: picks up the channel's latest setting and starts a period
+void PwmEngine::startPeriod(int channel, int64_t now) {
+    PwmOutput out = unpack(settings[channel].load(std::memory_order_acquire));
+
+    if (out.pin != activePin[channel] || out.periodNs == 0) {
+        if (pinIsHigh[channel]) gpio().digitalWrite(activePin[channel], pinLow);
+        pinIsHigh[channel] = false;
+        activePin[channel] = out.pin;
+    }
+    if (out.pin < 0 || out.periodNs == 0) {
+        activePin[channel] = -1;
+        return;
+    }
+
+    onNs[channel] = out.onNs;
+    periodNs[channel] = out.periodNs;
+    periodStartNs[channel] = edgeAtNs[channel];
+
+    if (out.onNs > 0) {
+        if (!pinIsHigh[channel]) {
+            gpio().digitalWrite(out.pin, pinHigh);
+            pinIsHigh[channel] = true;
+        }
+        if (captureArmed[channel].load(std::memory_order_relaxed) && captureArmed[channel].exchange(false))
+            capturedEdgeNs[channel].store(gpio().nowNs(), std::memory_order_release);
+
+        if (out.onNs < out.periodNs) {
+            risingNext[channel] = false;
+            edgeAtNs[channel] = periodStartNs[channel] + out.onNs;
+            return;
+        }
+    }
+    else if (pinIsHigh[channel]) {
+        gpio().digitalWrite(out.pin, pinLow);
+        pinIsHigh[channel] = false;
+    }
+    nextPeriod(channel, now);
+}
+
+/// Falling edge: ends the on time of the channel's current period
+void PwmEngine::endOnTime(int channel, int64_t now) {
+    if (pinIsHigh[channel]) {
+        gpio().digitalWrite(activePin[channel], pinLow);
+        pinIsHigh[channel] = false;
+    }
+    nextPeriod(channel, now);
+}
+
+/// Starts the channels that were idle and have been given an output
+void PwmEngine::wakeIdleChannels(int64_t now) {
+    for (int channel = 0; channel < PWM_MAX_CHANNELS; channel++) {
+        if (activePin[channel] >= 0) continue;
+        PwmOutput out = unpack(settings[channel].load(std::memory_order_acquire));
+        if (out.pin < 0 || out.periodNs == 0) continue;
+
+        activePin[channel] = out.pin;
+        pinIsHigh[channel] = false;
+        risingNext[channel] = true;
+        edgeAtNs[channel] = now;
+    }
+}
+
+/// Drops the channels that were halted since the last pass. An edge due
+/// before this pass already found the halt and left the pin low.
+void PwmEngine::applyHalts(int64_t now) {
+    for (int channel = 0; channel < PWM_MAX_CHANNELS; channel++) {
+        uint32_t requested = haltRequests[channel].load(std::memory_order_acquire);
+        if (haltsApplied[channel].load(std::memory_order_relaxed) == requested) continue;
+
+        if (pinIsHigh[channel]) gpio().digitalWrite(activePin[channel], pinLow);
+        pinIsHigh[channel] = false;
+        activePin[channel] = -1;
+        haltedAtNs[channel].store(now, std::memory_order_relaxed);
+        haltsApplied[channel].store(requested, std::memory_order_release);
+        futexWake(haltsApplied[channel], 1);
+    }
+}
+
+/// Generates the PWM signal of every channel, sleeping to the earliest
+/// absolute edge deadline among them
+void PwmEngine::engineLoop() {
+    timespec cpu;
+    int64_t startNs = gpio().nowNs();
+    uint32_t seen = updates.load(std::memory_order_acquire);
+    uint64_t sinceSample = 0;
+    wakeIdleChannels(startNs);
+
+    while (running.load(std::memory_order_relaxed)) {
+        int64_t now = gpio().nowNs();
+        uint32_t current = updates.load(std::memory_order_acquire);
+        if (current != seen) {
+            seen = current;
+            applyHalts(now);
+            wakeIdleChannels(now);
+        }
+
+        int64_t next = INT64_MAX;
+        for (int channel = 0; channel < PWM_MAX_CHANNELS; channel++) {
+            if (activePin[channel] >= 0 && edgeAtNs[channel] < next) next = edgeAtNs[channel];
+        }
+
+        if (next == INT64_MAX) {
+            // Nothing to drive: sleep until a setting changes instead of polling
+            futexWait(updates, seen, idleTimeoutMs);
+        }
+        else {
+            // Every edge that is due by the time the thread wakes is handled
+            // in this pass, whichever channel it belongs to
+            gpio().sleepUntilNs(next);
+            now = gpio().nowNs();
+            for (int channel = 0; channel < PWM_MAX_CHANNELS; channel++) {
+                if (activePin[channel] < 0 || edgeAtNs[channel] > now) continue;
+                recordWake(edgeAtNs[channel], now);
+                if (risingNext[channel]) startPeriod(channel, now);
+                else endOnTime(channel, now);
+            }
+        }
+
+        if (++sinceSample >= cpuSampleInterval) {
+            sinceSample = 0;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+            cpuNs.store((int64_t)cpu.tv_sec * 1000000000LL + cpu.tv_nsec, std::memory_order_relaxed);
+            wallNs.store(gpio().nowNs() - startNs, std::memory_order_relaxed);
+        }
+    }
+
+    for (int channel = 0; channel < PWM_MAX_CHANNELS; channel++) {
+        if (pinIsHigh[channel]) gpio().digitalWrite(activePin[channel], pinLow);
+        pinIsHigh[channel] = false;
+        activePin[channel] = -1;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//  STATISTICS  ////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Returns a snapshot of the engine timing statistics
+PwmStats PwmEngine::getStats() const {
+    PwmStats stats;
+    uint64_t n = edges.load(std::memory_order_relaxed);
+    int64_t wall = wallNs.load(std::memory_order_relaxed);
+
+    stats.periods = periods.load(std::memory_order_relaxed);
+    stats.overruns = overruns.load(std::memory_order_relaxed);
+    stats.maxJitterNs = jitterMaxNs.load(std::memory_order_relaxed);
+    stats.meanJitterNs = n ? jitterSumNs.load(std::memory_order_relaxed) / (int64_t)n : 0;
+    stats.cpuLoad = wall > 0 ? (double)cpuNs.load(std::memory_order_relaxed) / wall : 0.0;
+    return stats;
+}
+
+/// Clears the period, overrun and jitter counters
+void PwmEngine::resetStats() {
+    periods = 0;
+    overruns = 0;
+    edges = 0;
+    jitterSumNs = 0;
+    jitterMaxNs = 0;
+    cpuNs = 0;
+    wallNs = 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//  DUTY TABLE  ////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+bool validPwmTiming(int frequencyHz, int bits) {
+    return frequencyHz >= PWM_MIN_FREQUENCY && frequencyHz <= PWM_MAX_FREQUENCY
+        && bits >= PWM_MIN_BITS && bits <= PWM_MAX_BITS;
+}
+
+/// Builds the table; a setting out of range is clamped into it
+DutyTable::DutyTable(int frequencyHz, int bits)
+    : frequencyHz(std::max(PWM_MIN_FREQUENCY, std::min(frequencyHz, PWM_MAX_FREQUENCY))),
+      bits(std::max(PWM_MIN_BITS, std::min(bits, PWM_MAX_BITS))) {
+    periodNs = (1000000000LL + this->frequencyHz / 2) / this->frequencyHz;
+
+    int64_t count = steps();
+    onTimes.resize(count + 1);
+    for (int64_t step = 0; step <= count; step++) {
+        onTimes[step] = (periodNs * step + count / 2) / count;
+    }
+}
+
+/// On time of a duty step, clamped to 0 - 2^bits
+int64_t DutyTable::onNs(int step) const {
+    if (step <= 0) return 0;
+    if (step >= steps()) return periodNs;
+    return onTimes[step];
+}
+
+/// Largest difference between a tabled duty and the exact k / 2^bits, as
+/// a fraction of the period
+double DutyTable::maxTableError() const {
+    double worst = 0;
+    for (int step = 0; step <= steps(); step++) {
+        double error = std::fabs((double)onTimes[step] / periodNs - (double)step / steps());
+        if (error > worst) worst = error;
+    }
+    return worst;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+constexpr int PWM_MAX_CHANNELS = 8;
+
+constexpr int PWM_MIN_FREQUENCY = 200;		// Hz
+constexpr int PWM_MAX_FREQUENCY = 20000;
+constexpr int PWM_DEFAULT_FREQUENCY = 1000;
+constexpr int PWM_MIN_BITS = 1;				// duty resolution
+constexpr int PWM_MAX_BITS = 10;
+constexpr int PWM_DEFAULT_BITS = 10;
+
+bool validPwmTiming(int frequencyHz, int bits);
+
+/// On times of every duty step at one PWM frequency and resolution. They
+/// are rounded to whole nanoseconds once, in integers, so setting a duty
+/// is a lookup and step k always gives k / 2^bits of the period to within
+/// half a nanosecond.
+class DutyTable {
+private:
+	int frequencyHz;
+	int bits;
+	int64_t periodNs;
+	std::vector<int64_t> onTimes;	// 2^bits + 1 entries, ns
+
+public:
+	DutyTable(int frequencyHz = PWM_DEFAULT_FREQUENCY, int bits = PWM_DEFAULT_BITS);
+
+	int64_t onNs(int step) const;
+	double maxTableError() const;
+
+	int getFrequency() const {
+		return frequencyHz;
+	}
+	int getBits() const {
+		return bits;
+	}
+	int steps() const {
+		return 1 << bits;
+	}
+	int64_t getPeriodNs() const {
+		return periodNs;
+	}
+};
+
+/// Timing statistics collected by the PWM engine thread
+struct PwmStats {
+	uint64_t periods;		// completed PWM periods, all channels
+	uint64_t overruns;		// periods whose deadline had already passed
+	int64_t maxJitterNs;	// worst wake-up lateness against an edge deadline
+	int64_t meanJitterNs;	// mean wake-up lateness against an edge deadline
+	double cpuLoad;			// fraction of one core used by the engine thread
+};
+
+/// Output a channel is currently set to drive
+struct PwmOutput {
+	int pin;			// -1 when idle
+	int64_t onNs;
+	int64_t periodNs;
+};
+
+/// Drives the PWM outputs of every channel from one thread. The channel
+/// state is kept in flat arrays; each pass sleeps until the earliest
+/// pending edge of any channel and handles every edge that is due, so
+/// the cost grows with the number of edges, not with channels or threads.
+class PwmEngine {
+private:
+	std::thread worker;
+	std::atomic<bool> running;
+
+	// Packed output settings: pin (8 bits) | on time (28 bits) | period (28 bits), ns
+	std::atomic<uint64_t> settings[PWM_MAX_CHANNELS];
+	std::atomic<uint32_t> updates;	// futex word, bumped by every setting change
+
+	std::atomic<bool> captureArmed[PWM_MAX_CHANNELS];
+	std::atomic<int64_t> capturedEdgeNs[PWM_MAX_CHANNELS];
+	
+	// Halts: requested by halt(), confirmed by the engine once the pin is low
+	std::atomic<uint32_t> haltRequests[PWM_MAX_CHANNELS];
+	std::atomic<uint32_t> haltsApplied[PWM_MAX_CHANNELS];	// futex words
+	std::atomic<int64_t> haltedAtNs[PWM_MAX_CHANNELS];
+
+	// Channel state, engine thread only
+	int activePin[PWM_MAX_CHANNELS];		// -1 while the channel is idle
+	bool pinIsHigh[PWM_MAX_CHANNELS];
+	bool risingNext[PWM_MAX_CHANNELS];		// next edge starts a period
+	int64_t edgeAtNs[PWM_MAX_CHANNELS];		// deadline of the next edge
+	int64_t periodStartNs[PWM_MAX_CHANNELS];
+	int64_t onNs[PWM_MAX_CHANNELS];
+	int64_t periodNs[PWM_MAX_CHANNELS];
+
+	std::atomic<uint64_t> periods;
+	std::atomic<uint64_t> overruns;
+	std::atomic<uint64_t> edges;
+	std::atomic<int64_t> jitterSumNs;
+	std::atomic<int64_t> jitterMaxNs;
+	std::atomic<int64_t> cpuNs;
+	std::atomic<int64_t> wallNs;
+
+	static uint64_t pack(int pin, int64_t onNs, int64_t periodNs);
+	static PwmOutput unpack(uint64_t value);
+	static bool validChannel(int channel);
+	void publish(int channel, uint64_t value);
+	void recordWake(int64_t deadlineNs, int64_t now);
+	void nextPeriod(int channel, int64_t now);
+	void startPeriod(int channel, int64_t now);
+	void endOnTime(int channel, int64_t now);
+	void wakeIdleChannels(int64_t now);
+	void applyHalts(int64_t now);
+	void engineLoop();
+
+public:
+	PwmEngine();
+	~PwmEngine();
+
+	void start();
+	void stop();
+
+	void setOutput(int channel, int pin, int onTimeUs, int offTimeUs);
+	void setOutputNs(int channel, int pin, int64_t onNs, int64_t periodNs);
+	void idle(int channel);
+	PwmOutput getOutput(int channel) const;
+
+	void armEdgeCapture(int channel);
+	int64_t getCapturedEdge(int channel) const;
+	
+	void halt(int channel);
+	void release(int channel);
+	bool haltApplied(int channel, int64_t& atNs) const;
+	bool waitHalt(int channel, int64_t deadlineNs, int64_t& atNs);
+
+	PwmStats getStats() const;
+	void resetStats();
+};
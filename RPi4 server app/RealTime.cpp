@@ -0,0 +1,199 @@
+#include "RealTime.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/// What was actually applied, filled in as threads start
+struct RoleStatus {
+	int threads = 0;
+	int prioritySet = 0;		// threads now running SCHED_FIFO
+	int priorityError = 0;		// errno of the last failure
+	int pinned = 0;
+	int pinError = 0;
+};
+
+static RealTimeConfig activeConfig = defaultRealTimeConfig();
+static std::mutex statusMutex;
+static RoleStatus roleStatus[roleCount];
+static int memoryLockError = -1;	// -1 not attempted, 0 locked
+static bool futureLocked = false;	// later mappings are locked too
+
+/// PWM highest, then speed measurement, command execution and the network;
+/// the log sink stays on the normal scheduler. On a 4 core Pi the PWM gets
+/// core 3 to itself and core 0 is left to the system.
+RealTimeConfig defaultRealTimeConfig() {
+	RealTimeConfig config = { false, true, { 80, 70, 60, 40, 0 }, { 3, 2, 2, 1, -1 } };
+	return config;
+}
+
+const char* threadRoleName(threadRole role) {
+	switch (role) {
+	case rolePwm:
+		return "pwm";
+	case roleMonitor:
+		return "monitor";
+	case roleControl:
+		return "control";
+	case roleNetwork:
+		return "network";
+	case roleLogging:
+		return "logging";
+	default:
+		return "unknown";
+	}
+}
+
+/// Parses "role:value,role:value", e.g. "pwm:3,monitor:2"
+bool parseRoleList(const char* list, int values[roleCount]) {
+	std::string text = list;
+	size_t start = 0;
+	while (start < text.size()) {
+		size_t end = text.find(',', start);
+		if (end == std::string::npos) end = text.size();
+		std::string item = text.substr(start, end - start);
+		start = end + 1;
+
+		size_t colon = item.find(':');
+		if (colon == std::string::npos) return false;
+		std::string name = item.substr(0, colon);
+		int role = 0;
+		while (role < roleCount && name != threadRoleName((threadRole)role)) role++;
+		if (role == roleCount) return false;
+
+		char* endPtr = nullptr;
+		long value = strtol(item.c_str() + colon + 1, &endPtr, 10);
+		if (*endPtr != '\0' || endPtr == item.c_str() + colon + 1) return false;
+		values[role] = (int)value;
+	}
+	return true;
+}
+
+/// Touches the stack the thread will use so its pages fault in now
+static void __attribute__((noinline)) prefaultStack() {
+	unsigned char stack[RT_STACK_PREFAULT];
+	memset(stack, 0, sizeof(stack));
+	asm volatile("" : : "r"(stack) : "memory");	// keep the writes
+}
+
+//	SETUP	////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Locks memory and remembers the per-role settings threads apply as
+/// they start. Does nothing unless config.enabled is set.
+void setupRealTime(const RealTimeConfig& config) {
+	activeConfig = config;
+	if (!config.enabled) return;
+
+	if (config.lockMemory) {
+		// Keep freed heap in the process so it never faults back in
+		mallopt(M_TRIM_THRESHOLD, -1);
+		mallopt(M_MMAP_MAX, 0);
+
+		// Locking future mappings under a finite RLIMIT_MEMLOCK would make the
+		// 8 MB stacks of threads started later fail to allocate
+		rlimit memLimit;
+		futureLocked = geteuid() == 0 ||
+			(getrlimit(RLIMIT_MEMLOCK, &memLimit) == 0 && memLimit.rlim_cur == RLIM_INFINITY);
+
+		memoryLockError = mlockall(futureLocked ? MCL_CURRENT | MCL_FUTURE : MCL_CURRENT) == 0 ? 0 : errno;
+		if (memoryLockError == 0 && futureLocked) {
+			LOG_INFO(logServer, "RT: memory locked");
+		}
+		else if (memoryLockError == 0) {
+			LOG_WARN(logServer, "RT: RLIMIT_MEMLOCK is limited, only memory mapped so far is locked");
+		}
+		else {
+			LOG_WARN(logServer, "RT: mlockall failed (%s), page faults may add jitter", strerror(memoryLockError));
+		}
+	}
+	prefaultStack();
+
+	rlimit limit;
+	if (getrlimit(RLIMIT_RTPRIO, &limit) == 0 && geteuid() != 0 && limit.rlim_cur == 0) {
+		LOG_WARN(logServer, "RT: RLIMIT_RTPRIO is 0, SCHED_FIFO needs root or CAP_SYS_NICE");
+	}
+}
+
+/// Applies the configured priority and CPU of 'role' to the calling thread
+void applyThreadRole(threadRole role) {
+	if (!activeConfig.enabled || role < 0 || role >= roleCount) return;
+
+	int priority = activeConfig.priority[role];
+	int cpu = activeConfig.cpu[role];
+	int priorityResult = -1;
+	int pinResult = -1;
+
+	if (priority > 0) {
+		sched_param param;
+		param.sched_priority = std::min(priority, sched_get_priority_max(SCHED_FIFO));
+		priorityResult = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	}
+	if (cpu >= 0) {
+		if (cpu < sysconf(_SC_NPROCESSORS_ONLN)) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			pinResult = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		}
+		else {
+			pinResult = EINVAL;
+		}
+	}
+	prefaultStack();
+
+	std::lock_guard<std::mutex> lock(statusMutex);
+	RoleStatus& status = roleStatus[role];
+	status.threads++;
+	if (priorityResult == 0) status.prioritySet++;
+	else if (priorityResult > 0) status.priorityError = priorityResult;
+	if (pinResult == 0) status.pinned++;
+	else if (pinResult > 0) status.pinError = pinResult;
+
+	if (priorityResult > 0 || pinResult > 0) {
+		LOG_WARN(logServer, "RT: %s thread: priority %s, cpu %s", threadRoleName(role),
+			priorityResult > 0 ? strerror(priorityResult) : "ok", pinResult > 0 ? strerror(pinResult) : "ok");
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+
+/// Describes what the real-time mode applied, for the log and the RT command
+std::string realTimeReport() {
+	if (!activeConfig.enabled) return "RT mode off";
+
+	std::string str = "RT memory: ";
+	if (!activeConfig.lockMemory) str.append("not requested");
+	else if (memoryLockError == 0) str.append(futureLocked ? "locked" : "locked at startup only");
+	else str.append("not locked (").append(strerror(memoryLockError)).append(")");
+
+	std::lock_guard<std::mutex> lock(statusMutex);
+	for (int role = 0; role < roleCount; role++) {
+		const RoleStatus& status = roleStatus[role];
+		str.append("; ").append(threadRoleName((threadRole)role)).append(": ");
+		if (status.threads == 0) {
+			str.append("no threads yet");
+			continue;
+		}
+
+		if (activeConfig.priority[role] <= 0) str.append("SCHED_OTHER");
+		else if (status.prioritySet == status.threads) str.append("FIFO ").append(std::to_string(activeConfig.priority[role]));
+		else str.append("FIFO failed (").append(strerror(status.priorityError)).append(")");
+
+		if (activeConfig.cpu[role] < 0) str.append(", unpinned");
+		else if (status.pinned == status.threads) str.append(", cpu ").append(std::to_string(activeConfig.cpu[role]));
+		else str.append(", pin failed (").append(strerror(status.pinError)).append(")");
+
+		str.append(", ").append(std::to_string(status.threads)).append(status.threads == 1 ? " thread" : " threads");
+	}
+	return str;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+
+enum threadRole {
+	rolePwm = 0,
+	roleMonitor,
+	roleControl,
+	roleNetwork,
+	roleLogging,
+	roleCount
+};
+
+constexpr size_t RT_STACK_PREFAULT = 256 * 1024;	// stack touched per thread
+
+/// Opt-in real-time setup. Priority 0 keeps a role on the normal
+/// scheduler; cpu -1 leaves it unpinned.
+struct RealTimeConfig {
+	bool enabled;
+	bool lockMemory;
+	int priority[roleCount];
+	int cpu[roleCount];
+};
+
+RealTimeConfig defaultRealTimeConfig();
+bool parseRoleList(const char* list, int values[roleCount]);
+
+void setupRealTime(const RealTimeConfig& config);
+void applyThreadRole(threadRole role);
+std::string realTimeReport();
+const char* threadRoleName(threadRole role);
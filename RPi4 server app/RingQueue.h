@@ -0,0 +1,174 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <utility>
+
+#include "Futex.h"
+
+/// Bounded lock-free queue for any number of producers and consumers.
+/// Each slot carries a sequence number telling whether it is free or
+/// filled for the current lap, so push and pop only race on one index.
+/// Idle consumers sleep on a futex that every push bumps; producers
+/// waiting for room sleep on one that pops bump while they wait.
+template <typename T>
+class RingQueue {
+private:
+	struct Slot {
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	std::unique_ptr<Slot[]> slots;
+	size_t mask;
+
+	alignas(64) std::atomic<size_t> head;		// next slot to pop
+	alignas(64) std::atomic<size_t> tail;		// next slot to push
+	alignas(64) std::atomic<uint32_t> signal;	// futex word, bumped by every push
+	std::atomic<int> sleepers;
+	alignas(64) std::atomic<uint32_t> space;	// futex word, bumped by pops while producers wait
+	std::atomic<int> pushSleepers;
+
+	static constexpr int spinLimit = 64;
+
+	static size_t roundUp(size_t value) {
+		size_t size = 2;
+		while (size < value) size <<= 1;
+		return size;
+	}
+
+public:
+	explicit RingQueue(size_t capacity)
+		: slots(new Slot[roundUp(capacity)]), mask(roundUp(capacity) - 1),
+		  head(0), tail(0), signal(0), sleepers(0), space(0), pushSleepers(0) {
+		for (size_t i = 0; i <= mask; i++) {
+			slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	RingQueue(const RingQueue&) = delete;
+	RingQueue& operator=(const RingQueue&) = delete;
+
+	/// Enqueues a value. Returns false if the queue is full.
+	bool push(T value) {
+		return tryEmplace(value);
+	}
+
+	/// Enqueues a value, moving from it only on success
+	bool tryEmplace(T& value) {
+		Slot* slot;
+		size_t pos = tail.load(std::memory_order_relaxed);
+		while (true) {
+			slot = &slots[pos & mask];
+			size_t seq = slot->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			}
+			else if (diff < 0) {
+				return false;
+			}
+			else {
+				pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+		slot->value = std::move(value);
+		slot->sequence.store(pos + 1, std::memory_order_release);
+
+		signal.fetch_add(1, std::memory_order_seq_cst);
+		if (sleepers.load(std::memory_order_seq_cst) > 0) futexWake(signal, 1);
+		return true;
+	}
+
+	/// Dequeues a value without blocking. Returns false if the queue is empty.
+	bool tryPop(T& out) {
+		Slot* slot;
+		size_t pos = head.load(std::memory_order_relaxed);
+		while (true) {
+			slot = &slots[pos & mask];
+			size_t seq = slot->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			}
+			else if (diff < 0) {
+				return false;
+			}
+			else {
+				pos = head.load(std::memory_order_relaxed);
+			}
+		}
+		out = std::move(slot->value);
+		slot->sequence.store(pos + mask + 1, std::memory_order_release);
+
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (pushSleepers.load(std::memory_order_relaxed) > 0) {
+			space.fetch_add(1, std::memory_order_seq_cst);
+			futexWake(space, 1);
+		}
+		return true;
+	}
+
+	/// Dequeues a value, sleeping while the queue is empty.
+	/// Returns false on timeout (-1 waits forever) or when woken by notifyAll.
+	bool waitPop(T& out, int timeoutMs = -1) {
+		// A short yielding spin lets a busy producer refill the queue
+		// without paying for a futex round trip per item
+		for (int spin = 0; spin < spinLimit; spin++) {
+			if (tryPop(out)) return true;
+			std::this_thread::yield();
+		}
+
+		sleepers.fetch_add(1, std::memory_order_seq_cst);
+		uint32_t expected = signal.load(std::memory_order_seq_cst);
+		bool popped = tryPop(out);
+		if (!popped) {
+			futexWait(signal, expected, timeoutMs);
+			popped = tryPop(out);
+		}
+		sleepers.fetch_sub(1, std::memory_order_relaxed);
+		return popped;
+	}
+
+	/// Enqueues a value, sleeping while the queue is full.
+	/// Returns false on timeout (-1 waits forever) or when woken by notifyAll.
+	bool waitPush(T& value, int timeoutMs = -1) {
+		if (tryEmplace(value)) return true;
+
+		pushSleepers.fetch_add(1, std::memory_order_seq_cst);
+		uint32_t expected = space.load(std::memory_order_seq_cst);
+		bool pushed = tryEmplace(value);
+		if (!pushed) {
+			futexWait(space, expected, timeoutMs);
+			pushed = tryEmplace(value);
+		}
+		pushSleepers.fetch_sub(1, std::memory_order_relaxed);
+		return pushed;
+	}
+
+	/// Wakes every sleeping consumer and producer, e.g. so they can notice a shutdown
+	void notifyAll() {
+		signal.fetch_add(1, std::memory_order_seq_cst);
+		futexWake(signal, INT32_MAX);
+		space.fetch_add(1, std::memory_order_seq_cst);
+		futexWake(space, INT32_MAX);
+	}
+
+	bool empty() const {
+		return size() == 0;
+	}
+
+	/// Number of queued values; approximate while producers or consumers run
+	size_t size() const {
+		size_t h = head.load(std::memory_order_relaxed);
+		size_t t = tail.load(std::memory_order_relaxed);
+		return t > h ? t - h : 0;
+	}
+
+	size_t capacity() const {
+		return mask + 1;
+	}
+};
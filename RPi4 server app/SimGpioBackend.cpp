@@ -0,0 +1,317 @@
+#include "SimGpioBackend.h"
+#include "Futex.h"
+#include "Logger.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <time.h>
+
+// Pass time of the sensor edge whose handler runs on this thread, -1 outside handlers
+static thread_local int64_t edgeTimeNs = -1;
+
+SimGpioBackend::SimGpioBackend() : recording(false), timeScale(1.0), realBaseNs(0), driveMode(simDriveEdges), simulating(false) {
+    for (int i = 0; i < simPinCount; i++) {
+        modes[i] = pinInput;
+        levels[i] = pinLow;
+        handlers[i] = nullptr;
+        pinMotor[i] = -1;
+    }
+    for (int channel = 0; channel < simChannelCount; channel++) channelMotor[channel] = -1;
+}
+
+SimGpioBackend::~SimGpioBackend() {
+    stopSimulation();
+}
+
+bool SimGpioBackend::validPin(int pin) {
+    return pin >= 0 && pin < simPinCount;
+}
+
+int SimGpioBackend::setup() {
+    return 0;
+}
+
+//  PINS    ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+void SimGpioBackend::pinMode(int pin, int mode) {
+    if (validPin(pin)) modes[pin] = mode;
+}
+
+/// Sets the pin level and records the edge if the level changed
+void SimGpioBackend::digitalWrite(int pin, int value) {
+    if (!validPin(pin)) return;
+    int level = value ? pinHigh : pinLow;
+    if (levels[pin].exchange(level) == level) return;
+
+    int64_t now = nowNs();
+    int motor = pinMotor[pin];
+    if (motor >= 0 && driveMode == simDriveEdges) {
+        // Full supply one way or the other, or the winding shorted when both inputs match
+        const SimMotor& model = *motors[motor];
+        int cw = levels[model.cwPin].load(std::memory_order_relaxed);
+        int ccw = levels[model.ccwPin].load(std::memory_order_relaxed);
+        recordDrive(motor, now, cw == ccw ? 0.0 : cw ? 1.0 : -1.0);
+    }
+    if (recording.load(std::memory_order_relaxed)) {
+        PinEdge edge = { pin, level, now };
+        std::lock_guard<std::mutex> lock(edgeMutex);
+        edgeLog.push_back(edge);
+    }
+}
+
+int SimGpioBackend::digitalRead(int pin) {
+    return validPin(pin) ? levels[pin].load() : pinLow;
+}
+
+/// Stores the handler called by injectRisingEdge. Only rising edges are simulated.
+int SimGpioBackend::registerISR(int pin, int edge, void (*handler)()) {
+    if (!validPin(pin) || edge != edgeRising) return -1;
+    handlers[pin] = handler;
+    return 0;
+}
+
+/// Pulses an input pin and runs its interrupt handler on the calling thread
+void SimGpioBackend::injectRisingEdge(int pin) {
+    if (!validPin(pin)) return;
+    levels[pin] = pinHigh;
+    void (*handler)() = handlers[pin].load();
+    if (handler) handler();
+    levels[pin] = pinLow;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//  CLOCK   ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+int64_t SimGpioBackend::realNowNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/// Virtual time; inside a sensor handler, the time of its edge
+int64_t SimGpioBackend::nowNs() {
+    if (edgeTimeNs >= 0) return edgeTimeNs;
+    int64_t real = realNowNs();
+    if (timeScale == 1.0) return real;
+    return realBaseNs + (int64_t)((real - realBaseNs) * timeScale);
+}
+
+void SimGpioBackend::sleepUntilNs(int64_t deadlineNs) {
+    if (timeScale != 1.0) deadlineNs = realBaseNs + (int64_t)((deadlineNs - realBaseNs) / timeScale);
+    timespec ts;
+    ts.tv_sec = deadlineNs / 1000000000LL;
+    ts.tv_nsec = deadlineNs % 1000000000LL;
+    // Only a signal is retried; an invalid deadline returns at once
+    int result;
+    while ((result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr)) == EINTR) {}
+    if (result != 0) LOG_ERROR(logServer, "Sleep until %lld ns failed: %s", (long long)deadlineNs, strerror(result));
+}
+
+/// Sleeps on the futex word until the real time the virtual deadline falls on
+void SimGpioBackend::waitUntilNs(int64_t deadlineNs, std::atomic<uint32_t>& wake, uint32_t seen) {
+    if (timeScale != 1.0) deadlineNs = realBaseNs + (int64_t)((deadlineNs - realBaseNs) / timeScale);
+    futexWaitUntilNs(wake, seen, deadlineNs);
+}
+
+/// Runs virtual time 'scale' times as fast as real time from now on.
+/// Only before any thread reads the clock; the scale is not synchronised.
+bool SimGpioBackend::setTimeScale(double scale) {
+    if (!(scale > 0.0 && scale <= SIM_MAX_TIME_SCALE)) return false;
+    realBaseNs = realNowNs();
+    timeScale = scale;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//  MOTORS  ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Simulates a motor on three pins. Returns its index, or -1 if a pin is
+/// invalid or already taken or the simulation runs.
+int SimGpioBackend::attachMotor(const SimMotorParams& params, int cwPin, int ccwPin, int sensorPin) {
+    if (simulating || !validPin(cwPin) || !validPin(ccwPin) || !validPin(sensorPin)) return -1;
+    if (pinMotor[cwPin] >= 0 || pinMotor[ccwPin] >= 0 || cwPin == ccwPin) return -1;
+
+    std::lock_guard<std::mutex> lock(motorMutex);
+    int motor = (int)motors.size();
+    motors.push_back(std::make_unique<SimMotor>(params, cwPin, ccwPin, sensorPin, nowNs()));
+    driveChanges.push_back(std::make_unique<RingQueue<DriveChange>>(SIM_DRIVE_QUEUE_SIZE));
+    pinMotor[cwPin] = motor;
+    pinMotor[ccwPin] = motor;
+    return motor;
+}
+
+/// Hands a drive change to the simulator without locking, as the PWM
+/// thread does for every edge
+void SimGpioBackend::recordDrive(int motor, int64_t tNs, double drive) {
+    driveChanges[motor]->push(DriveChange{ tNs, drive });
+}
+
+/// In simDriveAverage mode, drives the motor on the channel's pin with the
+/// setting's duty. An idle channel releases the motor it drove last.
+void SimGpioBackend::pwmChanged(int channel, int pin, int64_t onNs, int64_t periodNs) {
+    if (driveMode != simDriveAverage || channel < 0 || channel >= simChannelCount) return;
+    int64_t now = nowNs();
+
+    std::lock_guard<std::mutex> lock(motorMutex);
+    int motor = validPin(pin) ? pinMotor[pin] : -1;
+    if (motor >= 0) channelMotor[channel] = motor;
+    else motor = channelMotor[channel];
+    if (motor < 0) return;
+
+    double duty = validPin(pin) && periodNs > 0 ? (double)onNs / periodNs : 0.0;
+    if (validPin(pin) && pin == motors[motor]->ccwPin) duty = -duty;
+    recordDrive(motor, now, duty);
+}
+
+void SimGpioBackend::startSimulation() {
+    if (motors.empty() || simulating.exchange(true)) return;
+    simulator = std::thread([this]() { this->simulationLoop(); });
+}
+
+void SimGpioBackend::stopSimulation() {
+    if (!simulating.exchange(false)) return;
+    if (simulator.joinable()) simulator.join();
+}
+
+/// Every SIM_TICK_NS of virtual time, brings each motor up to the present
+/// through the drive changes since the last tick, then delivers the edges
+/// that came out on the way
+void SimGpioBackend::simulationLoop() {
+    std::vector<int64_t> edges;
+    DriveChange change;
+    int64_t next = nowNs();
+
+    while (simulating.load(std::memory_order_relaxed)) {
+        next += SIM_TICK_NS;
+        sleepUntilNs(next);
+        int64_t now = nowNs();
+        if (next < now - SIM_TICK_NS) next = now;	// fell behind, e.g. at a high time scale
+
+        for (size_t motor = 0; motor < motors.size(); motor++) {
+            edges.clear();
+            int sensorPin;
+            {
+                std::lock_guard<std::mutex> lock(motorMutex);
+                SimMotor& model = *motors[motor];
+                while (driveChanges[motor]->tryPop(change)) {
+                    model.advance(change.tNs, edges);
+                    model.setDrive(change.drive);
+                }
+                model.advance(now, edges);
+                sensorPin = model.sensorPin;
+            }
+            for (int64_t edge : edges) deliverEdge(sensorPin, edge);
+        }
+    }
+}
+
+/// Pulses the sensor pin and runs its handler with the clock reading 'tNs'
+void SimGpioBackend::deliverEdge(int pin, int64_t tNs) {
+    levels[pin] = pinHigh;
+    void (*handler)() = handlers[pin].load();
+    if (handler) {
+        edgeTimeNs = tNs;
+        handler();
+        edgeTimeNs = -1;
+    }
+    levels[pin] = pinLow;
+}
+
+SimMotorState SimGpioBackend::motorState(int motor) const {
+    std::lock_guard<std::mutex> lock(motorMutex);
+    if (motor < 0 || motor >= (int)motors.size()) return SimMotorState{};
+    return motors[motor]->state();
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//  RECORDING   ////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Starts or stops recording output edges. Off by default: the log grows
+/// with every edge, so only callers that analyse it turn it on.
+void SimGpioBackend::setRecording(bool value) {
+    if (value) {
+        std::lock_guard<std::mutex> lock(edgeMutex);
+        edgeLog.reserve(1 << 16);
+    }
+    recording = value;
+}
+
+void SimGpioBackend::clearEdges() {
+    std::lock_guard<std::mutex> lock(edgeMutex);
+    edgeLog.clear();
+}
+
+/// Returns every recorded edge in time order
+std::vector<PinEdge> SimGpioBackend::getEdges() const {
+    std::lock_guard<std::mutex> lock(edgeMutex);
+    return edgeLog;
+}
+
+/// Returns the recorded edges of one pin in time order
+std::vector<PinEdge> SimGpioBackend::getEdges(int pin) const {
+    std::vector<PinEdge> result;
+    std::lock_guard<std::mutex> lock(edgeMutex);
+    for (const PinEdge& edge : edgeLog) {
+        if (edge.pin == pin) result.push_back(edge);
+    }
+    return result;
+}
+
+/// Measures period and duty accuracy of the PWM signal recorded on a pin.
+/// A period spans two consecutive rising edges.
+PwmAnalysis SimGpioBackend::analysePwm(int pin) const {
+    PwmAnalysis result = {};
+    std::vector<PinEdge> edges = getEdges(pin);
+
+    std::vector<int64_t> periods;
+    std::vector<double> duties;
+    int64_t lastRise = -1, lastFall = -1;
+
+    for (const PinEdge& edge : edges) {
+        if (edge.level == pinHigh) {
+            if (lastRise >= 0 && lastFall > lastRise) {
+                int64_t period = edge.tNs - lastRise;
+                periods.push_back(period);
+                duties.push_back((double)(lastFall - lastRise) / period);
+            }
+            lastRise = edge.tNs;
+        }
+        else {
+            lastFall = edge.tNs;
+        }
+    }
+    if (periods.empty()) return result;
+
+    double periodSum = 0, dutySum = 0;
+    for (size_t i = 0; i < periods.size(); i++) {
+        periodSum += periods[i];
+        dutySum += duties[i];
+    }
+    double meanPeriod = periodSum / periods.size();
+    double meanDuty = dutySum / duties.size();
+
+    double squares = 0, maxPeriodError = 0, maxDutyError = 0;
+    for (size_t i = 0; i < periods.size(); i++) {
+        double error = std::fabs(periods[i] - meanPeriod);
+        squares += error * error;
+        if (error > maxPeriodError) maxPeriodError = error;
+        double dutyError = std::fabs(duties[i] - meanDuty);
+        if (dutyError > maxDutyError) maxDutyError = dutyError;
+    }
+
+    result.periods = periods.size();
+    result.meanPeriodNs = (int64_t)meanPeriod;
+    result.maxPeriodErrorNs = (int64_t)maxPeriodError;
+    result.rmsPeriodErrorNs = (int64_t)std::sqrt(squares / periods.size());
+    result.meanDuty = meanDuty;
+    result.maxDutyError = maxDutyError;
+    return result;
+}
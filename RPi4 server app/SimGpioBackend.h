@@ -0,0 +1,133 @@
+#pragma once
+
+#include "GpioBackend.h"
+#include "SimMotor.h"
+#include "RingQueue.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+const int simPinCount = 64;
+const int simChannelCount = 16;
+constexpr double SIM_MAX_TIME_SCALE = 1000.0;
+constexpr size_t SIM_DRIVE_QUEUE_SIZE = 4096;	// drive changes per motor and tick; more are lost
+
+/// A level change on a simulated output pin
+struct PinEdge {
+	int pin;
+	int level;
+	int64_t tNs;
+};
+
+/// Duty and period accuracy of the PWM signal recorded on one pin
+struct PwmAnalysis {
+	uint64_t periods;
+	int64_t meanPeriodNs;
+	int64_t maxPeriodErrorNs;	// worst deviation of a period from the mean
+	int64_t rmsPeriodErrorNs;
+	double meanDuty;			// high time / period, [0.0 - 1.0]
+	double maxDutyError;		// worst deviation of a period's duty from the mean
+};
+
+/// What a simulated motor follows
+enum simDrive {
+	simDriveEdges = 0,		// the H-bridge pin levels, edge by edge
+	simDriveAverage,		// the duty of the PWM setting, as a steady voltage
+	simDriveCount
+};
+
+/// Change of the voltage a motor sees, as a signed fraction of the supply
+struct DriveChange {
+	int64_t tNs;
+	double drive;
+};
+
+/// Off-target backend: keeps pin state in memory, records output edges with
+/// nanosecond timestamps while recording is on and lets callers inject
+/// edges on input pins.
+///
+/// Attached motors are simulated: a thread integrates each motor under the
+/// drive its H-bridge pins give and runs the sensor pin's handler for every
+/// magnet pass, with the clock reading the pass time while it runs. The
+/// clock can run faster than real time; every wait that goes through the
+/// backend is shortened to match. OS timer jitter is stretched by the same
+/// factor, so a fast clock should drive the motors from the PWM settings
+/// rather than from the late edges of the PWM thread.
+class SimGpioBackend : public GpioBackend {
+private:
+	std::atomic<int> modes[simPinCount];
+	std::atomic<int> levels[simPinCount];
+	std::atomic<void (*)()> handlers[simPinCount];
+
+	std::atomic<bool> recording;
+	mutable std::mutex edgeMutex;
+	std::vector<PinEdge> edgeLog;
+
+	// Virtual time runs 'timeScale' times as fast as CLOCK_MONOTONIC from 'realBaseNs'
+	double timeScale;
+	int64_t realBaseNs;
+
+	// Motors are attached before the simulation starts and kept until it ends
+	std::vector<std::unique_ptr<SimMotor>> motors;
+	// Per motor, since the last tick. Lock-free, so the PWM thread hands
+	// its edges over without waiting for the simulator.
+	std::vector<std::unique_ptr<RingQueue<DriveChange>>> driveChanges;
+	int pinMotor[simPinCount];			// motor an H-bridge pin belongs to, -1 if none
+	int channelMotor[simChannelCount];	// motor a PWM channel last drove, -1 if none
+	simDrive driveMode;
+	mutable std::mutex motorMutex;		// guards the motor models and channelMotor
+	std::atomic<bool> simulating;
+	std::thread simulator;
+
+	static bool validPin(int pin);
+	static int64_t realNowNs();
+	void recordDrive(int motor, int64_t tNs, double drive);
+	void simulationLoop();
+	void deliverEdge(int pin, int64_t tNs);
+
+public:
+	SimGpioBackend();
+	~SimGpioBackend();
+
+	int setup() override;
+
+	void pinMode(int pin, int mode) override;
+	void digitalWrite(int pin, int value) override;
+	int digitalRead(int pin) override;
+	int registerISR(int pin, int edge, void (*handler)()) override;
+
+	int64_t nowNs() override;
+	void sleepUntilNs(int64_t deadlineNs) override;
+	void waitUntilNs(int64_t deadlineNs, std::atomic<uint32_t>& wake, uint32_t seen) override;
+	void pwmChanged(int channel, int pin, int64_t onNs, int64_t periodNs) override;
+
+	void injectRisingEdge(int pin);
+
+	bool setTimeScale(double scale);
+	double getTimeScale() const {
+		return timeScale;
+	}
+	void setDriveMode(simDrive mode) {
+		driveMode = mode;
+	}
+	simDrive getDriveMode() const {
+		return driveMode;
+	}
+	int attachMotor(const SimMotorParams& params, int cwPin, int ccwPin, int sensorPin);
+	void startSimulation();
+	void stopSimulation();
+	size_t motorCount() const {
+		return motors.size();
+	}
+	SimMotorState motorState(int motor) const;
+
+	void setRecording(bool value);
+	void clearEdges();
+	std::vector<PinEdge> getEdges() const;
+	std::vector<PinEdge> getEdges(int pin) const;
+
+	PwmAnalysis analysePwm(int pin) const;
+};
@@ -0,0 +1,94 @@
+#include "SimMotor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+
+constexpr double TWO_PI = 6.283185307179586;
+
+//  PARAMETERS  ////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+bool parseSimMotorParams(const std::string& text, SimMotorParams& params) {
+	std::istringstream iss(text);
+	std::string item;
+	while (std::getline(iss, item, ',')) {
+		size_t equals = item.find('=');
+		if (equals == std::string::npos) return false;
+		std::string key = item.substr(0, equals);
+		char* end;
+		double value = strtod(item.c_str() + equals + 1, &end);
+		if (*end != '\0' || !(value >= 0.0)) return false;
+
+		if (key == "V") params.supplyVolts = value;
+		else if (key == "R" && value > 0.0) params.resistanceOhm = value;
+		else if (key == "L" && value > 0.0) params.inductanceH = value;
+		else if (key == "Ke" && value > 0.0) params.backEmfVs = value;
+		else if (key == "J" && value > 0.0) params.inertiaKgm2 = value;
+		else if (key == "b") params.viscousNms = value;
+		else if (key == "load") params.loadNm = value;
+		else return false;
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//  MODEL   ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+SimMotor::SimMotor(const SimMotorParams& params, int cwPin, int ccwPin, int sensorPin, int64_t startNs)
+	: params(params), current(0.0), speed(0.0), angle(0.0), pulseIndex(0), pulses(0), timeNs(startNs), drive(0.0),
+	  cwPin(cwPin), ccwPin(ccwPin), sensorPin(sensorPin) {}
+
+/// Brings the model to 'toNs' under the present drive, appending the
+/// times of the sensor edges on the way
+void SimMotor::advance(int64_t toNs, std::vector<int64_t>& edges) {
+	while (timeNs < toNs) {
+		int64_t stepNs = std::min(SIM_STEP_NS, toNs - timeNs);
+		step(stepNs / 1e9, timeNs, edges);
+		timeNs += stepNs;
+	}
+}
+
+/// One step. With the speed held over the step the current settles
+/// exponentially towards (V - Ke w) / R; the load torque holds a stalled
+/// rotor until the motor torque overcomes it and never reverses it.
+void SimMotor::step(double dtS, int64_t startNs, std::vector<int64_t>& edges) {
+	const SimMotorParams& p = params;
+	double volts = drive * p.supplyVolts;
+	double settled = (volts - p.backEmfVs * speed) / p.resistanceOhm;
+	current = settled + (current - settled) * std::exp(-dtS * p.resistanceOhm / p.inductanceH);
+
+	double torque = p.backEmfVs * current - p.viscousNms * speed;
+	double before = speed;
+	if (speed == 0.0) {
+		if (std::fabs(torque) <= p.loadNm) return;
+		torque -= std::copysign(p.loadNm, torque);
+		speed = torque / p.inertiaKgm2 * dtS;
+	}
+	else {
+		torque -= std::copysign(p.loadNm, speed);
+		speed += torque / p.inertiaKgm2 * dtS;
+		if ((speed > 0.0) != (before > 0.0)) speed = 0.0;
+	}
+
+	double startAngle = angle;
+	angle += (before + speed) * 0.5 * dtS;
+
+	// A magnet passing the sensor gives a rising edge whichever way it turns
+	double pulseAngle = TWO_PI / p.pulsesPerRevolution;
+	int64_t index = (int64_t)std::floor(angle / pulseAngle);
+	while (index != pulseIndex) {
+		int64_t passed = index > pulseIndex ? pulseIndex + 1 : pulseIndex;
+		double fraction = (passed * pulseAngle - startAngle) / (angle - startAngle);
+		edges.push_back(startNs + (int64_t)(fraction * dtS * 1e9));
+		pulses++;
+		pulseIndex += index > pulseIndex ? 1 : -1;
+	}
+}
+
+SimMotorState SimMotor::state() const {
+	return SimMotorState{ current, speed * 60.0 / TWO_PI, angle / TWO_PI, pulses };
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+constexpr int64_t SIM_STEP_NS = 10000;		// longest integration step, virtual time
+constexpr int64_t SIM_TICK_NS = 500000;		// how often the simulator delivers sensor edges
+
+/// Electrical and mechanical constants of a brushed DC motor behind an
+/// H-bridge. The defaults match nominalMaxRpm at 12 V.
+struct SimMotorParams {
+	double supplyVolts = 12.0;
+	double resistanceOhm = 4.0;
+	double inductanceH = 0.002;			// electrical time constant L / R = 0.5 ms
+	double backEmfVs = 0.036;			// V per rad/s, equal to the torque constant in Nm/A
+	double inertiaKgm2 = 1.0e-5;		// mechanical time constant J R / K^2 = 31 ms
+	double viscousNms = 2.0e-6;			// friction growing with speed
+	double loadNm = 0.005;				// constant load and friction torque against the motion
+	int pulsesPerRevolution = 1;		// magnet edges per turn, the server's --ppr
+};
+
+/// Parses "key=value,..." over the defaults. Keys: V, R, L, Ke, J, b,
+/// load. Returns false on an unknown key or a value out of range.
+bool parseSimMotorParams(const std::string& text, SimMotorParams& params);
+
+/// Model state, for reports
+struct SimMotorState {
+	double currentA;
+	double rpm;						// signed, positive clockwise
+	double revolutions;
+	uint64_t pulses;
+};
+
+/// One simulated motor. Its H-bridge inputs are sampled as a list of level
+/// changes; between changes the drive is constant, so the current follows
+/// its exact exponential and only the mechanics are stepped. Sensor edges
+/// come out with the time the magnet passed the sensor.
+class SimMotor {
+private:
+	SimMotorParams params;
+	double current;					// A
+	double speed;					// rad/s
+	double angle;					// rad
+	int64_t pulseIndex;				// magnet positions passed, as floor(angle / pulse angle)
+	uint64_t pulses;
+	int64_t timeNs;					// virtual time the state is valid at
+	double drive;					// fraction of the supply, negative counter clockwise
+
+	void step(double dtS, int64_t startNs, std::vector<int64_t>& edges);
+
+public:
+	int cwPin, ccwPin, sensorPin;
+
+	SimMotor(const SimMotorParams& params, int cwPin, int ccwPin, int sensorPin, int64_t startNs);
+
+	void advance(int64_t toNs, std::vector<int64_t>& edges);
+	void setDrive(double value) {
+		drive = value;
+	}
+	SimMotorState state() const;
+};
@@ -0,0 +1,95 @@
+#include "SpeedController.h"
+
+#include <cmath>
+
+constexpr float derivativeFilter = 0.2f;	// weight of the newest rate sample
+
+SpeedController::SpeedController() : integral(0), lastMeasured(0), measuredRate(0), primed(false) {
+	gains = { 0.02f, 0.08f, 0.0f, 0.04f, 0.0f, 120.0f, 0.5f };
+}
+
+void SpeedController::setGains(const PidGains& newGains) {
+	gains = newGains;
+}
+
+PidGains SpeedController::getGains() const {
+	return gains;
+}
+
+/// Clears the controller state before a new run
+void SpeedController::reset(float initialIntegral) {
+	integral = initialIntegral;
+	lastMeasured = 0;
+	measuredRate = 0;
+	primed = false;
+}
+
+/// Runs one control step and returns the power to apply
+float SpeedController::update(float targetRpm, float measuredRpm, float dtS) {
+	float error = targetRpm - measuredRpm;
+
+	if (primed && dtS > 0) {
+		float rate = (measuredRpm - lastMeasured) / dtS;
+		measuredRate += derivativeFilter * (rate - measuredRate);
+	}
+	lastMeasured = measuredRpm;
+	primed = true;
+
+	// Far from the target the feed-forward and P term do the work; the
+	// sensor lags by a revolution there and would wind the integral up
+	float candidate = integral;
+	if (gains.integralZone <= 0 || std::fabs(error) <= gains.integralZone * std::fabs(targetRpm))
+		candidate += gains.ki * error * dtS;
+	float out = gains.kff * targetRpm + gains.kp * error + candidate - gains.kd * measuredRate;
+
+	if (out > gains.outMax) {
+		out = gains.outMax;
+		if (error < 0) integral = candidate;
+	}
+	else if (out < gains.outMin) {
+		out = gains.outMin;
+		if (error > 0) integral = candidate;
+	}
+	else {
+		integral = candidate;
+	}
+	return out;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+void ControlRecorder::begin(float targetRpm, int64_t nowNs) {
+	stats = {};
+	stats.targetRpm = targetRpm;
+	stats.settlingNs = -1;
+	startNs = nowNs;
+	lastOutsideNs = nowNs;
+	jitterSumNs = 0;
+}
+
+void ControlRecorder::tick(float measuredRpm, int64_t nowNs, int64_t lateNs) {
+	stats.ticks++;
+	stats.finalRpm = measuredRpm;
+	if (measuredRpm > stats.peakRpm) stats.peakRpm = measuredRpm;
+
+	if (lateNs < 0) lateNs = 0;
+	jitterSumNs += lateNs;
+	if (lateNs > stats.maxJitterNs) stats.maxJitterNs = lateNs;
+
+	float band = std::fmax(std::fabs(stats.targetRpm) * SETTLE_BAND, SETTLE_MIN_BAND_RPM);
+	if (std::fabs(measuredRpm - stats.targetRpm) > band) lastOutsideNs = nowNs;
+}
+
+ControlStats ControlRecorder::finish() const {
+	ControlStats out = stats;
+	if (out.ticks > 0) {
+		out.meanJitterNs = jitterSumNs / out.ticks;
+		// Settled only if the speed was inside the band when the run ended
+		float band = std::fmax(std::fabs(out.targetRpm) * SETTLE_BAND, SETTLE_MIN_BAND_RPM);
+		if (std::fabs(out.finalRpm - out.targetRpm) <= band) out.settlingNs = lastOutsideNs - startNs;
+	}
+	if (out.targetRpm > 0 && out.peakRpm > out.targetRpm) {
+		out.overshootPct = (out.peakRpm - out.targetRpm) * 100.0f / out.targetRpm;
+	}
+	return out;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+
+/// PID gains; output is in motor power units (0 - maxSpeed, 0.1 V each)
+struct PidGains {
+	float kp;		// per rpm of error
+	float ki;		// per rpm of error per second
+	float kd;		// per rpm/s of measured speed change
+	float kff;		// feed-forward, per rpm of target
+	float outMin;
+	float outMax;
+	float integralZone;	// integrate only within this fraction of the target, 0 always
+};
+
+/// How a closed loop run went
+struct ControlStats {
+	uint32_t ticks;
+	float targetRpm;
+	float finalRpm;
+	float peakRpm;
+	float overshootPct;		// peak beyond the target, % of target
+	int64_t settlingNs;		// time until the speed stayed within the band, -1 if never
+	int64_t meanJitterNs;	// control tick wake-up lateness
+	int64_t maxJitterNs;
+};
+
+constexpr int CONTROL_TICK_MS = 10;
+constexpr float SETTLE_BAND = 0.05f;		// fraction of target counting as settled
+constexpr float SETTLE_MIN_BAND_RPM = 20.0f;
+
+/// PID speed controller with feed-forward. The integral only moves near
+/// the target and while the output is unsaturated or the error pulls it
+/// back (anti-windup), and the derivative acts on a low-passed measurement
+/// so setpoint changes do not kick the output.
+class SpeedController {
+private:
+	PidGains gains;
+	float integral;
+	float lastMeasured;
+	float measuredRate;		// filtered d(measured)/dt
+	bool primed;
+
+public:
+	SpeedController();
+
+	void setGains(const PidGains& newGains);
+	PidGains getGains() const;
+	void reset(float initialIntegral = 0.0f);
+
+	float update(float targetRpm, float measuredRpm, float dtS);
+};
+
+/// Tracks overshoot, settling time and tick jitter of one run
+class ControlRecorder {
+private:
+	ControlStats stats;
+	int64_t startNs;
+	int64_t lastOutsideNs;
+	int64_t jitterSumNs;
+
+public:
+	void begin(float targetRpm, int64_t nowNs);
+	void tick(float measuredRpm, int64_t nowNs, int64_t lateNs);
+	ControlStats finish() const;
+};
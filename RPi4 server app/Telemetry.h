@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+constexpr uint16_t TELEMETRY_MAGIC = 0x4D54;	// "TM" on the wire
+constexpr int TELEMETRY_MAX_RATE = 1000;		// Hz
+constexpr int TELEMETRY_TEXT_RATE = 10;		// Hz, the legacy text stream
+constexpr int64_t TELEMETRY_BATCH_NS = 10000000;	// samples gathered per push
+constexpr size_t TELEMETRY_BATCH_MAX = 64;
+
+enum tDirection : uint8_t {
+    dirStopped = 0,
+    dirCW,
+    dirCCW
+};
+
+/// One telemetry sample as sent on the speed channel in binary mode.
+/// Fixed size, packed, little-endian (native on the Pi and on x86).
+#pragma pack(push, 1)
+struct TelemetryFrame {
+    uint16_t magic;			// TELEMETRY_MAGIC
+    uint16_t size;			// sizeof(TelemetryFrame)
+    uint32_t sequence;		// per session, gaps mean dropped samples
+    int64_t timestampNs;	// CLOCK_MONOTONIC of the sample
+    float rpm;
+    uint16_t duty;			// on time / period, scaled to 0 - 65535
+    uint8_t direction;		// tDirection
+    uint8_t motor;			// motor id; was reserved and 0, as on single-motor servers
+};
+#pragma pack(pop)
+
+static_assert(sizeof(TelemetryFrame) == 24, "TelemetryFrame is a wire format");
+
+/// Thins the sampling ticks out to a rate. The frames of one tick come
+/// motor by motor with the same timestamp and are used or skipped
+/// together, as decided on the tick's first frame. A consumer that falls
+/// more than a period behind starts afresh instead of catching up.
+struct TickDecimator {
+    int64_t nextSampleNs = 0;
+    int64_t tickNs = -1;		// timestamp of the current tick
+    bool sampleDue = false;		// the current tick is used
+
+    /// Whether the frame at 'timestampNs' is used at 'rateHz'
+    bool due(int64_t timestampNs, int rateHz) {
+        if (timestampNs == tickNs) return sampleDue;
+        tickNs = timestampNs;
+        sampleDue = timestampNs >= nextSampleNs;
+        if (sampleDue) {
+            int64_t period = 1000000000LL / rateHz;
+            if (timestampNs - nextSampleNs > period)
+                nextSampleNs = timestampNs + period;
+            else
+                nextSampleNs += period;
+        }
+        return sampleDue;
+    }
+
+    /// Whether 'timestampNs' starts a tick not decided yet
+    bool isNewTick(int64_t timestampNs) const {
+        return timestampNs != tickNs;
+    }
+};
+
+typedef std::vector<TelemetryFrame> TelemetryBatch;
+typedef std::shared_ptr<const TelemetryBatch> SharedTelemetryBatch;	// read by every speed session at once
+
@@ -0,0 +1,121 @@
+#include "TelemetryMulticast.h"
+#include "Logger.h"
+#include "Metrics.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+bool parseMulticastAddress(const std::string& text, MulticastConfig& config) {
+	size_t colon = text.find(':');
+	std::string address = text.substr(0, colon);
+	in_addr parsed;
+	if (inet_pton(AF_INET, address.c_str(), &parsed) != 1) return false;
+
+	if (colon != std::string::npos) {
+		char* end;
+		long port = strtol(text.c_str() + colon + 1, &end, 10);
+		if (*end != '\0' || port < 1 || port > 65535) return false;
+		config.port = (int)port;
+	}
+	config.address = address;
+	return true;
+}
+
+TelemetryMulticast::TelemetryMulticast()
+	: fd(-1), destination(), rateHz(TELEMETRY_MULTICAST_RATE), sequence(0), ticks(), pendingCount(0) {}
+
+TelemetryMulticast::~TelemetryMulticast() {
+	close();
+}
+
+/// Opens the sending socket. A multicast group gets the TTL, loopback to
+/// observers on this host and the sending interface; any other address is
+/// sent to with broadcast allowed.
+bool TelemetryMulticast::open(const MulticastConfig& config) {
+	close();
+	destination = sockaddr_in();
+	destination.sin_family = AF_INET;
+	destination.sin_port = htons(config.port);
+	if (inet_pton(AF_INET, config.address.c_str(), &destination.sin_addr) != 1) {
+		LOG_ERROR(logServer, "Bad telemetry multicast address '%s'", config.address.c_str());
+		return false;
+	}
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		LOG_ERROR(logServer, "Telemetry multicast socket creation failed");
+		return false;
+	}
+
+	bool ok = true;
+	if (IN_MULTICAST(ntohl(destination.sin_addr.s_addr))) {
+		unsigned char ttl = (unsigned char)config.ttl;
+		unsigned char loop = 1;
+		ok = setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == 0
+			&& setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) == 0;
+		if (ok && !config.interfaceAddress.empty()) {
+			in_addr local;
+			ok = inet_pton(AF_INET, config.interfaceAddress.c_str(), &local) == 1
+				&& setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &local, sizeof(local)) == 0;
+		}
+	}
+	else {
+		int broadcast = 1;
+		ok = setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast)) == 0;
+	}
+	if (!ok) {
+		LOG_ERROR(logServer, "Telemetry multicast socket options failed: %s", strerror(errno));
+		close();
+		return false;
+	}
+
+	rateHz = config.rateHz < 1 ? 1 : config.rateHz > TELEMETRY_MAX_RATE ? TELEMETRY_MAX_RATE : config.rateHz;
+	ticks = TickDecimator();
+	pendingCount = 0;
+	LOG_INFO(logServer, "Telemetry multicast to %s:%d at %d Hz", config.address.c_str(), config.port, rateHz);
+	return true;
+}
+
+void TelemetryMulticast::close() {
+	if (fd < 0) return;
+	::close(fd);
+	fd = -1;
+}
+
+/// Sends the pending frames as one datagram. A datagram the socket does
+/// not take is dropped, never retried; the sequence already moved on.
+void TelemetryMulticast::flush() {
+	if (pendingCount == 0) return;
+
+	ssize_t sent = sendto(fd, pending, pendingCount * sizeof(TelemetryFrame), MSG_DONTWAIT,
+		(const sockaddr*)&destination, sizeof(destination));
+	if (sent < 0) {
+		metrics().multicastDropped.add(pendingCount);
+		LOG_DEBUG(logServer, "Telemetry datagram dropped: %s", strerror(errno));
+	}
+	else {
+		metrics().multicastFrames.add(pendingCount);
+		metrics().multicastDatagrams.add();
+	}
+	pendingCount = 0;
+}
+
+/// Numbers and sends the frames due at the channel's rate. A batch usually
+/// goes out as one datagram.
+void TelemetryMulticast::feed(const TelemetryBatch& batch) {
+	if (fd < 0) return;
+
+	for (const TelemetryFrame& frame : batch) {
+		if (!ticks.due(frame.timestampNs, rateHz)) continue;
+
+		TelemetryFrame& out = pending[pendingCount++];
+		out = frame;
+		out.sequence = sequence++;
+		if (pendingCount == TELEMETRY_DATAGRAM_FRAMES) flush();
+	}
+	flush();
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "Telemetry.h"
+
+#include <cstdint>
+#include <string>
+#include <netinet/in.h>
+
+constexpr int TELEMETRY_MULTICAST_PORT = 12348;
+constexpr const char* TELEMETRY_MULTICAST_GROUP = "239.255.77.84";	// organisation-local scope
+constexpr int TELEMETRY_MULTICAST_RATE = 100;		// Hz
+constexpr size_t TELEMETRY_DATAGRAM_FRAMES = 56;	// 1344 bytes, inside one Ethernet frame
+
+/// Where the UDP telemetry goes and how often it is sampled
+struct MulticastConfig {
+	std::string address;			// multicast group or broadcast address; empty when off
+	int port = TELEMETRY_MULTICAST_PORT;
+	int rateHz = TELEMETRY_MULTICAST_RATE;
+	int ttl = 1;					// router hops; 1 keeps it on the LAN
+	std::string interfaceAddress;	// local address the group is sent from, empty for the routing default
+};
+
+/// Parses "<address>[:port]" into 'config'. Returns false if malformed.
+bool parseMulticastAddress(const std::string& text, MulticastConfig& config);
+
+/// Sends the telemetry samples as UDP datagrams of whole TelemetryFrames to
+/// a multicast group or broadcast address. Every observer receives the same
+/// datagram, so the server's cost does not grow with them. Frames are
+/// numbered by one sequence over the whole channel; frames that could not
+/// be sent keep their numbers, so receivers see every loss as a gap.
+class TelemetryMulticast {
+private:
+	int fd;
+	sockaddr_in destination;
+	int rateHz;
+	uint32_t sequence;
+	TickDecimator ticks;
+	TelemetryFrame pending[TELEMETRY_DATAGRAM_FRAMES];
+	size_t pendingCount;
+
+	void flush();
+
+public:
+	TelemetryMulticast();
+	~TelemetryMulticast();
+	TelemetryMulticast(const TelemetryMulticast&) = delete;
+	TelemetryMulticast& operator=(const TelemetryMulticast&) = delete;
+
+	bool open(const MulticastConfig& config);
+	void close();
+	void feed(const TelemetryBatch& batch);
+
+	bool isOpen() const {
+		return fd >= 0;
+	}
+	int getRateHz() const {
+		return rateHz;
+	}
+};
@@ -0,0 +1,231 @@
+#include "TelemetryStream.h"
+
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+
+static const char* const FIELD_NAMES[telemetryFieldCount] = { "rpm", "duty", "dir" };
+static const char* const STAT_NAMES[telemetryStatCount] = { "min", "max", "mean", "stddev" };
+
+//  SPECS   ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+static bool parseInt(const std::string& token, int& value) {
+	const char* end = token.data() + token.size();
+	auto result = std::from_chars(token.data(), end, value);
+	return result.ec == std::errc() && result.ptr == end;
+}
+
+/// Parses a comma separated list of names into bits of their indices
+static bool parseNames(const std::string& list, const char* const* names, int count, uint8_t& bits) {
+	bits = 0;
+	std::istringstream iss(list);
+	std::string name;
+	while (std::getline(iss, name, ',')) {
+		int index = 0;
+		while (index < count && name != names[index]) index++;
+		if (index == count) return false;
+		bits |= 1 << index;
+	}
+	return bits != 0;
+}
+
+static void appendNames(std::string& out, uint8_t bits, const char* const* names, int count, char separator) {
+	bool first = true;
+	for (int index = 0; index < count; index++) {
+		if (!(bits & (1 << index))) continue;
+		if (!first) out.push_back(separator);
+		out.append(names[index]);
+		first = false;
+	}
+}
+
+///	SUB [FIELDS rpm,duty,dir] [RATE hz] [MOTOR id|ALL] [WINDOW ms] [STATS min,max,mean,stddev]
+///	Naming a window or statistics asks for statistics instead of raw samples.
+const char* parseStreamSpec(const std::string& args, StreamSpec& spec) {
+	spec = StreamSpec();
+	std::istringstream iss(args);
+	std::string key, value;
+	while (iss >> key) {
+		if (!(iss >> value)) return "missing value";
+
+		if (key == "FIELDS") {
+			if (!parseNames(value, FIELD_NAMES, telemetryFieldCount, spec.fields)) return "unknown field";
+		}
+		else if (key == "STATS") {
+			if (!parseNames(value, STAT_NAMES, telemetryStatCount, spec.stats)) return "unknown statistic";
+		}
+		else if (key == "RATE") {
+			if (!parseInt(value, spec.rateHz) || spec.rateHz < 1 || spec.rateHz > TELEMETRY_MAX_RATE) return "rate out of range";
+		}
+		else if (key == "WINDOW") {
+			if (!parseInt(value, spec.windowMs) || spec.windowMs < 1 || spec.windowMs > MAX_TELEMETRY_WINDOW_MS) return "window out of range";
+		}
+		else if (key == "MOTOR") {
+			if (value == "ALL") spec.motor = -1;
+			else if (!parseInt(value, spec.motor) || spec.motor < 0 || spec.motor >= TELEMETRY_STREAM_MOTORS) return "unknown motor";
+		}
+		else {
+			return "unknown keyword";
+		}
+	}
+
+	if (spec.stats || spec.windowMs) {
+		if (!spec.stats) spec.stats = (1 << telemetryStatCount) - 1;
+		if (!spec.windowMs) spec.windowMs = TELEMETRY_WINDOW_MS;
+		if (!spec.rateHz) spec.rateHz = TELEMETRY_WINDOW_RATE;
+		if (spec.fields & (1 << fieldDirection)) return "direction has no statistics";
+		if ((int64_t)spec.windowMs * spec.rateHz < 1000) return "window shorter than a sample period";
+	}
+	else if (!spec.rateHz) {
+		spec.rateHz = TELEMETRY_STREAM_RATE;
+	}
+	return nullptr;
+}
+
+/// "rpm,duty at 100 Hz, motor all" or "rpm min/max over 500 ms at 100 Hz, motor 0"
+std::string describeStreamSpec(const StreamSpec& spec) {
+	std::string out;
+	appendNames(out, spec.fields, FIELD_NAMES, telemetryFieldCount, ',');
+	if (spec.stats) {
+		out.push_back(' ');
+		appendNames(out, spec.stats, STAT_NAMES, telemetryStatCount, '/');
+		out.append(" over ").append(std::to_string(spec.windowMs)).append(" ms");
+	}
+	out.append(" at ").append(std::to_string(spec.rateHz)).append(" Hz, motor ")
+		.append(spec.motor < 0 ? "all" : std::to_string(spec.motor));
+	return out;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//  STREAM  ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+TelemetryStream::TelemetryStream(int id, const StreamSpec& spec)
+	: id(id), spec(spec), sequence(0), ticks(), windowEndNs(0), window{} {}
+
+static void appendTime(std::string& out, int64_t ns) {
+	char text[32];
+	snprintf(text, sizeof(text), " %lld.%06lld", (long long)(ns / 1000000000LL), (long long)(ns % 1000000000LL / 1000));
+	out.append(text);
+}
+
+void TelemetryStream::appendSample(std::string& out, const TelemetryFrame& frame) {
+	char text[48];
+	out.push_back('#');
+	out.append(std::to_string(id)).push_back(' ');
+	out.append(std::to_string(sequence));
+	appendTime(out, frame.timestampNs);
+	out.push_back(' ');
+	out.append(std::to_string(frame.motor));
+
+	if (spec.fields & (1 << fieldRpm)) {
+		snprintf(text, sizeof(text), " rpm=%.2f", frame.rpm);
+		out.append(text);
+	}
+	if (spec.fields & (1 << fieldDuty)) {
+		snprintf(text, sizeof(text), " duty=%.4f", frame.duty / 65535.0);
+		out.append(text);
+	}
+	if (spec.fields & (1 << fieldDirection)) {
+		out.append(frame.direction == dirCW ? " dir=cw" : frame.direction == dirCCW ? " dir=ccw" : " dir=stop");
+	}
+	out.push_back('\n');
+}
+
+/// Writes one line per motor that had samples in the window and starts
+/// the next window. Returns the lines written.
+uint32_t TelemetryStream::closeWindow(std::string& out) {
+	uint32_t lines = 0;
+	char text[48];
+	for (int motor = 0; motor < TELEMETRY_STREAM_MOTORS; motor++) {
+		if (window[motor][fieldRpm].count == 0) continue;
+
+		out.push_back('#');
+		out.append(std::to_string(id)).push_back(' ');
+		out.append(std::to_string(sequence));
+		appendTime(out, windowEndNs);
+		out.push_back(' ');
+		out.append(std::to_string(motor)).append(" n=").append(std::to_string(window[motor][fieldRpm].count));
+
+		for (int field = fieldRpm; field < fieldDirection; field++) {
+			if (!(spec.fields & (1 << field))) continue;
+			const Accumulator& acc = window[motor][field];
+			double values[telemetryStatCount] = { acc.min, acc.max, acc.mean, std::sqrt(acc.m2 / acc.count) };
+
+			out.push_back(' ');
+			out.append(FIELD_NAMES[field]).push_back('=');
+			bool first = true;
+			for (int stat = 0; stat < telemetryStatCount; stat++) {
+				if (!(spec.stats & (1 << stat))) continue;
+				snprintf(text, sizeof(text), field == fieldRpm ? "%s%.2f" : "%s%.4f", first ? "" : "/", values[stat]);
+				out.append(text);
+				first = false;
+			}
+		}
+		out.push_back('\n');
+		lines++;
+	}
+
+	for (auto& motor : window) {
+		for (Accumulator& acc : motor) acc = Accumulator{};
+	}
+	sequence++;
+	return lines;
+}
+
+void TelemetryStream::accumulate(const TelemetryFrame& frame) {
+	double values[fieldDirection] = { frame.rpm, frame.duty / 65535.0 };
+	for (int field = fieldRpm; field < fieldDirection; field++) {
+		Accumulator& acc = window[frame.motor][field];
+		double value = values[field];
+		if (acc.count == 0 || value < acc.min) acc.min = value;
+		if (acc.count == 0 || value > acc.max) acc.max = value;
+		acc.count++;
+		double delta = value - acc.mean;
+		acc.mean += delta / acc.count;
+		acc.m2 += delta * (value - acc.mean);
+	}
+}
+
+/// Turns the ticks due at the stream's rate into lines. A window closes on
+/// the first tick at or past its end; after a pause in sampling the next
+/// one starts afresh.
+StreamChunk TelemetryStream::feed(const TelemetryBatch& batch) {
+	std::string out;
+	uint32_t lines = 0;
+
+	for (const TelemetryFrame& frame : batch) {
+		if (ticks.isNewTick(frame.timestampNs)) {
+			// Raw lines of one tick share a sequence number
+			if (!spec.stats && ticks.sampleDue) sequence++;
+			bool due = ticks.due(frame.timestampNs, spec.rateHz);
+
+			if (spec.stats && due) {
+				if (windowEndNs == 0) {
+					windowEndNs = frame.timestampNs + spec.windowMs * 1000000LL;
+				}
+				else if (frame.timestampNs >= windowEndNs) {
+					lines += closeWindow(out);
+					windowEndNs += spec.windowMs * 1000000LL;
+					if (frame.timestampNs >= windowEndNs) windowEndNs = frame.timestampNs + spec.windowMs * 1000000LL;
+				}
+			}
+		}
+		if (!ticks.sampleDue || frame.motor >= TELEMETRY_STREAM_MOTORS) continue;
+		if (spec.motor >= 0 && frame.motor != spec.motor) continue;
+
+		if (spec.stats) {
+			accumulate(frame);
+		}
+		else {
+			appendSample(out, frame);
+			lines++;
+		}
+	}
+
+	if (out.empty()) return StreamChunk{ nullptr, 0 };
+	return StreamChunk{ std::make_shared<const std::string>(std::move(out)), lines };
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "Telemetry.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+constexpr int TELEMETRY_STREAM_RATE = 10;		// Hz, raw samples when SUB names no rate
+constexpr int TELEMETRY_WINDOW_RATE = 100;		// Hz, samples fed to a window when SUB names no rate
+constexpr int TELEMETRY_WINDOW_MS = 1000;		// window when SUB asks for statistics only
+constexpr int MAX_TELEMETRY_WINDOW_MS = 60000;
+constexpr int TELEMETRY_STREAM_MOTORS = 8;		// motor ids a stream keeps windows for
+
+enum telemetryField {
+	fieldRpm = 0,
+	fieldDuty,
+	fieldDirection,			// raw samples only
+	telemetryFieldCount
+};
+
+enum telemetryStat {
+	statMin = 0,
+	statMax,
+	statMean,
+	statStddev,				// population standard deviation
+	telemetryStatCount
+};
+
+/// What a subscriber asked for. Subscribers asking for the same thing
+/// share one stream.
+struct StreamSpec {
+	uint8_t fields = 1 << fieldRpm;	// telemetryField bits
+	uint8_t stats = 0;				// telemetryStat bits, 0 for raw samples
+	int rateHz = 0;
+	int windowMs = 0;				// statistics only
+	int motor = -1;					// -1 for every motor
+
+	bool operator==(const StreamSpec& other) const {
+		return fields == other.fields && stats == other.stats && rateHz == other.rateHz
+			&& windowMs == other.windowMs && motor == other.motor;
+	}
+};
+
+/// Text a stream produced from one batch, shared read-only by its subscribers
+struct StreamChunk {
+	std::shared_ptr<const std::string> text;
+	uint32_t lines;
+};
+
+/// Parses the arguments of SUB into 'spec'. Returns null for a valid spec,
+/// otherwise the reason it was rejected.
+const char* parseStreamSpec(const std::string& args, StreamSpec& spec);
+std::string describeStreamSpec(const StreamSpec& spec);
+
+/// Decimates or aggregates the sample batches once for everyone subscribed
+/// to the same spec, and encodes the result once. Lines carry the stream id
+/// and a sequence that grows by one per sample tick or window, so a
+/// subscriber whose backlog overflowed sees the gap.
+///
+///   #<id> <seq> <time s> <motor> rpm=<rpm> duty=<0-1> dir=<cw|ccw|stop>
+///   #<id> <seq> <window end s> <motor> n=<samples> rpm=<min>/<max>/<mean>/<stddev> ...
+///
+/// Only the fields and statistics asked for appear, in the order above.
+/// Owned by the network thread.
+class TelemetryStream {
+private:
+	/// Welford's running mean and variance, with the range
+	struct Accumulator {
+		uint32_t count;
+		double min, max, mean, m2;
+	};
+
+	int id;
+	StreamSpec spec;
+	uint32_t sequence;
+	TickDecimator ticks;
+	int64_t windowEndNs;			// 0 until the first sample
+	Accumulator window[TELEMETRY_STREAM_MOTORS][fieldDirection];
+
+	void appendSample(std::string& out, const TelemetryFrame& frame);
+	uint32_t closeWindow(std::string& out);
+	void accumulate(const TelemetryFrame& frame);
+
+public:
+	TelemetryStream(int id, const StreamSpec& spec);
+
+	int getId() const {
+		return id;
+	}
+	const StreamSpec& getSpec() const {
+		return spec;
+	}
+
+	/// Connection ids of the subscribers
+	std::vector<int> subscribers;
+
+	/// Runs a batch through the stream; the chunk's text is null when
+	/// nothing came due
+	StreamChunk feed(const TelemetryBatch& batch);
+};
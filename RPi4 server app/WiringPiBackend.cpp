@@ -0,0 +1,52 @@
+#include "WiringPiBackend.h"
+#include "Futex.h"
+#include "Logger.h"
+
+#include <wiringPi.h>
+#include <cerrno>
+#include <cstring>
+#include <time.h>
+
+/// Initialises wiringPi with Broadcom pin numbering
+int WiringPiBackend::setup() {
+    return wiringPiSetupGpio();
+}
+
+void WiringPiBackend::pinMode(int pin, int mode) {
+    ::pinMode(pin, mode);
+}
+
+void WiringPiBackend::digitalWrite(int pin, int value) {
+    ::digitalWrite(pin, value);
+}
+
+int WiringPiBackend::digitalRead(int pin) {
+    return ::digitalRead(pin);
+}
+
+int WiringPiBackend::registerISR(int pin, int edge, void (*handler)()) {
+    return wiringPiISR(pin, edge, handler);
+}
+
+/// Returns CLOCK_MONOTONIC in nanoseconds
+int64_t WiringPiBackend::nowNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/// Sleeps until an absolute CLOCK_MONOTONIC deadline
+void WiringPiBackend::sleepUntilNs(int64_t deadlineNs) {
+    timespec ts;
+    ts.tv_sec = deadlineNs / 1000000000LL;
+    ts.tv_nsec = deadlineNs % 1000000000LL;
+    // Only a signal is retried; an invalid deadline returns at once
+    int result;
+    while ((result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr)) == EINTR) {}
+    if (result != 0) LOG_ERROR(logServer, "Sleep until %lld ns failed: %s", (long long)deadlineNs, strerror(result));
+}
+
+/// Sleeps on the futex word with the CLOCK_MONOTONIC deadline as its timeout
+void WiringPiBackend::waitUntilNs(int64_t deadlineNs, std::atomic<uint32_t>& wake, uint32_t seen) {
+    futexWaitUntilNs(wake, seen, deadlineNs);
+}
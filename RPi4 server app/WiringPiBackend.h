@@ -0,0 +1,18 @@
+#pragma once
+
+#include "GpioBackend.h"
+
+/// Hardware backend: forwards to wiringPi, times with CLOCK_MONOTONIC
+class WiringPiBackend : public GpioBackend {
+public:
+	int setup() override;
+
+	void pinMode(int pin, int mode) override;
+	void digitalWrite(int pin, int value) override;
+	int digitalRead(int pin) override;
+	int registerISR(int pin, int edge, void (*handler)()) override;
+
+	int64_t nowNs() override;
+	void sleepUntilNs(int64_t deadlineNs) override;
+	void waitUntilNs(int64_t deadlineNs, std::atomic<uint32_t>& wake, uint32_t seen) override;
+};
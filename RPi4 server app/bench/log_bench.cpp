@@ -0,0 +1,65 @@
+// Measures what a log call costs the calling thread: compiled out,
+// filtered at runtime, queued to the async logger, and written
+// synchronously to std::cerr as the server used to. Run with stderr
+// sent somewhere realistic (a terminal, ssh, or /dev/null as a floor).
+//
+//   cmake --build <build dir> --target log_bench
+
+#include "Logger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using benchClock = std::chrono::steady_clock;
+
+constexpr int bursts = 300;
+constexpr int burstSize = 64;	// below the ring size, so nothing is dropped
+
+static int64_t nowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(benchClock::now().time_since_epoch()).count();
+}
+
+static int64_t percentile(const std::vector<int64_t>& sorted, double p) {
+	if (sorted.empty()) return 0;
+	return sorted[(size_t)(p * (sorted.size() - 1))];
+}
+
+/// Times every call of 'logOnce' in bursts the sink can keep up with
+template <typename Log>
+void report(const char* name, Log logOnce) {
+	std::vector<int64_t> samples;
+	samples.reserve(bursts * burstSize);
+
+	for (int b = 0; b < bursts; b++) {
+		for (int i = 0; i < burstSize; i++) {
+			int64_t start = nowNs();
+			logOnce(b * burstSize + i);
+			samples.push_back(nowNs() - start);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	}
+
+	std::sort(samples.begin(), samples.end());
+	printf("%-16s p50 %8.0f ns  p99 %8.0f ns  p99.9 %8.0f ns  max %9.0f ns\n", name,
+		(double)percentile(samples, 0.50), (double)percentile(samples, 0.99),
+		(double)percentile(samples, 0.999), (double)samples.back());
+}
+
+int main() {
+	logger().start();
+	logger().setLevel(logInfo);
+
+	report("compiled out", [](int i) { LOG_TRACE(logCmdExe, "Executing command %d", i); });
+	report("filtered", [](int i) { LOG_DEBUG(logCmdExe, "Executing command %d", i); });
+	report("async", [](int i) { LOG_INFO(logCmdExe, "Executing command %d", i); });
+	report("std::cerr", [](int i) { std::cerr << "CMDEXE:\tExecuting command " << i << '\n'; });
+
+	logger().stop();
+	printf("async messages written %llu, dropped %llu\n",
+		(unsigned long long)logger().getWritten(), (unsigned long long)logger().getDropped());
+	return 0;
+}
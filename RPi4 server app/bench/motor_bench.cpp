@@ -0,0 +1,460 @@
+// Benchmarks the server's hot paths on the simulated GPIO backend:
+//   pwm       PWM engine period and on-time error at 10/50/90% duty, and
+//             period error and CPU per edge with 1 to 8 channels driven
+//   duty      achieved duty against the requested step at each PWM
+//             frequency and resolution
+//   parser    CommandParser cost per command
+//   queue     RingQueue push+pop cost and cross-thread wake-up latency
+//   journal   cost of appending an event to the memory-mapped journal
+//   loopback  command round trip through a MotorServer on 127.0.0.1
+// Prints p50/p99/p99.9 per measurement; --json and --csv write the same
+// results for comparing runs over time.
+//
+//   motor_bench [--suite pwm,duty,parser,queue,journal,loopback] [--quick]
+//               [--json <file|->] [--csv <file|->]
+
+#include "CommandParser.h"
+#include "Journal.h"
+#include "Logger.h"
+#include "MotorServer.h"
+#include "PwmEngine.h"
+#include "RingQueue.h"
+#include "SimGpioBackend.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+using benchClock = std::chrono::steady_clock;
+
+/// Distribution of one measurement, in nanoseconds
+struct BenchResult {
+	std::string suite;
+	std::string name;
+	size_t samples;
+	double meanNs;
+	double p50Ns;
+	double p99Ns;
+	double p999Ns;
+	double maxNs;
+	double opsPerSec;	// 0 when throughput does not apply
+};
+
+static std::vector<BenchResult> results;
+static bool quick = false;
+static FILE* table = stdout;	// stderr when machine-readable output goes to stdout
+
+static int64_t nowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(benchClock::now().time_since_epoch()).count();
+}
+
+static double percentile(const std::vector<int64_t>& sorted, double p) {
+	if (sorted.empty()) return 0;
+	return (double)sorted[(size_t)(p * (sorted.size() - 1))];
+}
+
+/// Summarises 'samples' into a result and prints it
+static void record(const char* suite, const std::string& name, std::vector<int64_t> samples, double opsPerSec = 0) {
+	BenchResult result = { suite, name, samples.size(), 0, 0, 0, 0, 0, opsPerSec };
+	if (!samples.empty()) {
+		std::sort(samples.begin(), samples.end());
+		double sum = 0;
+		for (int64_t s : samples) sum += s;
+		result.meanNs = sum / samples.size();
+		result.p50Ns = percentile(samples, 0.50);
+		result.p99Ns = percentile(samples, 0.99);
+		result.p999Ns = percentile(samples, 0.999);
+		result.maxNs = (double)samples.back();
+	}
+	results.push_back(result);
+
+	fprintf(table, "%-9s %-26s n %7zu  p50 %10.0f  p99 %10.0f  p99.9 %10.0f  max %10.0f ns",
+		suite, name.c_str(), result.samples, result.p50Ns, result.p99Ns, result.p999Ns, result.maxNs);
+	if (opsPerSec > 0) fprintf(table, "  %12.0f ops/s", opsPerSec);
+	fprintf(table, "\n");
+}
+
+//	PWM	////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Drives one pin at 1 kHz and measures every period and on-time against
+/// the requested values from the recorded edges
+static void benchPwm(SimGpioBackend& sim) {
+	const int pin = 17;
+	const int periodUs = 1000;
+	const int runMs = quick ? 200 : 1000;
+
+	PwmEngine engine;
+	engine.start();
+	for (int dutyPct : { 10, 50, 90 }) {
+		int onUs = periodUs * dutyPct / 100;
+		sim.clearEdges();
+		sim.setRecording(true);
+		engine.setOutput(0, pin, onUs, periodUs - onUs);
+		std::this_thread::sleep_for(std::chrono::milliseconds(runMs));
+		engine.idle(0);
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		sim.setRecording(false);
+
+		std::vector<PinEdge> edges = sim.getEdges(pin);
+		std::vector<int64_t> periodError, onError;
+		int64_t lastRise = -1;
+		for (size_t i = 0; i < edges.size(); i++) {
+			if (edges[i].level != pinHigh) continue;
+			if (lastRise >= 0) periodError.push_back(std::abs(edges[i].tNs - lastRise - periodUs * 1000LL));
+			if (i + 1 < edges.size() && edges[i + 1].level == pinLow)
+				onError.push_back(std::abs(edges[i + 1].tNs - edges[i].tNs - onUs * 1000LL));
+			lastRise = edges[i].tNs;
+		}
+		record("pwm", "period_error_duty" + std::to_string(dutyPct), periodError);
+		record("pwm", "on_time_error_duty" + std::to_string(dutyPct), onError);
+	}
+	engine.stop();
+
+	// One engine thread serves every channel; its CPU should follow the
+	// edge count. A fresh engine per run so its CPU figure covers the run.
+	for (int channels : { 1, 2, 4, 8 }) {
+		PwmEngine multi;
+		sim.clearEdges();
+		sim.setRecording(true);
+		multi.start();
+		for (int channel = 0; channel < channels; channel++) {
+			int onUs = periodUs * (20 + 10 * channel) / 100;
+			multi.setOutput(channel, pin + channel, onUs, periodUs - onUs);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(runMs));
+		PwmStats stats = multi.getStats();
+		multi.stop();
+		sim.setRecording(false);
+
+		std::vector<int64_t> periodError;
+		for (int channel = 0; channel < channels; channel++) {
+			int64_t lastRise = -1;
+			for (const PinEdge& edge : sim.getEdges(pin + channel)) {
+				if (edge.level != pinHigh) continue;
+				if (lastRise >= 0) periodError.push_back(std::abs(edge.tNs - lastRise - periodUs * 1000LL));
+				lastRise = edge.tNs;
+			}
+		}
+		std::string suffix = std::to_string(channels) + "ch";
+		double edgesPerSec = 2.0 * stats.periods * 1000.0 / runMs;
+		record("pwm", "period_error_" + suffix, periodError, edgesPerSec);
+		record("pwm", "engine_cpu_per_edge_" + suffix, { (int64_t)(stats.cpuLoad * 1e9 / edgesPerSec) });
+	}
+}
+
+//	DUTY	////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Drives steps near 10, 50 and 90% from the duty table of each setting
+/// and compares every recorded period with the step it was asked for.
+/// The on time error is recorded per setting; the summary gives the duty
+/// error as a fraction of the period, next to the size of one step.
+static void benchDuty(SimGpioBackend& sim) {
+	const int pin = 17;
+	const int runMs = quick ? 50 : 250;
+
+	PwmEngine engine;
+	engine.start();
+	std::vector<std::string> summary;
+	for (int frequency : { 200, 1000, 5000, 20000 }) {
+		for (int bits : { 6, 8, 10 }) {
+			DutyTable dutyTable(frequency, bits);
+			std::vector<int64_t> onError;
+			double dutyErrorSum = 0, dutyErrorMax = 0;
+
+			for (int dutyPct : { 10, 50, 90 }) {
+				int step = (dutyTable.steps() * dutyPct + 50) / 100;
+				double requested = (double)step / dutyTable.steps();
+				sim.clearEdges();
+				sim.setRecording(true);
+				engine.setOutputNs(0, pin, dutyTable.onNs(step), dutyTable.getPeriodNs());
+				std::this_thread::sleep_for(std::chrono::milliseconds(runMs));
+				engine.idle(0);
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				sim.setRecording(false);
+
+				// Whole periods only: rise, fall, next rise
+				std::vector<PinEdge> edges = sim.getEdges(pin);
+				for (size_t i = 0; i + 2 < edges.size(); i++) {
+					if (edges[i].level != pinHigh || edges[i + 1].level != pinLow || edges[i + 2].level != pinHigh) continue;
+					int64_t on = edges[i + 1].tNs - edges[i].tNs;
+					int64_t period = edges[i + 2].tNs - edges[i].tNs;
+					onError.push_back(std::abs(on - (int64_t)(requested * dutyTable.getPeriodNs())));
+					double dutyError = std::fabs((double)on / period - requested);
+					dutyErrorSum += dutyError;
+					if (dutyError > dutyErrorMax) dutyErrorMax = dutyError;
+				}
+			}
+
+			std::string name = std::to_string(frequency) + "hz_" + std::to_string(bits) + "bit";
+			record("duty", "on_time_error_" + name, onError);
+			char line[160];
+			snprintf(line, sizeof(line), "duty      %5d Hz %2d bits  step %.4f%%  duty error mean %.4f%%  max %.4f%%  (%zu periods)",
+				frequency, bits, 100.0 / dutyTable.steps(), onError.empty() ? 0.0 : 100.0 * dutyErrorSum / onError.size(),
+				100.0 * dutyErrorMax, onError.size());
+			summary.push_back(line);
+		}
+	}
+	engine.stop();
+	for (const std::string& line : summary) fprintf(table, "%s\n", line.c_str());
+}
+
+//	PARSER	////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Times batches of commands; per-command cost is the batch time / size
+static void benchParser() {
+	const std::vector<std::string> messages = {
+		"RCW 5 1000", "RCCW 7.5 250", "ACC 3 0", "TSI", "RPM 1500 2000",
+		"TSO", "RCCW 2,25 125", "quit",
+	};
+	const int batches = quick ? 5000 : 50000;
+	const int batchSize = 64;
+
+	std::vector<int64_t> samples;
+	samples.reserve(batches);
+	volatile float sink = 0;
+
+	int64_t start = nowNs();
+	for (int b = 0; b < batches; b++) {
+		int64_t t0 = nowNs();
+		for (int i = 0; i < batchSize; i++) {
+			ParsedCommand parsed = parseCommand(messages[i % messages.size()]);
+			sink = sink + parsed.speed;
+		}
+		samples.push_back((nowNs() - t0) / batchSize);
+	}
+	double seconds = (nowNs() - start) / 1e9;
+	record("parser", "parse_command", samples, batches * (double)batchSize / seconds);
+}
+
+//	QUEUE	////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Uncontended push+pop pairs, then the time from a push to an idle
+/// consumer holding the value
+static void benchQueue() {
+	RingQueue<int64_t> queue(1024);
+	const int batches = quick ? 5000 : 50000;
+	const int batchSize = 64;
+
+	std::vector<int64_t> samples;
+	samples.reserve(batches);
+	int64_t value;
+
+	int64_t start = nowNs();
+	for (int b = 0; b < batches; b++) {
+		int64_t t0 = nowNs();
+		for (int i = 0; i < batchSize; i++) {
+			queue.push(i);
+			queue.tryPop(value);
+		}
+		samples.push_back((nowNs() - t0) / batchSize);
+	}
+	double seconds = (nowNs() - start) / 1e9;
+	record("queue", "push_pop", samples, batches * (double)batchSize / seconds);
+
+	const int wakeSamples = quick ? 500 : 3000;
+	std::vector<int64_t> latency;
+	latency.reserve(wakeSamples);
+	std::thread consumer([&queue, &latency, wakeSamples]() {
+		int64_t sent;
+		for (int i = 0; i < wakeSamples; i++) {
+			while (!queue.waitPop(sent)) {}
+			latency.push_back(nowNs() - sent);
+		}
+	});
+	for (int i = 0; i < wakeSamples; i++) {
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+		queue.push(nowNs());
+	}
+	consumer.join();
+	record("queue", "wake_latency", latency);
+}
+
+//	JOURNAL	////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Appends in batches to a journal small enough to wrap many times, so
+/// the figure includes slots that were written before
+static void benchJournal() {
+	const char* path = "/tmp/motor_bench.journal";
+	Journal journal;
+	if (!journal.open(path, 1024 * 1024)) return;
+
+	const int batches = quick ? 5000 : 50000;
+	const int batchSize = 64;
+	std::vector<int64_t> samples;
+	samples.reserve(batches);
+
+	int64_t start = nowNs();
+	for (int b = 0; b < batches; b++) {
+		int64_t t0 = nowNs();
+		for (int i = 0; i < batchSize; i++) {
+			journal.duty(0, 17, i * 1000, 1000000);
+		}
+		samples.push_back((nowNs() - t0) / batchSize);
+	}
+	double seconds = (nowNs() - start) / 1e9;
+	record("journal", "append", samples, batches * (double)batchSize / seconds);
+
+	journal.close();
+	unlink(path);
+}
+
+//	LOOPBACK	////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Sends one command and reads until a response line contains 'until'
+static bool roundTrip(int fd, const char* command, const char* until, std::string& buffer) {
+	if (send(fd, command, strlen(command), MSG_NOSIGNAL) < 0) return false;
+	while (true) {
+		size_t end;
+		while ((end = buffer.find('\n')) != std::string::npos) {
+			bool done = buffer.compare(0, end, until) == 0 || buffer.substr(0, end).find(until) != std::string::npos;
+			buffer.erase(0, end + 1);
+			if (done) return true;
+		}
+		char chunk[1024];
+		ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+		if (n <= 0) return false;
+		buffer.append(chunk, n);
+	}
+}
+
+/// Runs a MotorServer in this process and measures client round trips
+/// for a queued command (through parsing and execution) and a query
+static void benchLoopback() {
+	// Outlives the run: the server's worker threads are detached
+	static MotorServer server;
+	server.bindAddress = "127.0.0.1";
+	std::thread serverThread([]() { server.startServer(); });
+
+	int fd = -1;
+	for (int attempt = 0; attempt < 100 && fd < 0; attempt++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(recvPort);
+		inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+		if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd < 0) {
+		fprintf(table, "loopback  server did not come up on port %d, skipped\n", recvPort);
+		server.stopServer();
+		serverThread.join();
+		return;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	const int trips = quick ? 200 : 2000;
+	std::string buffer;
+	struct Case { const char* name; const char* command; const char* until; };
+	for (const Case& c : { Case{ "command_round_trip", "ACC 10 0\n", "Completed" },
+			Case{ "query_round_trip", "PWM\n", "PWM periods" } }) {
+		std::vector<int64_t> samples;
+		samples.reserve(trips);
+		int64_t start = nowNs();
+		for (int i = 0; i < trips; i++) {
+			int64_t t0 = nowNs();
+			if (!roundTrip(fd, c.command, c.until, buffer)) break;
+			samples.push_back(nowNs() - t0);
+		}
+		double seconds = (nowNs() - start) / 1e9;
+		record("loopback", c.name, samples, samples.size() / seconds);
+	}
+
+	close(fd);
+	server.stopServer();
+	serverThread.join();
+}
+
+//	OUTPUT	////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+static FILE* openOutput(const std::string& path) {
+	if (path == "-") return stdout;
+	FILE* file = fopen(path.c_str(), "w");
+	if (!file) fprintf(stderr, "cannot write %s\n", path.c_str());
+	return file;
+}
+
+static void writeJson(const std::string& path) {
+	FILE* out = openOutput(path);
+	if (!out) return;
+	fprintf(out, "{\n  \"timestamp\": %lld,\n  \"results\": [\n",
+		(long long)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+	for (size_t i = 0; i < results.size(); i++) {
+		const BenchResult& r = results[i];
+		fprintf(out, "    {\"suite\": \"%s\", \"name\": \"%s\", \"samples\": %zu, \"mean_ns\": %.1f, "
+			"\"p50_ns\": %.1f, \"p99_ns\": %.1f, \"p999_ns\": %.1f, \"max_ns\": %.1f, \"ops_per_sec\": %.1f}%s\n",
+			r.suite.c_str(), r.name.c_str(), r.samples, r.meanNs, r.p50Ns, r.p99Ns, r.p999Ns, r.maxNs,
+			r.opsPerSec, i + 1 < results.size() ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+	if (out != stdout) fclose(out);
+}
+
+static void writeCsv(const std::string& path) {
+	FILE* out = openOutput(path);
+	if (!out) return;
+	fprintf(out, "suite,name,samples,mean_ns,p50_ns,p99_ns,p999_ns,max_ns,ops_per_sec\n");
+	for (const BenchResult& r : results) {
+		fprintf(out, "%s,%s,%zu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", r.suite.c_str(), r.name.c_str(),
+			r.samples, r.meanNs, r.p50Ns, r.p99Ns, r.p999Ns, r.maxNs, r.opsPerSec);
+	}
+	if (out != stdout) fclose(out);
+}
+
+////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[]) {
+	std::string suites = "pwm,duty,parser,queue,journal,loopback";
+	std::string jsonPath, csvPath;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--suite" && i + 1 < argc) suites = argv[++i];
+		else if (arg == "--json" && i + 1 < argc) jsonPath = argv[++i];
+		else if (arg == "--csv" && i + 1 < argc) csvPath = argv[++i];
+		else if (arg == "--quick") quick = true;
+		else {
+			fprintf(stderr, "usage: %s [--suite pwm,duty,parser,queue,journal,loopback] [--quick] [--json <file|->] [--csv <file|->]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (jsonPath == "-" || csvPath == "-") table = stderr;
+	auto selected = [&suites](const char* name) {
+		return ("," + suites + ",").find("," + std::string(name) + ",") != std::string::npos;
+	};
+
+	static SimGpioBackend sim;
+	setGpioBackend(&sim);
+	gpio().setup();
+	logger().setLevel(logWarn);
+	logger().start();
+
+	if (selected("pwm")) benchPwm(sim);
+	if (selected("duty")) benchDuty(sim);
+	if (selected("parser")) benchParser();
+	if (selected("queue")) benchQueue();
+	if (selected("journal")) benchJournal();
+	if (selected("loopback")) benchLoopback();
+
+	logger().stop();
+	if (!jsonPath.empty()) writeJson(jsonPath);
+	if (!csvPath.empty()) writeCsv(csvPath);
+	return 0;
+}
@@ -0,0 +1,119 @@
+// Compares CommandParser against the istringstream/stof parser that
+// MotorServer::parseCommand used, counting heap allocations per command.
+//
+//   cmake --build <build dir> --target parser_bench
+
+#include "CommandParser.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using benchClock = std::chrono::steady_clock;
+
+constexpr int rounds = 200000;
+
+static std::atomic<uint64_t> allocations(0);
+
+void* operator new(size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+	std::free(p);
+}
+
+/// The previous parser, minus its per-command std::cout line. It also
+/// read tokens[2] unchecked, so only full commands are fed to it.
+static ParsedCommand legacyParse(std::string message) {
+	ParsedCommand parsed = { mCmd::none, 0, 0, parseOk, 0 };
+	if (message == "") return parsed;
+
+	std::istringstream iss(message);
+	std::vector<std::string> tokens;
+
+	std::string token;
+	while (std::getline(iss, token, ' ')) {
+		tokens.push_back(token);
+	}
+
+	std::string commandRaw = tokens[0];
+	if (tokens.size() > 1) {
+		try {
+			parsed.speed = std::stof(tokens[1]);
+			parsed.duration = std::stof(tokens[2]);
+		}
+		catch (const std::exception& e) {
+			parsed.error = errInvalidArgument;
+		}
+	}
+
+	if (commandRaw == "RCW")
+		parsed.cmd = mCmd::rotateCW;
+	else if (commandRaw == "RCCW")
+		parsed.cmd = mCmd::rotateCCW;
+	else if (commandRaw == "TSI")
+		parsed.cmd = mCmd::SpdOn;
+	else if (commandRaw == "TSO")
+		parsed.cmd = mCmd::SpdOff;
+	else if (commandRaw == "ACC")
+		parsed.cmd = mCmd::Acc;
+	else if (commandRaw == "quit")
+		parsed.cmd = mCmd::quit;
+	return parsed;
+}
+
+/// A mix resembling a client session
+static const std::vector<std::string>& workload() {
+	static const std::vector<std::string> messages = {
+		"RCW 5 1000", "RCCW 7.5 250", "ACC 3 0", "TSI", "RCW 10 2000",
+		"TSO", "RCCW 2.25 125", "quit",
+	};
+	return messages;
+}
+
+template <typename Parse>
+void report(const char* name, Parse parse) {
+	const std::vector<std::string>& messages = workload();
+	volatile float sink = 0;
+
+	uint64_t allocBefore = allocations.load();
+	auto start = benchClock::now();
+	for (int r = 0; r < rounds; r++) {
+		for (const std::string& message : messages) {
+			ParsedCommand parsed = parse(message);
+			sink = sink + parsed.speed + parsed.cmd;
+		}
+	}
+	double seconds = std::chrono::duration<double>(benchClock::now() - start).count();
+	uint64_t allocs = allocations.load() - allocBefore;
+
+	double commands = (double)rounds * messages.size();
+	printf("%-14s %12.0f commands/s  %8.1f ns/command  %6.2f allocations/command\n",
+		name, commands / seconds, seconds * 1e9 / commands, allocs / commands);
+}
+
+int main() {
+	// Both parsers must agree before their speed means anything
+	for (const std::string& message : workload()) {
+		ParsedCommand a = legacyParse(message);
+		ParsedCommand b = parseCommand(message);
+		if (a.cmd != b.cmd || a.speed != b.speed || a.duration != b.duration) {
+			printf("mismatch on '%s'\n", message.c_str());
+			return 1;
+		}
+	}
+
+	report("istringstream", [](const std::string& m) { return legacyParse(m); });
+	report("CommandParser", [](const std::string& m) { return parseCommand(m); });
+	return 0;
+}
@@ -0,0 +1,125 @@
+// Runs a queued command sequence through the legacy per-slice ramp and
+// through the MotionPlanner profiles, on the simulated GPIO backend.
+// Reports the CPU time and wake-ups of the executing thread.
+//
+//   cmake --build <build dir> --target planner_bench
+
+#include "MotorController.h"
+#include "SimGpioBackend.h"
+
+#include <cstdio>
+#include <sys/resource.h>
+#include <time.h>
+#include <vector>
+
+struct Segment {
+	int direction;
+	float volts;
+	float durationMs;
+};
+
+static const std::vector<Segment> sequence = {
+	{ motorCW, 6.0f, 400 }, { motorCW, 9.0f, 300 }, { motorCW, 4.0f, 400 },
+	{ motorCCW, 5.0f, 500 }, { motorCCW, 8.0f, 300 }, { motorCW, 3.0f, 400 },
+};
+
+static int64_t threadCpuNs() {
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/// The previous MotorController ramp: one power step, calculatePWM and a
+/// delay per slice, an idle output after every command and a full stop
+/// before every reversal
+class LegacyRamp {
+private:
+	PwmEngine& engine;
+	int lastPowerSet = 0;
+	int lastDirection = motorCW;
+	int acceleration = 10;
+	int pwmOnTime = 0, pwmOffTime = 0;
+
+	void calculatePWM(float speed) {
+		int T = 1000;	// us, the fixed 1 kHz period it used
+		float t = T / maxSpeed;
+		pwmOnTime = speed > maxSpeed ? t * maxSpeed : t * speed;
+		pwmOffTime = T - pwmOnTime;
+	}
+	void accelerateMotor(int direction, float speed) {
+		calculatePWM(speed);
+		engine.setOutput(0, direction, pwmOnTime, pwmOffTime);
+		gpio().delay((11 - acceleration) * 2);
+	}
+
+public:
+	explicit LegacyRamp(PwmEngine& pwm) : engine(pwm) {}
+
+	void stopMotor() {
+		unsigned long startTime = gpio().millis();
+		while (gpio().millis() - startTime < 2000 && lastPowerSet > 0) {
+			accelerateMotor(lastDirection, --lastPowerSet);
+		}
+		engine.idle(0);
+	}
+	void turnMotor(int direction, float desiredSpeed, float mDuration) {
+		unsigned long startTime = gpio().millis();
+		if (direction != lastDirection) stopMotor();
+		int speed = lastPowerSet;
+		while (gpio().millis() - startTime < mDuration) {
+			if (lastPowerSet > desiredSpeed) speed = --lastPowerSet;
+			else if (lastPowerSet < desiredSpeed) speed = ++lastPowerSet;
+			accelerateMotor(direction, speed);
+		}
+		lastDirection = direction;
+		engine.idle(0);
+	}
+};
+
+/// Sleeps the thread went into, i.e. wake-ups
+static long threadWakeups() {
+	rusage usage;
+	getrusage(RUSAGE_THREAD, &usage);
+	return usage.ru_nvcsw;
+}
+
+static void report(const char* name, int64_t cpuNs, int64_t wallNs, long wakeups) {
+	printf("%-18s cpu %7.2f ms  wall %6.0f ms  cpu load %5.2f%%  wake-ups %5ld\n",
+		name, cpuNs / 1e6, wallNs / 1e6, cpuNs * 100.0 / wallNs, wakeups);
+}
+
+int main() {
+	static SimGpioBackend sim;
+	setGpioBackend(&sim);
+
+	PwmEngine engine;
+	MotorController controller(0, defaultMotorPins, engine);
+	controller.setupController();
+
+	{
+		LegacyRamp legacy(engine);
+		int64_t wall = gpio().nowNs();
+		int64_t cpu = threadCpuNs();
+		long wakeups = threadWakeups();
+		for (const Segment& s : sequence) legacy.turnMotor(s.direction, s.volts * 10, s.durationMs);
+		legacy.stopMotor();
+		report("per-slice ramp", threadCpuNs() - cpu, gpio().nowNs() - wall, threadWakeups() - wakeups);
+	}
+
+	for (int shape = profileTrapezoid; shape <= profileSCurve; shape++) {
+		controller.setProfileShape(shape);
+		int64_t wall = gpio().nowNs();
+		int64_t cpu = threadCpuNs();
+		long wakeups = threadWakeups();
+		for (const Segment& s : sequence) {
+			if (s.direction == motorCW) controller.turnCW(s.volts, s.durationMs);
+			else controller.turnCCW(s.volts, s.durationMs);
+		}
+		controller.stopMotor();
+		report(shape == profileSCurve ? "planned S-curve" : "planned trapezoid",
+			threadCpuNs() - cpu, gpio().nowNs() - wall, threadWakeups() - wakeups);
+	}
+
+	engine.stop();
+	return 0;
+}
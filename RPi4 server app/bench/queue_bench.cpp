@@ -0,0 +1,127 @@
+// Compares the MotorServer RingQueue against the mutex + std::queue pair
+// it replaced, including the polling consumer the server loops used.
+//
+//   cmake --build <build dir> --target queue_bench
+
+#include "RingQueue.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+using benchClock = std::chrono::steady_clock;
+
+constexpr int producers = 3;
+constexpr int itemsPerProducer = 200000;
+constexpr int latencySamples = 2000;
+
+/// The previous pushX/popX implementation
+template <typename T>
+class LockedQueue {
+private:
+	std::queue<T> items;
+	std::mutex mutex;
+
+public:
+	bool push(T value) {
+		std::unique_lock<std::mutex> lock(mutex);
+		items.push(value);
+		lock.unlock();
+		return true;
+	}
+	bool tryPop(T& out) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (items.empty()) return false;
+		out = items.front();
+		items.pop();
+		return true;
+	}
+	/// Consumers polled the queue and slept 1 ms when it was empty
+	bool waitPop(T& out) {
+		while (!tryPop(out)) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		return true;
+	}
+};
+
+static int64_t nowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(benchClock::now().time_since_epoch()).count();
+}
+
+/// Items per second with several producers and one consumer
+template <typename Queue>
+double throughput(Queue& queue) {
+	const int total = producers * itemsPerProducer;
+	auto start = benchClock::now();
+
+	std::vector<std::thread> threads;
+	for (int p = 0; p < producers; p++) {
+		threads.emplace_back([&queue]() {
+			for (int i = 0; i < itemsPerProducer; i++) {
+				while (!queue.push((int64_t)i)) std::this_thread::yield();
+			}
+		});
+	}
+
+	int64_t value;
+	for (int received = 0; received < total; received++) {
+		while (!queue.waitPop(value)) {}
+	}
+	for (std::thread& t : threads) t.join();
+
+	double seconds = std::chrono::duration<double>(benchClock::now() - start).count();
+	return total / seconds;
+}
+
+/// Push-to-pop wake-up latency for an idle consumer, sorted ascending
+template <typename Queue>
+std::vector<int64_t> latency(Queue& queue) {
+	std::vector<int64_t> samples;
+	samples.reserve(latencySamples);
+
+	std::thread consumer([&queue, &samples]() {
+		int64_t sent;
+		for (int i = 0; i < latencySamples; i++) {
+			while (!queue.waitPop(sent)) {}
+			samples.push_back(nowNs() - sent);
+		}
+	});
+
+	for (int i = 0; i < latencySamples; i++) {
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+		queue.push(nowNs());
+	}
+	consumer.join();
+
+	std::sort(samples.begin(), samples.end());
+	return samples;
+}
+
+static int64_t percentile(const std::vector<int64_t>& sorted, double p) {
+	if (sorted.empty()) return 0;
+	size_t index = (size_t)(p * (sorted.size() - 1));
+	return sorted[index];
+}
+
+template <typename Queue>
+void report(const char* name, Queue& queue) {
+	double rate = throughput(queue);
+	std::vector<int64_t> samples = latency(queue);
+	printf("%-14s %12.0f items/s   latency p50 %8.1f us  p99 %8.1f us  max %8.1f us\n",
+		name, rate,
+		percentile(samples, 0.50) / 1000.0,
+		percentile(samples, 0.99) / 1000.0,
+		samples.empty() ? 0.0 : samples.back() / 1000.0);
+}
+
+int main() {
+	LockedQueue<int64_t> locked;
+	RingQueue<int64_t> ring(1024);
+
+	report("mutex+queue", locked);
+	report("RingQueue", ring);
+	return 0;
+}
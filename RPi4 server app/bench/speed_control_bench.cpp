@@ -0,0 +1,110 @@
+// Runs the closed loop SpeedController against a simulated DC motor and
+// compares it with the open loop feed-forward the controller replaces,
+// under load and supply voltage changes. Time is simulated, so the run is
+// deterministic and faster than real time.
+//
+//   cmake --build <build dir> --target speed_control_bench
+
+#include "SpeedController.h"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+constexpr float maxPower = 120.0f;			// MotorController maxSpeed
+constexpr float nominalMaxRpm = 3000.0f;
+constexpr int64_t simStepNs = 100000;		// plant integration step
+constexpr int64_t tickNs = (int64_t)CONTROL_TICK_MS * 1000000;
+constexpr int64_t runNs = 3000000000LL;
+constexpr int64_t maxLatenessNs = 400000;	// simulated control tick wake-up jitter
+
+/// First order motor: speed follows gain * power minus load drop with
+/// time constant tau. The sensor sees one magnet per turn, so the
+/// measured speed only changes once per revolution, like MotorMonitor.
+struct MotorPlant {
+	float rpmPerPower;
+	float loadDropRpm;
+	float tauS;
+
+	float rpm = 0;
+	double angle = 0;			// revolutions since the last edge
+	int64_t lastEdgeNs = -1;
+	float measured = 0;
+
+	void step(float power, int64_t nowNs, float dtS) {
+		float steady = std::fmax(0.0f, rpmPerPower * power - loadDropRpm);
+		rpm += (steady - rpm) * dtS / tauS;
+		angle += rpm / 60.0 * dtS;
+		if (angle >= 1.0) {
+			angle -= 1.0;
+			if (lastEdgeNs >= 0) measured = 60.0e9f / (nowNs - lastEdgeNs);
+			lastEdgeNs = nowNs;
+		}
+		// No edge for a second reads as stopped
+		if (lastEdgeNs >= 0 && nowNs - lastEdgeNs > 1000000000LL) measured = 0;
+	}
+};
+
+struct Scenario {
+	const char* name;
+	float rpmPerPower;
+	float loadDropRpm;
+};
+
+/// Runs one step response; closedLoop false applies the feed-forward only
+static ControlStats run(const Scenario& scenario, float target, bool closedLoop) {
+	MotorPlant plant = { scenario.rpmPerPower, scenario.loadDropRpm, 0.15f };
+	SpeedController controller;
+	controller.setGains({ 0.02f, 0.08f, 0.0f, maxPower / nominalMaxRpm, 0.0f, maxPower, 0.5f });
+	controller.reset();
+
+	std::mt19937 random(7);
+	std::uniform_int_distribution<int64_t> lateness(0, maxLatenessNs);
+
+	ControlRecorder recorder;
+	recorder.begin(target, 0);
+
+	float power = 0;
+	int64_t next = 0;
+	int64_t wake = lateness(random);
+	for (int64_t now = 0; now < runNs; now += simStepNs) {
+		if (now >= wake) {
+			recorder.tick(plant.measured, now, now - next);
+			power = closedLoop
+				? controller.update(target, plant.measured, CONTROL_TICK_MS / 1000.0f)
+				: std::fmin(maxPower, target * maxPower / nominalMaxRpm);
+			next += tickNs;
+			wake = next + lateness(random);
+		}
+		plant.step(power, now, simStepNs / 1e9f);
+	}
+	return recorder.finish();
+}
+
+static void report(const char* mode, const Scenario& scenario, const ControlStats& stats) {
+	char settling[32];
+	if (stats.settlingNs < 0) snprintf(settling, sizeof(settling), "not settled");
+	else snprintf(settling, sizeof(settling), "%lld ms", (long long)(stats.settlingNs / 1000000));
+
+	printf("%-12s %-22s final %6.0f rpm  error %6.1f%%  overshoot %5.1f%%  settling %-12s jitter %lld/%lld us\n",
+		mode, scenario.name, stats.finalRpm,
+		(stats.finalRpm - stats.targetRpm) * 100.0f / stats.targetRpm, stats.overshootPct, settling,
+		(long long)(stats.meanJitterNs / 1000), (long long)(stats.maxJitterNs / 1000));
+}
+
+int main() {
+	const float target = 1500.0f;
+	const Scenario scenarios[] = {
+		{ "nominal", nominalMaxRpm / maxPower, 0.0f },
+		{ "loaded", nominalMaxRpm / maxPower, 400.0f },
+		{ "supply at 80%", 0.8f * nominalMaxRpm / maxPower, 0.0f },
+		{ "loaded, 80% supply", 0.8f * nominalMaxRpm / maxPower, 400.0f },
+	};
+
+	printf("step to %.0f rpm, %d ms control tick\n", target, CONTROL_TICK_MS);
+	for (const Scenario& scenario : scenarios) {
+		report("open loop", scenario, run(scenario, target, false));
+		report("closed loop", scenario, run(scenario, target, true));
+	}
+	return 0;
+}
@@ -1,19 +1,173 @@
 #include "MotorServer.h"
+#include "SimGpioBackend.h"
+#include "Logger.h"
+#include "RealTime.h"
+#include "Journal.h"
 
-int main() {
-	if (wiringPiSetupGpio() == -1) {
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+
+static MotorServer* activeServer = nullptr;
+
+/// Stops the server on SIGINT/SIGTERM so sockets are closed cleanly
+static void handleStopSignal(int) {
+	if (activeServer) activeServer->stopServer();
+}
+
+int main(int argc, char* argv[]) {
+	static SimGpioBackend simBackend;
+	std::string bindAddress;
+	std::vector<MotorPins> motorPins;
+	RealTimeConfig realTime = defaultRealTimeConfig();
+	std::string journalPath;
+	size_t journalSize = JOURNAL_DEFAULT_SIZE;
+	bool simulated = false;
+	double simSpeed = 1.0;
+	int simDriveMode = -1;
+	SimMotorParams simMotor;
+	int pwmFrequency = PWM_DEFAULT_FREQUENCY;
+	int pwmBits = PWM_DEFAULT_BITS;
+	int pulsesPerRevolution = defaultPulsesPerRevolution;
+	MulticastConfig multicast;
+	
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--sim") {
+			// Run without hardware, e.g. for profiling on a plain Linux box
+			setGpioBackend(&simBackend);
+			simulated = true;
+		}
+		else if (arg == "--sim-speed" && i + 1 < argc) {
+			// Virtual time per real time, e.g. 20 runs a 10 minute scenario in 30 s
+			simSpeed = atof(argv[++i]);
+		}
+		else if (arg == "--sim-drive" && i + 1 < argc) {
+			// edges follows the pins; average follows the PWM duty and is the default above x1
+			std::string mode = argv[++i];
+			if (mode == "edges") simDriveMode = simDriveEdges;
+			else if (mode == "average") simDriveMode = simDriveAverage;
+			else LOG_WARN(logServer, "Unknown --sim-drive '%s'", argv[i]);
+		}
+		else if (arg == "--sim-motor" && i + 1 < argc) {
+			// e.g. --sim-motor load=0.01,J=2e-5 ; keys are V, R, L, Ke, J, b, load
+			if (!parseSimMotorParams(argv[++i], simMotor)) LOG_WARN(logServer, "Bad --sim-motor parameters '%s'", argv[i]);
+		}
+		else if (arg == "--bind" && i + 1 < argc) {
+			bindAddress = argv[++i];
+		}
+		else if (arg == "--motor" && i + 1 < argc) {
+			// --motor <cw pin>,<ccw pin>,<sensor pin>, once per motor; ids follow the order
+			MotorPins pins;
+			char end;
+			if (sscanf(argv[++i], "%d,%d,%d%c", &pins.cw, &pins.ccw, &pins.sensor, &end) == 3) motorPins.push_back(pins);
+			else LOG_WARN(logServer, "Bad --motor pins '%s'", argv[i]);
+		}
+		else if (arg == "--pwm-freq" && i + 1 < argc) {
+			// Hz, 200 - 20000; a client can change it per motor with FRQ
+			pwmFrequency = atoi(argv[++i]);
+		}
+		else if (arg == "--pwm-bits" && i + 1 < argc) {
+			// Duty resolution, 1 - 10 bits
+			pwmBits = atoi(argv[++i]);
+		}
+		else if (arg == "--ppr" && i + 1 < argc) {
+			// Sensor edges per motor turn, 1 - 64; a simulated motor pulses as often
+			pulsesPerRevolution = atoi(argv[++i]);
+			if (pulsesPerRevolution < 1 || pulsesPerRevolution > MAX_PULSES_PER_REVOLUTION) {
+				LOG_WARN(logServer, "Bad --ppr '%s'", argv[i]);
+				pulsesPerRevolution = defaultPulsesPerRevolution;
+			}
+		}
+		else if (arg == "--multicast" && i + 1 < argc) {
+			// <address>[:port], a group such as 239.255.77.84 or a broadcast address; port 12348 by default
+			if (!parseMulticastAddress(argv[++i], multicast)) LOG_WARN(logServer, "Bad --multicast address '%s'", argv[i]);
+		}
+		else if (arg == "--multicast-rate" && i + 1 < argc) {
+			// Hz, 100 by default
+			multicast.rateHz = atoi(argv[++i]);
+		}
+		else if (arg == "--multicast-ttl" && i + 1 < argc) {
+			// Router hops a group datagram may cross, 1 by default
+			multicast.ttl = atoi(argv[++i]);
+		}
+		else if (arg == "--multicast-if" && i + 1 < argc) {
+			// Local address to send the group from, e.g. 127.0.0.1 for observers on this host only
+			multicast.interfaceAddress = argv[++i];
+		}
+		else if (arg == "--log-level" && i + 1 < argc) {
+			// trace, debug, info, warn, error or off; debug shows every command step
+			int level = parseLogLevel(argv[++i]);
+			if (level < 0) LOG_WARN(logServer, "Unknown log level '%s'", argv[i]);
+			else logger().setLevel(level);
+		}
+		else if (arg == "--journal" && i + 1 < argc) {
+			// Record speeds, PWM changes and commands to a fixed-size file; read it with motor_journal
+			journalPath = argv[++i];
+		}
+		else if (arg == "--journal-size" && i + 1 < argc) {
+			// In MiB, fixed for the life of the file; another size starts it afresh
+			int mib = atoi(argv[++i]);
+			if (mib <= 0) LOG_WARN(logServer, "Bad journal size '%s'", argv[i]);
+			else journalSize = (size_t)mib * 1024 * 1024;
+		}
+		else if (arg == "--rt") {
+			// Lock memory and give the timing-critical threads FIFO priorities and CPUs
+			realTime.enabled = true;
+		}
+		else if (arg == "--rt-no-mlock") {
+			realTime.lockMemory = false;
+		}
+		else if ((arg == "--rt-prio" || arg == "--rt-cpu") && i + 1 < argc) {
+			// e.g. --rt-cpu pwm:3,monitor:2 ; roles are pwm, monitor, control, network, logging
+			int* values = arg == "--rt-prio" ? realTime.priority : realTime.cpu;
+			if (!parseRoleList(argv[++i], values)) LOG_WARN(logServer, "Bad %s list '%s'", arg.c_str(), argv[i]);
+		}
+	}
+	
+	// Before any thread starts, so every thread picks its role settings up
+	// and reads the simulated clock at its final rate
+	if (simulated && !simBackend.setTimeScale(simSpeed)) LOG_WARN(logServer, "Bad --sim-speed '%g'", simSpeed);
+	setupRealTime(realTime);
+	logger().start();
+	if (!journalPath.empty()) journal().open(journalPath, journalSize);
+	
+	if (gpio().setup() == -1) {
         // Initialization failed
-		std::cerr<<"GPIO init failed.\n";
+		LOG_ERROR(logServer, "GPIO init failed.");
+		logger().stop();
 		return 1;
     }
     
-	MotorServer server;
+	if (motorPins.empty()) motorPins.push_back(defaultMotorPins);
+	if (simulated) {
+		// One model per motor, driven by its H-bridge pins and pulsing its sensor pin
+		if (simDriveMode < 0) simDriveMode = simBackend.getTimeScale() > 1.0 ? simDriveAverage : simDriveEdges;
+		simBackend.setDriveMode((simDrive)simDriveMode);
+		simMotor.pulsesPerRevolution = pulsesPerRevolution;
+		for (const MotorPins& pins : motorPins) simBackend.attachMotor(simMotor, pins.cw, pins.ccw, pins.sensor);
+		simBackend.startSimulation();
+		LOG_INFO(logServer, "GPIO simulated, %zu motor(s) driven by %s, clock x%g.", simBackend.motorCount(),
+			simDriveMode == simDriveAverage ? "PWM duty" : "pin edges", simBackend.getTimeScale());
+	}
+	MotorServer server(motorPins);
+	if (!bindAddress.empty()) server.bindAddress = bindAddress;
+	server.pwmFrequency = pwmFrequency;
+	server.pwmBits = pwmBits;
+	server.pulsesPerRevolution = pulsesPerRevolution;
+	server.multicast = multicast;
+	
+	activeServer = &server;
+	std::signal(SIGINT, handleStopSignal);
+	std::signal(SIGTERM, handleStopSignal);
+	
 	server.startServer();
 	
-	while(true) {
-		delay(1000);
-		std::cerr << "Server finished.\n";
-	}
+	activeServer = nullptr;
+	simBackend.stopSimulation();
+	journal().sync();
+	LOG_INFO(logServer, "Server finished.");
+	logger().stop();
 	
 	return 0;
 }
@@ -0,0 +1,267 @@
+// Reads the event journal the server writes with --journal, offline or
+// while the server is running, and exports or replays a time range.
+//
+//   motor_journal <file> info
+//   motor_journal <file> export [options]
+//   motor_journal <file> replay [options] [--speed <factor>]
+//
+// Options:
+//   --from <t>, --to <t>   Unix time in seconds; negative values count back
+//                          from the newest event
+//   --type <rpm|duty|command>, --motor <id>
+//   --format <csv|bin>     CSV (default) or the journal's 32-byte records
+//   -o <file>              write there instead of stdout
+//
+// A binary export is read back like a journal, so it can be replayed or
+// filtered again. Replay writes the events at the pace they were recorded,
+// scaled by --speed.
+//
+//   cmake --build <build dir> --target motor_journal
+
+#include "Journal.h"
+#include "CommandParser.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <vector>
+
+struct JournalFilter {
+	double fromS = -1e18;
+	double toS = 1e18;
+	int type = 0;		// 0 = every event
+	int motor = -1;		// -1 = every motor
+};
+
+static const char* commandName(int cmd) {
+	for (const CommandSpec& spec : COMMAND_TABLE) {
+		if (spec.cmd == cmd) return spec.name.data();
+	}
+	return "none";
+}
+
+static int parseEventName(const char* name) {
+	for (int type = journalRpm; type <= journalCommand; type++) {
+		if (strcmp(name, journalEventName((uint8_t)type)) == 0) return type;
+	}
+	return -1;
+}
+
+//  READING ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+/// Loads the complete records of a journal or binary export in sequence
+/// order. 'torn' counts slots whose write did not finish.
+static bool loadRecords(const char* path, std::vector<JournalRecord>& out, uint64_t& torn, bool& isJournal) {
+	FILE* file = fopen(path, "rb");
+	if (!file) {
+		perror(path);
+		return false;
+	}
+	std::vector<char> data;
+	char chunk[65536];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) data.insert(data.end(), chunk, chunk + n);
+	fclose(file);
+
+	torn = 0;
+	isJournal = data.size() >= JOURNAL_HEADER_SIZE && memcmp(data.data(), JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) == 0;
+
+	const char* first = data.data();
+	size_t count = data.size() / sizeof(JournalRecord);
+	uint64_t next = UINT64_MAX;
+	uint64_t capacity = UINT64_MAX;
+	if (isJournal) {
+		// The header is only read through plain fields here
+		uint32_t version, recordSize;
+		memcpy(&version, first + offsetof(JournalHeader, version), sizeof(version));
+		memcpy(&recordSize, first + offsetof(JournalHeader, recordSize), sizeof(recordSize));
+		memcpy(&capacity, first + offsetof(JournalHeader, capacity), sizeof(capacity));
+		memcpy(&next, first + offsetof(JournalHeader, nextSequence), sizeof(next));
+		if (version != JOURNAL_VERSION || recordSize != sizeof(JournalRecord)) {
+			fprintf(stderr, "%s: journal version %u with %u-byte records is not supported\n", path, version, recordSize);
+			return false;
+		}
+		first += JOURNAL_HEADER_SIZE;
+		count = std::min<uint64_t>(capacity, (data.size() - JOURNAL_HEADER_SIZE) / sizeof(JournalRecord));
+	}
+	else if (data.size() % sizeof(JournalRecord) != 0) {
+		fprintf(stderr, "%s: neither a journal nor a binary export\n", path);
+		return false;
+	}
+
+	out.clear();
+	out.reserve(count);
+	for (size_t i = 0; i < count; i++) {
+		JournalRecord record;
+		memcpy(&record, first + i * sizeof(JournalRecord), sizeof(record));
+		if (record.sequence == 0) continue;
+		if (journalRecordValid(record, next, capacity)) out.push_back(record);
+		else if (record.check != (uint32_t)record.sequence) torn++;
+	}
+	std::sort(out.begin(), out.end(), [](const JournalRecord& a, const JournalRecord& b) {
+		return a.sequence < b.sequence;
+	});
+	return true;
+}
+
+static bool matches(const JournalRecord& record, const JournalFilter& filter) {
+	double timeS = record.timeNs / 1e9;
+	if (timeS < filter.fromS || timeS > filter.toS) return false;
+	if (filter.type && record.type != filter.type) return false;
+	if (filter.motor >= 0 && record.motor != filter.motor) return false;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//  OUTPUT  ////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+static void writeCsvHeader(FILE* out) {
+	fprintf(out, "sequence,time,event,motor,rpm,pin,on_us,period_us,duty,command,stage,speed,duration\n");
+}
+
+/// One row per event; columns that do not apply to it stay empty
+static void writeCsv(FILE* out, const JournalRecord& record) {
+	fprintf(out, "%llu,%lld.%09lld,%s,%u,", (unsigned long long)record.sequence,
+		(long long)(record.timeNs / 1000000000LL), (long long)(record.timeNs % 1000000000LL),
+		journalEventName(record.type), record.motor);
+
+	switch (record.type) {
+	case journalRpm:
+		fprintf(out, "%.2f,,,,,,,,\n", record.rpm);
+		break;
+	case journalDuty:
+		if (record.code == 0xFFFF) {
+			fprintf(out, ",,,,0,,,,\n");
+		}
+		else {
+			double duty = record.duty.periodNs ? (double)record.duty.onNs / record.duty.periodNs : 0.0;
+			fprintf(out, ",%u,%.3f,%.3f,%.4f,,,,\n", record.code, record.duty.onNs / 1000.0,
+				record.duty.periodNs / 1000.0, duty);
+		}
+		break;
+	case journalCommand:
+		fprintf(out, ",,,,,%s,%s,%g,%g\n", commandName(record.code & 0xFF),
+			journalStageName((uint8_t)(record.code >> 8)), record.command.speed, record.command.duration);
+		break;
+	default:
+		fprintf(out, ",,,,,,,,\n");
+		break;
+	}
+}
+
+static void writeRecord(FILE* out, const JournalRecord& record, bool binary) {
+	if (binary) fwrite(&record, sizeof(record), 1, out);
+	else writeCsv(out, record);
+}
+
+static void printInfo(const char* path, const std::vector<JournalRecord>& records, uint64_t torn, bool isJournal) {
+	printf("%s: %s, %zu events, %llu torn\n", path, isJournal ? "journal" : "binary export",
+		records.size(), (unsigned long long)torn);
+	if (records.empty()) return;
+
+	uint64_t perType[journalCommand + 1] = {};
+	for (const JournalRecord& record : records) {
+		if (record.type <= journalCommand) perType[record.type]++;
+	}
+	printf("sequence %llu..%llu\n", (unsigned long long)records.front().sequence,
+		(unsigned long long)records.back().sequence);
+	printf("time     %.3f..%.3f (%.3f s)\n", records.front().timeNs / 1e9, records.back().timeNs / 1e9,
+		(records.back().timeNs - records.front().timeNs) / 1e9);
+	for (int type = journalRpm; type <= journalCommand; type++) {
+		printf("%-8s %llu\n", journalEventName((uint8_t)type), (unsigned long long)perType[type]);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+
+static int usage() {
+	fprintf(stderr, "usage: motor_journal <file> info|export|replay [--from t] [--to t] [--type rpm|duty|command]\n"
+		"                     [--motor id] [--format csv|bin] [--speed factor] [-o file]\n");
+	return 2;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 3) return usage();
+	const char* path = argv[1];
+	std::string mode = argv[2];
+	if (mode != "info" && mode != "export" && mode != "replay") return usage();
+
+	JournalFilter filter;
+	const char* fromArg = nullptr;
+	const char* toArg = nullptr;
+	const char* outPath = nullptr;
+	bool binary = false;
+	double speed = 1.0;
+
+	for (int i = 3; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) return usage();
+		const char* value = argv[++i];
+		if (arg == "--from") fromArg = value;
+		else if (arg == "--to") toArg = value;
+		else if (arg == "--motor") filter.motor = atoi(value);
+		else if (arg == "--speed") speed = atof(value);
+		else if (arg == "-o") outPath = value;
+		else if (arg == "--type") {
+			filter.type = parseEventName(value);
+			if (filter.type < 0) return usage();
+		}
+		else if (arg == "--format") {
+			if (strcmp(value, "csv") != 0 && strcmp(value, "bin") != 0) return usage();
+			binary = strcmp(value, "bin") == 0;
+		}
+		else return usage();
+	}
+	if (speed <= 0.0) return usage();
+
+	std::vector<JournalRecord> records;
+	uint64_t torn;
+	bool isJournal;
+	if (!loadRecords(path, records, torn, isJournal)) return 1;
+
+	if (mode == "info") {
+		printInfo(path, records, torn, isJournal);
+		return 0;
+	}
+
+	// Negative times are relative to the newest event
+	double newestS = records.empty() ? 0.0 : records.back().timeNs / 1e9;
+	if (fromArg) filter.fromS = atof(fromArg) < 0 ? newestS + atof(fromArg) : atof(fromArg);
+	if (toArg) filter.toS = atof(toArg) < 0 ? newestS + atof(toArg) : atof(toArg);
+
+	FILE* out = outPath ? fopen(outPath, binary ? "wb" : "w") : stdout;
+	if (!out) {
+		perror(outPath);
+		return 1;
+	}
+	if (!binary) writeCsvHeader(out);
+
+	bool replay = mode == "replay";
+	auto start = std::chrono::steady_clock::now();
+	int64_t firstNs = -1;
+	size_t written = 0;
+	for (const JournalRecord& record : records) {
+		if (!matches(record, filter)) continue;
+
+		if (replay) {
+			if (firstNs < 0) firstNs = record.timeNs;
+			auto due = start + std::chrono::nanoseconds((int64_t)((record.timeNs - firstNs) / speed));
+			fflush(out);
+			std::this_thread::sleep_until(due);
+		}
+		writeRecord(out, record, binary);
+		written++;
+	}
+
+	if (out != stdout) fclose(out);
+	else fflush(out);
+	fprintf(stderr, "%zu of %zu events\n", written, records.size());
+	return 0;
+}
@@ -0,0 +1,221 @@
+// Joins the UDP telemetry the server sends with --multicast, as one more
+// passive observer, and checks the frame sequence for gaps.
+//
+//   telemetry_listen [--group <address>] [--port <port>] [--if <address>]
+//                    [--seconds <n>] [--print]
+//
+// Options:
+//   --group <address>   multicast group to join (default 239.255.77.84); a
+//                       broadcast or unicast address is only listened on
+//   --port <port>       default 12348
+//   --if <address>      local interface to join on, e.g. 127.0.0.1 to
+//                       follow a server on this host
+//   --seconds <n>       stop after n seconds; runs until Ctrl-C otherwise
+//   --print             print every frame
+//
+// A report goes to stderr every second and a summary at the end. Frames
+// lost on the way or dropped by the server leave a gap in the sequence;
+// late or repeated frames count as out of order. A sequence that falls far
+// back is taken as a server restart. Several listeners can run at once.
+// Exits with 2 if any frames were lost, so a script can check a run.
+//
+//   cmake --build <build dir> --target telemetry_listen
+
+#include "Telemetry.h"
+#include "TelemetryMulticast.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+constexpr uint32_t RESTART_DISTANCE = 1u << 20;	// a sequence further back than this is a new server
+
+/// What arrived and what the sequence says is missing
+struct ListenStats {
+	uint64_t datagrams = 0;
+	uint64_t frames = 0;
+	uint64_t invalid = 0;		// wrong magic or size
+	uint64_t lost = 0;			// sequence numbers skipped over
+	uint64_t gaps = 0;
+	uint64_t outOfOrder = 0;	// behind the expected sequence: late or repeated
+	uint64_t restarts = 0;
+};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void handleStopSignal(int) {
+	stopRequested = 1;
+}
+
+static int64_t steadyNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// Follows the sequence. 'expected' is the next number wanted; anything
+/// ahead of it leaves a gap, anything a little behind is late.
+static void checkSequence(ListenStats& stats, bool& started, uint32_t& expected, uint32_t sequence) {
+	if (!started) {
+		started = true;
+		expected = sequence + 1;
+		return;
+	}
+	uint32_t ahead = sequence - expected;
+	if (ahead == 0) {
+		expected++;
+	}
+	else if (ahead < 0x80000000u) {
+		stats.lost += ahead;
+		stats.gaps++;
+		expected = sequence + 1;
+	}
+	else if (expected - sequence > RESTART_DISTANCE) {
+		stats.restarts++;
+		expected = sequence + 1;
+	}
+	else {
+		stats.outOfOrder++;
+	}
+}
+
+static void report(FILE* out, const char* label, const ListenStats& stats) {
+	double lossPct = stats.frames + stats.lost ? 100.0 * stats.lost / (stats.frames + stats.lost) : 0.0;
+	fprintf(out, "%s frames %llu in %llu datagrams, lost %llu in %llu gaps (%.3f%%), out of order %llu, invalid %llu, restarts %llu\n",
+		label, (unsigned long long)stats.frames, (unsigned long long)stats.datagrams, (unsigned long long)stats.lost,
+		(unsigned long long)stats.gaps, lossPct, (unsigned long long)stats.outOfOrder, (unsigned long long)stats.invalid,
+		(unsigned long long)stats.restarts);
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [--group <address>] [--port <port>] [--if <address>] [--seconds <n>] [--print]\n", name);
+}
+
+int main(int argc, char* argv[]) {
+	std::string group = TELEMETRY_MULTICAST_GROUP;
+	std::string interfaceAddress;
+	int port = TELEMETRY_MULTICAST_PORT;
+	double seconds = 0;
+	bool print = false;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--group" && i + 1 < argc) group = argv[++i];
+		else if (arg == "--port" && i + 1 < argc) port = atoi(argv[++i]);
+		else if (arg == "--if" && i + 1 < argc) interfaceAddress = argv[++i];
+		else if (arg == "--seconds" && i + 1 < argc) seconds = atof(argv[++i]);
+		else if (arg == "--print") print = true;
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	in_addr groupAddr, localAddr;
+	localAddr.s_addr = htonl(INADDR_ANY);
+	if (inet_pton(AF_INET, group.c_str(), &groupAddr) != 1
+			|| (!interfaceAddress.empty() && inet_pton(AF_INET, interfaceAddress.c_str(), &localAddr) != 1)
+			|| port < 1 || port > 65535) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return 1;
+	}
+	// Every listener on this host binds the same port
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+	int bufferSize = 1 << 20;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+	sockaddr_in bindAddr = {};
+	bindAddr.sin_family = AF_INET;
+	bindAddr.sin_port = htons(port);
+	bindAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(fd, (sockaddr*)&bindAddr, sizeof(bindAddr)) < 0) {
+		perror("bind");
+		close(fd);
+		return 1;
+	}
+	if (IN_MULTICAST(ntohl(groupAddr.s_addr))) {
+		ip_mreq membership;
+		membership.imr_multiaddr = groupAddr;
+		membership.imr_interface = localAddr;
+		if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) {
+			perror("join group");
+			close(fd);
+			return 1;
+		}
+	}
+	fprintf(stderr, "listening on %s:%d\n", group.c_str(), port);
+
+	std::signal(SIGINT, handleStopSignal);
+	std::signal(SIGTERM, handleStopSignal);
+
+	ListenStats stats, lastReport;
+	bool started = false;
+	uint32_t expected = 0;
+	int64_t start = steadyNs();
+	int64_t nextReport = start + 1000000000LL;
+	int64_t end = seconds > 0 ? start + (int64_t)(seconds * 1e9) : INT64_MAX;
+	TelemetryFrame frames[TELEMETRY_DATAGRAM_FRAMES];
+
+	while (!stopRequested) {
+		int64_t now = steadyNs();
+		if (now >= end) break;
+		if (now >= nextReport) {
+			ListenStats delta = stats;
+			delta.datagrams -= lastReport.datagrams;
+			delta.frames -= lastReport.frames;
+			delta.invalid -= lastReport.invalid;
+			delta.lost -= lastReport.lost;
+			delta.gaps -= lastReport.gaps;
+			delta.outOfOrder -= lastReport.outOfOrder;
+			delta.restarts -= lastReport.restarts;
+			report(stderr, "last second:", delta);
+			lastReport = stats;
+			nextReport += 1000000000LL;
+		}
+
+		pollfd waitFor = { fd, POLLIN, 0 };
+		int64_t waitNs = std::min(nextReport, end) - now;
+		if (poll(&waitFor, 1, (int)(waitNs / 1000000) + 1) <= 0) continue;
+
+		ssize_t received = recv(fd, frames, sizeof(frames), 0);
+		if (received < 0) continue;
+		stats.datagrams++;
+
+		size_t count = received / sizeof(TelemetryFrame);
+		if (received % sizeof(TelemetryFrame)) stats.invalid++;
+		for (size_t i = 0; i < count; i++) {
+			const TelemetryFrame& frame = frames[i];
+			if (frame.magic != TELEMETRY_MAGIC || frame.size != sizeof(TelemetryFrame)) {
+				stats.invalid++;
+				continue;
+			}
+			stats.frames++;
+			checkSequence(stats, started, expected, frame.sequence);
+			if (print) {
+				printf("%u %lld.%06lld %u %.2f %.4f %s\n", frame.sequence, (long long)(frame.timestampNs / 1000000000LL),
+					(long long)(frame.timestampNs % 1000000000LL / 1000), frame.motor, frame.rpm, frame.duty / 65535.0,
+					frame.direction == dirCW ? "cw" : frame.direction == dirCCW ? "ccw" : "stop");
+			}
+		}
+	}
+
+	report(stderr, "total:", stats);
+	close(fd);
+	return stats.lost ? 2 : 0;
+}